@@ -39,7 +39,7 @@ if %errorlevel% neq 0 (
 )
 
 echo Linking my.exe...
-gcc -o my.exe my.o -lws2_32 -ladvapi32
+gcc -o my.exe my.o -lws2_32 -ladvapi32 -lmswsock -liphlpapi -lpsapi
 if %errorlevel% neq 0 (
     echo Linking failed!
     exit /b 1
@@ -73,7 +73,7 @@ if %errorlevel% neq 0 (
 )
 
 echo Linking my.exe...
-link /nologo /OUT:my.exe my.obj ws2_32.lib advapi32.lib
+link /nologo /OUT:my.exe my.obj ws2_32.lib advapi32.lib mswsock.lib iphlpapi.lib psapi.lib
 if %errorlevel% neq 0 (
     echo Linking failed!
     exit /b 1
@@ -3,34 +3,195 @@
 
 #include <windows.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <mswsock.h>
+#include <mstcpip.h>
+#include <iphlpapi.h>
+#define PSAPI_VERSION 2         // GetProcessMemoryInfo is GetProcessMemoryInfo; psapi.lib for older SDKs
+#include <psapi.h>
+#include <sddl.h>
 #include <tchar.h>
 
+#if !defined(NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define HAVE_SSE2 1
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+static __inline int CountTrailingZeros(unsigned int x) {
+    unsigned long index;
+    _BitScanForward(&index, x);
+    return (int)index;
+}
+#else
+#define CountTrailingZeros(x) __builtin_ctz(x)
+#endif
+#endif
+
 #pragma comment(lib, "ws2_32.lib")
 #pragma comment(lib, "advapi32.lib")
+#pragma comment(lib, "mswsock.lib")
+#pragma comment(lib, "iphlpapi.lib")
+#pragma comment(lib, "psapi.lib")
 
-#define BUFSIZE 4096
+#define BUFSIZE 4096            // transcoding step and client-side buffers
+#define RELAY_MIN_BUFFER 1024   // smallest relay chunk
+#define RELAY_MAX_BUFFER (256 * 1024)
+#define RELAY_CLASSES 9         // chunk sizes RELAY_MIN_BUFFER..RELAY_MAX_BUFFER, powers of two
+#define RELAY_POOL_KEEP 4       // free chunks a worker keeps per size
+#define RELAY_PIPE_SIZE (64 * 1024) // shell pipes: let cmd.exe run ahead of the relay
+#define SESSION_PEEK_SIZE 128   // idle pipe read, inline in the session
+#define SESSION_SLAB 64         // sessions allocated together
 #define DEFAULT_PORT 9999
+#define MAX_LISTENERS 8         // -listen may be given this many times
+#define MAX_WORKERS 64          // workers, one per processor by default
+#define ACCEPT_ADDR_SIZE (sizeof(SOCKADDR_STORAGE) + 16)
+#define PROBE_INTERVAL_MS 20    // -latency: pause between samples, like typing
+#define PROBE_TIMEOUT_MS 5000
+#define COLDSTART_BUDGET_MS 500 // -coldstart: connect to first prompt with the server not running
+#define WATCH_TEST_LINES 2000   // -watchtest: about 130 KB of output, twice FRAME_MAX_CONTROL
+#define PREDICT_TEST_LINES 20   // -predicttest: commands typed through the echo predictor
+#define TRANSCODE_TEST_SIZE (1024 * 1024) // -transcodetest: bytes of shell output per code page
+#define TRANSCODE_TEST_ROUNDS 20 // -transcodetest: timed passes over the text per scan
+#define LOG_TEST_BURSTS 60      // -logtest: bursts of half a log ring, drained in between (LOG_FLUSH_MS each)
+#define LOG_BUDGET_NS 100       // -logtest: target for one LOG_VAL on the hot path
+#define IDLE_EXIT_DEFAULT 300   // seconds an activated server stays up without sessions
+#define ACTIVATION_RETRY_MS 1000
+#define ACTIVATION_STOP_MS 10000
+#define ACTIVATION_SOCKETS_VAR "RC_LISTEN_SOCKETS" // inherited listener handles, comma-separated
+#define ACTIVATION_STOP_VAR "RC_STOP_EVENT"
+#define FRAME_HEADER_SIZE 4     // type, then payload length (24 bits, little-endian)
+#define FRAME_MAGIC "\0RCF"     // framing hello, sent once by each side
+#define FRAME_MAGIC_SIZE 4
+#define FRAME_MAX_CONTROL (64 * 1024)
+#define WATCH_MIN_INTERVAL_MS 100
+#define WATCH_MAX_OUTPUT (1024 * 1024) // per run; the rest is dropped
+// Largest FRAME_WATCH_DIFF: the transcoded text and 5 bytes per old and new
+// line, each at most one per byte of output. Fits the 24-bit frame length.
+#define WATCH_MAX_UPDATE (8 + RELAY_OUT_SIZE(WATCH_MAX_OUTPUT) + 10 * (WATCH_MAX_OUTPUT + 1))
+#define WATCH_READ_SIZE 4096
+#define WATCH_WINDOW 32         // lines the diff looks ahead for moved text
+#define EXEC_WINDOW (1024 * 1024)   // -pipe input the client may have outstanding
+#define EXEC_WRITE_SIZE (64 * 1024)
+#define EXEC_WRITE_DEPTH 4          // writes kept in flight to the command's stdin
+#define PIPE_CLIENT_BLOCK (256 * 1024)
+#define TIMER_TICK_MS 100       // resolution of the workers' timer wheels
+#define TIMER_BITS 5
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_LEVELS 5          // TIMER_SLOTS^TIMER_LEVELS ticks ahead: 38 days
+#define KEEPALIVE_DEFAULT 30    // seconds of silence before a client is asked for a sign of life
+#define KEEPALIVE_PROBES 3      // unanswered FRAME_PINGs before the client counts as dead
+#define LOCAL_MAGIC "\0RCL"     // instead of FRAME_MAGIC: asks for the local transport
+#define LOCAL_RING_SIZE RELAY_MAX_BUFFER // each direction; a power of two
+#define LOCAL_EVENTS 4
+#define LOCAL_REPLY_SIZE (FRAME_MAGIC_SIZE + 4 + 8 * (1 + LOCAL_EVENTS)) // magic, status, handles
+#define LOCAL_EARLY_SIZE (BUFSIZE * 4) // client: output that may precede the reply
+
+// Logging
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+#define LOG_DEBUG 3
+#define LOG_RING_SIZE 256       // events per thread, power of two
+#define LOG_FLUSH_MS 50
+#define LOG_LINE_MAX 512
+#define DEFAULT_LOG_FILE "RemoteConsole.log"
+
+// message and keys must be string literals: only the pointers are queued
+#define LOG_MSG(level, msg) \
+    LogWrite(level, msg, NULL, 0, NULL, 0, NULL, 0)
+#define LOG_VAL(level, msg, k1, v1) \
+    LogWrite(level, msg, k1, (LONGLONG)(v1), NULL, 0, NULL, 0)
+#define LOG_VAL2(level, msg, k1, v1, k2, v2) \
+    LogWrite(level, msg, k1, (LONGLONG)(v1), k2, (LONGLONG)(v2), NULL, 0)
+#define LOG_VAL3(level, msg, k1, v1, k2, v2, k3, v3) \
+    LogWrite(level, msg, k1, (LONGLONG)(v1), k2, (LONGLONG)(v2), k3, (LONGLONG)(v3))
+
+// Worst case UTF-8 growth: every input byte becomes a 3-byte sequence
+#define UTF8_OUT_SIZE(n) ((n) * 3 + 16)
+// Same for a relay buffer of n bytes transcoded in BUFSIZE steps
+#define RELAY_OUT_SIZE(n) ((n) * 3 + 16 * ((n) / BUFSIZE + 1))
+
+// One queued log record; formatted later by the log thread
+typedef struct {
+    LARGE_INTEGER timestamp;
+    const char* message;
+    const char* keys[3];
+    LONGLONG values[3];
+    DWORD threadId;
+    int level;
+} LogEvent;
+
+// Single-producer/single-consumer ring, one per logging thread
+typedef struct LogRing {
+    volatile LONG head;             // next slot to write (producer)
+    volatile LONG tail;             // next slot to read (log thread)
+    LONG dropped;                   // events lost because the ring was full
+    LONG reportedDrops;             // drops already reported by the log thread
+    volatile LONG owner;            // owning thread id, 0 when free for reuse
+    struct LogRing* volatile next;
+    LogEvent events[LOG_RING_SIZE];
+} LogRing;
+
+typedef struct Session Session;
 
 // Global variables
-HANDLE g_hChildStd_IN_Rd = NULL;
-HANDLE g_hChildStd_IN_Wr = NULL;
-HANDLE g_hChildStd_OUT_Rd = NULL;
-HANDLE g_hChildStd_OUT_Wr = NULL;
-HANDLE g_StopEvent = NULL;
+HANDLE g_StopEvent = NULL;         // stops the whole server
+CRITICAL_SECTION g_SessionLock;     // session slab free list
+volatile LONG g_SessionCount = 0;
+volatile LONG g_NextSessionId = 0;
+BOOL g_Takeover = FALSE;            // -takeover: inherit listener and sessions
+BOOL g_OnDemand = FALSE;            // -ondemand: launcher that starts the server per use
+BOOL g_Activated = FALSE;           // -activated: started by a launcher with its listeners
+DWORD g_IdleExitMs = IDLE_EXIT_DEFAULT * 1000; // -idleexit seconds, activated only; 0 = stay
+volatile LONG g_ActivationServed = 0;
+int g_ServerArgc = 0;               // server options, passed on to an activated server
+char** g_ServerArgv = NULL;
+const char* g_ListenSpecs[MAX_LISTENERS]; // -listen host[:port]; none = dual-stack any
+int g_ListenSpecCount = 0;
+int g_ListenPort = DEFAULT_PORT;    // -port: for specs without a port
+SOCKET g_Listeners[MAX_LISTENERS];
+int g_ListenerFamily[MAX_LISTENERS];
+int g_ListenerCount = 0;
+int g_WorkerCount = 0;              // -workers N; 0 = number of processors
+HANDLE g_AcceptStopEvent = NULL;    // stops the accept threads only (handoff)
+DWORD g_JobCpuWeight = 0;           // -cpuweight 1..9 per session, 0 = not set
+DWORD g_JobMemoryMB = 0;            // -memlimit MB per session, 0 = unlimited
+DWORD g_JobProcessLimit = 0;        // -proclimit N per session, 0 = unlimited
+const char* g_LogPath = NULL;       // -log <file>; NULL = console (or default file for the service)
+DWORD g_KeepaliveMs = KEEPALIVE_DEFAULT * 1000; // -keepalive seconds, 0 = off
+DWORD g_IdleTimeoutMs = 0;          // -idletimeout seconds without input, 0 = none
+DWORD g_SessionLimitMs = 0;         // -sessiontimeout seconds per session, 0 = none
+volatile LONG g_ReapedIdle = 0;     // sessions ended by the server, by reason
+volatile LONG g_ReapedLimit = 0;
+volatile LONG g_ReapedDead = 0;
+
+LogRing* volatile g_LogRings = NULL;
+DWORD g_LogTlsIndex = TLS_OUT_OF_INDEXES;
+volatile LONG g_LogLostEvents = 0;
+int g_LogLevel = LOG_INFO;
+HANDLE g_LogFile = INVALID_HANDLE_VALUE;
+HANDLE g_LogThread = NULL;
+HANDLE g_LogStopEvent = NULL;
+LARGE_INTEGER g_LogFrequency;
+LARGE_INTEGER g_LogStartTicks;
+ULARGE_INTEGER g_LogStartTime;
 
 SERVICE_STATUS g_ServiceStatus = {0};
 SERVICE_STATUS_HANDLE g_ServiceStatusHandle = NULL;
 
+
 // Forward declarations
 void RunServer(BOOL asService);
-void RunClient(const char* serverIP);
-BOOL CreateChildProcessWithPipes(void);
-DWORD WINAPI PipeToSocketThread(LPVOID lpParam);
-DWORD WINAPI SocketToPipeThread(LPVOID lpParam);
-void InstallService(void);
+void RunOnDemand(BOOL asService);
+void RunClient(const char* serverIP, BOOL predictEcho, int latencySamples, BOOL local);
+void RunWatchClient(const char* serverIP, const char* command, double seconds);
+int RunPipeClient(const char* serverIP, const char* command, BOOL local);
+BOOL CreateChildProcessWithPipes(Session* session);
+void InstallService(BOOL onDemand);
 void UninstallService(void);
 void StartMyService(void);
 void StopMyService(void);
@@ -38,28 +199,364 @@ VOID WINAPI ServiceMain(DWORD argc, LPTSTR *argv);
 DWORD WINAPI ServiceCtrlHandler(DWORD dwControl, DWORD dwEventType, LPVOID lpEventData, LPVOID lpContext);
 void SetServiceStatus(DWORD dwCurrentState, DWORD dwWin32ExitCode, DWORD dwWaitHint);
 void ErrorExit(const char* msg);
+BOOL LogInit(const char* path);
+void LogShutdown(void);
+void LogThreadDetach(void);
+void DefaultLogPath(char* path, DWORD size);
+void LogWrite(int level, const char* message,
+              const char* key1, LONGLONG value1,
+              const char* key2, LONGLONG value2,
+              const char* key3, LONGLONG value3);
+
+
+// OEM code page -> UTF-8 conversion of the shell output stream
+typedef struct {
+    UINT codePage;
+    BOOL dbcs;                      // code page has lead bytes (932, 936, 949, 950)
+    unsigned char leadByte;         // DBCS lead byte cut off at the end of a chunk
+    BOOL hasLeadByte;
+    unsigned char high[128][4];     // SBCS: UTF-8 for 0x80..0xFF, [3] = length
+    WCHAR wide[BUFSIZE + 2];
+} OutputTranscoder;
+
+// UTF-8 validation that keeps sequences split across chunks intact
+typedef struct {
+    unsigned char carry[4];
+    int carryLen;
+} Utf8Stream;
+
+// Frames, for clients that open with FRAME_MAGIC; anyone else (telnet) gets
+// the plain byte stream in both directions
+enum {
+    FRAME_DATA = 1,                 // keystrokes for the shell / shell output
+    FRAME_WATCH,                    // client: u32 interval in ms, command (UTF-8)
+    FRAME_WATCH_STOP,               // client: end the watch
+    FRAME_WATCH_DIFF,               // server: what changed since the last update
+    FRAME_WATCH_END,                // server: the watch ended, payload says why
+    FRAME_EXEC,                     // client: run a command (UTF-8) for -pipe
+    FRAME_EXEC_INPUT,               // client: bytes for the command's stdin
+    FRAME_EXEC_EOF,                 // client: no more input
+    FRAME_EXEC_KILL,                // client: stop the command
+    FRAME_EXEC_OUTPUT,              // server: bytes the command wrote
+    FRAME_EXEC_EXIT,                // server: u32 exit code, then a message if it failed
+    FRAME_CREDIT,                   // server: u32 more FRAME_EXEC_INPUT bytes the client may send
+    FRAME_PING,                     // server: the client has been silent, answer with FRAME_PONG
+    FRAME_PONG                      // client: still here
+};
+
+enum { PROTO_UNKNOWN, PROTO_RAW, PROTO_FRAMED };
+
+// Splits a byte stream into frames; see FrameRead()
+typedef struct {
+    unsigned char header[FRAME_HEADER_SIZE];
+    int headerLen;
+    int type;                       // frame being read
+    DWORD remaining;                // its payload bytes still to come
+    char* control;                  // payload of a control frame, collected whole
+    DWORD controlLen;
+    BOOL delivered;                 // control was handed out, free it on the next call
+    BOOL watchClient;               // FRAME_WATCH_DIFF may exceed FRAME_MAX_CONTROL
+} FrameReader;
+
+// Entry on a worker's timer wheel, embedded in what it times
+typedef struct Timer {
+    struct Timer* next;
+    struct Timer** link;            // what points at this timer; NULL while not set
+    ULONGLONG expires;              // tick
+    int level;
+    int kind;                       // TIMER_*
+    void* owner;
+} Timer;
+
+enum { TIMER_SESSION, TIMER_WATCH };
+
+// Hierarchical timer wheel; see "Timers"
+typedef struct {
+    ULONGLONG tick;                 // the tick being run: earlier ones are done
+    Timer* slots[TIMER_LEVELS][TIMER_SLOTS];
+    int counts[TIMER_LEVELS];
+    int count;
+} TimerWheel;
+
+typedef struct Watch Watch;
+typedef struct Exec Exec;
+typedef struct LocalLink LocalLink;
+
+// What a chunk queued for the client came from: once it is sent, more is
+// read from there
+enum { SOURCE_NONE, SOURCE_SHELL, SOURCE_EXEC, SOURCE_LOCAL };
+
+// Relay chunk: raw bytes plus room for their transcoded form. Chunks come
+// from the worker's pool and belong to a session only while a send or a
+// write to the shell is in flight.
+typedef struct RelayChunk {
+    struct RelayChunk* next;        // pool free list
+    DWORD size;                     // bytes in data
+    DWORD length;                   // bytes of out to deliver
+    DWORD offset;                   // bytes of out already delivered
+    int source;                     // SOURCE_*
+    char* out;                      // FRAME_HEADER_SIZE + RELAY_OUT_SIZE(size) bytes
+    char data[1];
+} RelayChunk;
+
+// Overlapped operations of a session, one of each at most
+enum { IO_PIPE_READ, IO_SOCK_SEND, IO_SOCK_RECV, IO_PIPE_WRITE, IO_COUNT,
+       IO_WATCH_READ = IO_COUNT, IO_EXEC_READ, IO_EXEC_WRITE, IO_LOCAL_WATCH };
+
+typedef struct {
+    OVERLAPPED ov;                  // first: completions hand back this pointer
+    int type;                       // IO_*
+    BOOL active;
+    RelayChunk* chunk;              // attached while a send or write is in flight
+} SessionIo;
+
+// One direction of the local transport; see "Local transport". head and
+// tail count the bytes written and read, modulo 2^32; each is stored only
+// by its own side.
+typedef struct {
+    volatile ULONG head;
+    volatile LONG readerWaiting;    // reader asleep: signal its data event
+    char headLine[56];
+    volatile ULONG tail;
+    volatile LONG writerWaiting;    // writer asleep: signal its space event
+    char tailLine[56];
+} LocalRing;
 
-// Structure to pass socket handle to threads
+// Start of the section; the data of toServer and then toClient follows
 typedef struct {
+    ULONG ringSize;
+    volatile LONG closed;           // set by whichever side hangs up first
+    char line[56];
+    LocalRing toServer;
+    LocalRing toClient;
+} LocalShared;
+
+// Which event wakes whom
+enum { LOCAL_SERVER_DATA, LOCAL_SERVER_SPACE, LOCAL_CLIENT_DATA, LOCAL_CLIENT_SPACE };
+
+struct LocalLink {
+    LocalShared* shared;
+    char* toServer;                 // ring data
+    char* toClient;
+    DWORD size;
+    HANDLE hSection;
+    HANDLE events[LOCAL_EVENTS];
+    HANDLE readPacket;              // LOCAL_SERVER_DATA -> io[IO_SOCK_RECV] completes
+    HANDLE writePacket;             // LOCAL_SERVER_SPACE -> io[IO_SOCK_SEND] completes
+    BOOL sending;                   // output goes to the ring: the reply is out
+    SessionIo watch;                // zero-byte receive: the socket only reports the end
+};
+
+// One client connection and its cmd.exe. Only its worker's I/O thread
+// touches it after start; idle, it is this struct and kernel handles.
+struct Session {
+    LONG id;
     SOCKET sock;
-} ThreadParams;
+    HANDLE hStdinWr;                // cmd.exe stdin (server end, overlapped)
+    HANDLE hStdoutRd;               // cmd.exe stdout/stderr (server end, overlapped)
+    HANDLE hProcess;                // cmd.exe
+    HANDLE hJob;                    // job object holding the session's process tree
+    int worker;                     // worker whose I/O thread relays for it
+    SessionIo io[IO_COUNT];
+    int pending;                    // operations in flight
+    BOOL closing;
+    BOOL parking;                   // handoff: finish what is in flight, start nothing
+    int parkedReads;                // 1 << IO_PIPE_READ / IO_SOCK_RECV held back while parking
+    DWORD outHint;                  // next chunk size per direction
+    DWORD inHint;
+    char peek[SESSION_PEEK_SIZE];   // target of the idle pipe read
+    unsigned char outLeadByte;      // transcoder state between chunks and across a handoff
+    BOOL outHasLeadByte;
+    Utf8Stream inCarry;
+    int protocol;                   // PROTO_*, decided by the client's first bytes
+    int helloLen;                   // FRAME_MAGIC bytes matched so far
+    FrameReader frames;             // input of a framed client
+    RelayChunk* sendQueue;          // waiting behind the send in flight
+    RelayChunk* sendQueueTail;
+    Watch* watch;                   // watch running for this client, or NULL
+    Exec* exec;                     // -pipe command, or NULL
+    LocalLink* local;               // rings the data goes through instead of sock, or NULL
+    Timer timer;                    // heartbeat and timeouts
+    ULONGLONG started;              // GetTickCount64(), for -sessiontimeout
+    ULONGLONG lastHeard;            // anything from the client
+    ULONGLONG lastInput;            // anything but FRAME_PONG, for -idletimeout
+    int pings;                      // FRAME_PINGs unanswered
+    LONGLONG bytesOut;              // shell -> client, before transcoding
+    LONGLONG bytesIn;               // client -> shell
+    LONG syscallsOut;               // reads from the pipe and sends
+    LONG syscallsIn;                // recvs and writes to the pipe
+    DWORD peakOut;                  // largest chunk each direction used
+    DWORD peakIn;
+    Session* prev;                  // worker's session list; next also links the slab free list
+    Session* next;
+};
+
+// Handoff control channel: a successor started with -takeover connects to
+// the pipe, the running server duplicates the listening socket and every
+// session's socket, pipes and process into it, and exits once it has acked.
+#define HANDOFF_PIPE_NAME "\\\\.\\pipe\\RemoteConsoleHandoff"
+#define HANDOFF_MAGIC 0x35484352        // "RCH5": released message after the ack
+#define HANDOFF_TIMEOUT_MS 5000
+#define HANDOFF_PARK_MS (HANDOFF_TIMEOUT_MS / 2)   // sends and writes still in flight by then: give up
+#define HANDOFF_RELEASED 0x4c455252         // "RREL": the old process let go, relay now
+
+typedef struct {
+    DWORD magic;
+    DWORD processId;                // successor, target of the duplicated handles
+} HandoffHello;
+
+typedef struct {
+    DWORD magic;
+    DWORD sessionCount;             // HandoffSession records that follow
+    DWORD listenerCount;
+    WSAPROTOCOL_INFOA listeners[MAX_LISTENERS];
+} HandoffHeader;
+
+typedef struct {
+    LONG id;
+    WSAPROTOCOL_INFOA socket;
+    ULONGLONG hStdinWr;             // handle values valid in the successor
+    ULONGLONG hStdoutRd;
+    ULONGLONG hProcess;
+    ULONGLONG hJob;
+    unsigned char outLeadByte;
+    BOOL outHasLeadByte;
+    Utf8Stream inCarry;
+    int protocol;
+    int helloLen;
+    unsigned char frameHeader[FRAME_HEADER_SIZE];   // frame being received
+    int frameHeaderLen;
+    int frameType;
+    DWORD frameRemaining;
+    ULONGLONG started;              // GetTickCount64() counts from boot, so it carries over
+    ULONGLONG lastInput;
+    ULONGLONG localSection;         // 0: the session runs over its socket
+    ULONGLONG localEvents[LOCAL_EVENTS];
+} HandoffSession;
+
+// UTF-8 -> OEM code page conversion of the client input stream
+typedef struct {
+    UINT codePage;
+    Utf8Stream utf8;
+    char utf8Buffer[UTF8_OUT_SIZE(BUFSIZE)];
+    WCHAR wide[UTF8_OUT_SIZE(BUFSIZE)];
+} InputTranscoder;
+
+// Predictive local echo state (client, -predict).
+// Typed characters are shown immediately; bytes already sent to the server
+// stay "unconfirmed" until cmd.exe echoes them back, the line being edited
+// is shown after them and has not been sent yet.
+typedef struct {
+    HANDLE hConsole;
+    char sent[BUFSIZE];     // sent, shown locally, waiting for server echo
+    int sentPos;            // first unconfirmed byte in sent[]
+    int sentLen;
+    char line[BUFSIZE];     // typed but not sent yet
+    int lineLen;
+    COORD anchor;           // screen position of the first predicted byte
+    DWORD confirmed;        // predicted bytes matched by server echo
+    DWORD rolledBack;       // predicted bytes discarded as mispredictions
+} EchoPredictor;
+
+// -load settings
+typedef struct {
+    const char* serverIP;
+    int clients;
+    int seconds;
+    int keysPerSecond;          // 0 = send each command in one piece
+    int mix[3];                 // weights of echo, dir, burst
+    int burstKB;
+    int thinkMs;                // pause between commands
+    double p99BudgetMs;         // exit code 2 when echo p99 exceeds it
+    BOOL storm;                 // only connect and disconnect, as fast as possible
+    BOOL idle;                  // open the clients, stay silent, report server memory
+    BOOL coldStart;             // time to the first prompt, cold and warm
+    double budgetMs;            // -coldstart: exit code 2 when the cold start exceeds it
+    BOOL watchTest;             // a watched command whose output is larger than a control frame
+    BOOL predictTest;           // the -predict echo predictor, scripted and against the server
+    BOOL transcodeTest;         // SSE2 and scalar transcoding compared, no server needed
+    BOOL logTest;               // cost of one LOG_VAL against LOG_BUDGET_NS, no server needed
+    BOOL tcp;                   // stay on TCP with a local server
+} LoadConfig;
+
+int RunLoadTest(const LoadConfig* config);
 
 int main(int argc, char* argv[]) {
     if (argc < 2) {
         printf("Usage:\n");
-        printf("  Server mode:              my.exe -s\n");
-        printf("  Server as service:        my.exe -s -service\n");
-        printf("  Install service:          my.exe -install\n");
+        printf("  Server mode:              my.exe -s [-log file] [-takeover] [-listen host[:port]]... [-port N] [-workers N]\n");
+        printf("                            -takeover: replace the running server, keeping its sessions\n");
+        printf("                            [-cpuweight 1-9] [-memlimit MB] [-proclimit N]: per-session limits\n");
+        printf("                            [-keepalive S] [-idletimeout S] [-sessiontimeout S]: dead-client\n");
+        printf("                            check after S s of silence (default 30, 0 = off), session time limits\n");
+        printf("  Server on demand:         my.exe -s -ondemand [-idleexit S] [server options]\n");
+        printf("                            holds the listeners, starts the server at the first connection;\n");
+        printf("                            it exits after S s without sessions (default 300, 0 = stays)\n");
+        printf("  Server as service:        my.exe -s -service [-ondemand] [-log file]\n");
+        printf("                            (service default: RemoteConsole.log next to my.exe)\n");
+        printf("  Install service:          my.exe -install [-ondemand]\n");
         printf("  Uninstall service:        my.exe -uninstall\n");
         printf("  Start service:            my.exe -start\n");
         printf("  Stop service:             my.exe -stop\n");
-        printf("  Client mode:              my.exe -c [server_ip]\n");
+        printf("  Client mode:              my.exe -c [server[:port]] [-predict]\n");
         printf("                            (default: 127.0.0.1)\n");
+        printf("                            -predict: local echo for high-latency links\n");
+        printf("  Latency probe:            my.exe -c [server_ip] -latency N [-tcp]\n");
+        printf("  Watch a command:          my.exe -c [server[:port]] -watch seconds \"command\"\n");
+        printf("  Pipe through a command:   my.exe -c [server[:port]] -pipe \"command\" [-tcp] < input > output\n");
+        printf("  Load test:                my.exe -load [server_ip] [-clients N] [-seconds S] [-rate keys/s]\n");
+        printf("                            [-mix echo,dir,burst] [-burst KB] [-think ms] [-p99 ms] [-storm] [-idle] [-tcp]\n");
+        printf("                            -latency, -pipe and -load use shared memory with a server on this\n");
+        printf("                            host; -tcp keeps them on the socket\n");
+        printf("  Cold start:               my.exe -load [server_ip] -coldstart [-budget ms]\n");
+        printf("  Large watch update:       my.exe -load [server_ip] -watchtest\n");
+        printf("  Predictive echo:          my.exe -load [server_ip] -predicttest\n");
+        printf("  Transcoding:              my.exe -load -transcodetest\n");
+        printf("  Logging hot path:         my.exe -load -logtest\n");
         return 1;
     }
 
     if (strcmp(argv[1], "-s") == 0) {
-        if (argc > 2 && strcmp(argv[2], "-service") == 0) {
+        BOOL asService = FALSE;
+        int i;
+        g_ServerArgc = argc - 2;
+        g_ServerArgv = argv + 2;
+        for (i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "-service") == 0)
+                asService = TRUE;
+            else if (strcmp(argv[i], "-ondemand") == 0)
+                g_OnDemand = TRUE;
+            else if (strcmp(argv[i], "-activated") == 0)
+                g_Activated = TRUE;
+            else if (strcmp(argv[i], "-idleexit") == 0 && i + 1 < argc)
+                g_IdleExitMs = (DWORD)atoi(argv[++i]) * 1000;
+            else if (strcmp(argv[i], "-log") == 0 && i + 1 < argc)
+                g_LogPath = argv[++i];
+            else if (strcmp(argv[i], "-takeover") == 0)
+                g_Takeover = TRUE;
+            else if (strcmp(argv[i], "-listen") == 0 && i + 1 < argc) {
+                if (g_ListenSpecCount < MAX_LISTENERS)
+                    g_ListenSpecs[g_ListenSpecCount++] = argv[i + 1];
+                i++;
+            }
+            else if (strcmp(argv[i], "-port") == 0 && i + 1 < argc)
+                g_ListenPort = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-workers") == 0 && i + 1 < argc)
+                g_WorkerCount = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-cpuweight") == 0 && i + 1 < argc)
+                g_JobCpuWeight = (DWORD)atoi(argv[++i]);
+            else if (strcmp(argv[i], "-memlimit") == 0 && i + 1 < argc)
+                g_JobMemoryMB = (DWORD)atoi(argv[++i]);
+            else if (strcmp(argv[i], "-proclimit") == 0 && i + 1 < argc)
+                g_JobProcessLimit = (DWORD)atoi(argv[++i]);
+            else if (strcmp(argv[i], "-keepalive") == 0 && i + 1 < argc)
+                g_KeepaliveMs = (DWORD)atoi(argv[++i]) * 1000;
+            else if (strcmp(argv[i], "-idletimeout") == 0 && i + 1 < argc)
+                g_IdleTimeoutMs = (DWORD)atoi(argv[++i]) * 1000;
+            else if (strcmp(argv[i], "-sessiontimeout") == 0 && i + 1 < argc)
+                g_SessionLimitMs = (DWORD)atoi(argv[++i]) * 1000;
+        }
+        if (asService) {
             // Run as service
             SERVICE_TABLE_ENTRY ServiceTable[] = {
                 {TEXT("RemoteConsoleService"), (LPSERVICE_MAIN_FUNCTION)ServiceMain},
@@ -69,17 +566,102 @@ int main(int argc, char* argv[]) {
                 printf("StartServiceCtrlDispatcher failed (%d)\n", GetLastError());
                 return 1;
             }
+        } else if (g_OnDemand) {
+            RunOnDemand(FALSE);
         } else {
             // Run as console application
             RunServer(FALSE);
         }
     }
     else if (strcmp(argv[1], "-c") == 0) {
-        const char* serverIP = (argc > 2) ? argv[2] : "127.0.0.1";
-        RunClient(serverIP);
+        const char* serverIP = "127.0.0.1";
+        BOOL predictEcho = FALSE;
+        int latencySamples = 0;
+        const char* watchCommand = NULL;
+        const char* pipeCommand = NULL;
+        double watchSeconds = 2;
+        BOOL local = TRUE;
+        int i;
+        for (i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "-predict") == 0)
+                predictEcho = TRUE;
+            else if (strcmp(argv[i], "-latency") == 0 && i + 1 < argc)
+                latencySamples = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-watch") == 0 && i + 2 < argc) {
+                watchSeconds = atof(argv[i + 1]);
+                watchCommand = argv[i + 2];
+                i += 2;
+            }
+            else if (strcmp(argv[i], "-pipe") == 0 && i + 1 < argc)
+                pipeCommand = argv[++i];
+            else if (strcmp(argv[i], "-tcp") == 0)
+                local = FALSE;
+            else
+                serverIP = argv[i];
+        }
+        if (pipeCommand != NULL)
+            return RunPipeClient(serverIP, pipeCommand, local);
+        else if (watchCommand != NULL)
+            RunWatchClient(serverIP, watchCommand, watchSeconds);
+        else
+            RunClient(serverIP, predictEcho, latencySamples, local);
+    }
+    else if (strcmp(argv[1], "-load") == 0) {
+        LoadConfig config;
+        int i;
+        ZeroMemory(&config, sizeof(config));
+        config.serverIP = "127.0.0.1";
+        config.clients = 10;
+        config.seconds = 30;
+        config.keysPerSecond = 8;
+        config.mix[0] = 80;
+        config.mix[1] = 15;
+        config.mix[2] = 5;
+        config.burstKB = 64;
+        config.thinkMs = 500;
+        config.budgetMs = COLDSTART_BUDGET_MS;
+        for (i = 2; i < argc; i++) {
+            if (strcmp(argv[i], "-clients") == 0 && i + 1 < argc)
+                config.clients = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-seconds") == 0 && i + 1 < argc)
+                config.seconds = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-rate") == 0 && i + 1 < argc)
+                config.keysPerSecond = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-mix") == 0 && i + 1 < argc)
+                sscanf(argv[++i], "%d,%d,%d", &config.mix[0], &config.mix[1], &config.mix[2]);
+            else if (strcmp(argv[i], "-burst") == 0 && i + 1 < argc)
+                config.burstKB = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-think") == 0 && i + 1 < argc)
+                config.thinkMs = atoi(argv[++i]);
+            else if (strcmp(argv[i], "-p99") == 0 && i + 1 < argc)
+                config.p99BudgetMs = atof(argv[++i]);
+            else if (strcmp(argv[i], "-storm") == 0)
+                config.storm = TRUE;
+            else if (strcmp(argv[i], "-idle") == 0)
+                config.idle = TRUE;
+            else if (strcmp(argv[i], "-coldstart") == 0)
+                config.coldStart = TRUE;
+            else if (strcmp(argv[i], "-budget") == 0 && i + 1 < argc)
+                config.budgetMs = atof(argv[++i]);
+            else if (strcmp(argv[i], "-watchtest") == 0)
+                config.watchTest = TRUE;
+            else if (strcmp(argv[i], "-predicttest") == 0)
+                config.predictTest = TRUE;
+            else if (strcmp(argv[i], "-transcodetest") == 0)
+                config.transcodeTest = TRUE;
+            else if (strcmp(argv[i], "-logtest") == 0)
+                config.logTest = TRUE;
+            else if (strcmp(argv[i], "-tcp") == 0)
+                config.tcp = TRUE;
+            else
+                config.serverIP = argv[i];
+        }
+        if (config.clients < 1)
+            config.clients = 1;
+        return RunLoadTest(&config);
     }
     else if (strcmp(argv[1], "-install") == 0) {
-        InstallService();
+        InstallService(argc > 2 && strcmp(argv[2], "-ondemand") == 0);
     }
     else if (strcmp(argv[1], "-uninstall") == 0) {
         UninstallService();
@@ -98,292 +680,4939 @@ int main(int argc, char* argv[]) {
     return 0;
 }
 
-// Create child process (cmd.exe) with redirected pipes
-BOOL CreateChildProcessWithPipes(void) {
-    SECURITY_ATTRIBUTES saAttr;
-    PROCESS_INFORMATION piProcInfo;
-    STARTUPINFOA siStartInfo;
-    BOOL bSuccess = FALSE;
+// ---------------------------------------------------------------------------
+// Logging
+//
+// Producers never format or touch a file: LogWrite() copies the message
+// pointer, up to three integer fields and a QPC timestamp into the calling
+// thread's single-producer ring. The log thread drains all rings every
+// LOG_FLUSH_MS and writes "time level tid=N message key=value ..." lines to
+// the log file, or to the console when running interactively. When a ring
+// is full the event is dropped and counted; the log thread reports drops.
+// ---------------------------------------------------------------------------
 
-    // Set up security attributes for pipe handles
-    saAttr.nLength = sizeof(SECURITY_ATTRIBUTES);
-    saAttr.bInheritHandle = TRUE;
-    saAttr.lpSecurityDescriptor = NULL;
+static const char* const g_LogLevelNames[] = { "ERROR", "WARN", "INFO", "DEBUG" };
 
-    // Create pipe for child's STDOUT
-    if (!CreatePipe(&g_hChildStd_OUT_Rd, &g_hChildStd_OUT_Wr, &saAttr, 0))
-        return FALSE;
-    
-    // Ensure read handle is not inherited
-    if (!SetHandleInformation(g_hChildStd_OUT_Rd, HANDLE_FLAG_INHERIT, 0))
-        return FALSE;
+// Ring owned by the calling thread, taken from the registry or created
+static LogRing* LogGetRing(void) {
+    LogRing* ring;
+    DWORD threadId;
 
-    // Create pipe for child's STDIN
-    if (!CreatePipe(&g_hChildStd_IN_Rd, &g_hChildStd_IN_Wr, &saAttr, 0))
-        return FALSE;
-    
-    // Ensure write handle is not inherited
-    if (!SetHandleInformation(g_hChildStd_IN_Wr, HANDLE_FLAG_INHERIT, 0))
-        return FALSE;
+    if (g_LogTlsIndex == TLS_OUT_OF_INDEXES)
+        return NULL;
+    ring = (LogRing*)TlsGetValue(g_LogTlsIndex);
+    if (ring != NULL)
+        return ring;
 
-    // Set up process info
-    ZeroMemory(&piProcInfo, sizeof(PROCESS_INFORMATION));
-    ZeroMemory(&siStartInfo, sizeof(STARTUPINFO));
-    
-    siStartInfo.cb = sizeof(STARTUPINFO);
-    siStartInfo.hStdError = g_hChildStd_OUT_Wr;
-    siStartInfo.hStdOutput = g_hChildStd_OUT_Wr;
-    siStartInfo.hStdInput = g_hChildStd_IN_Rd;
-    siStartInfo.dwFlags |= STARTF_USESTDHANDLES | STARTF_USESHOWWINDOW;
-    siStartInfo.wShowWindow = SW_HIDE;
-
-    // Create cmd.exe process
-    char cmdline[] = "cmd.exe";
-    bSuccess = CreateProcessA(NULL, cmdline, NULL, NULL, TRUE, 
-                              CREATE_NO_WINDOW, NULL, NULL, 
-                              &siStartInfo, &piProcInfo);
+    // Reuse a ring released by a finished thread before allocating
+    threadId = GetCurrentThreadId();
+    for (ring = g_LogRings; ring != NULL; ring = ring->next) {
+        if (InterlockedCompareExchange(&ring->owner, (LONG)threadId, 0) == 0)
+            break;
+    }
+    if (ring == NULL) {
+        ring = (LogRing*)VirtualAlloc(NULL, sizeof(LogRing), MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (ring == NULL)
+            return NULL;
+        ring->owner = (LONG)threadId;
+        do {
+            ring->next = g_LogRings;
+        } while (InterlockedCompareExchangePointer((PVOID volatile*)&g_LogRings, ring, ring->next) != ring->next);
+    }
+    TlsSetValue(g_LogTlsIndex, ring);
+    return ring;
+}
 
-    if (!bSuccess) {
-        printf("CreateProcess failed (%d)\n", GetLastError());
-        return FALSE;
+void LogWrite(int level, const char* message,
+              const char* key1, LONGLONG value1,
+              const char* key2, LONGLONG value2,
+              const char* key3, LONGLONG value3) {
+    LogRing* ring;
+    LogEvent* e;
+    LONG head;
+
+    if (level > g_LogLevel)
+        return;
+    ring = LogGetRing();
+    if (ring == NULL) {
+        InterlockedIncrement(&g_LogLostEvents);
+        return;
     }
 
-    // Close handles not needed by parent
-    CloseHandle(piProcInfo.hProcess);
-    CloseHandle(piProcInfo.hThread);
-    CloseHandle(g_hChildStd_OUT_Wr);
-    CloseHandle(g_hChildStd_IN_Rd);
+    head = ring->head;
+    if (head - ring->tail >= LOG_RING_SIZE) {
+        ring->dropped++;    // only this thread writes it
+        return;
+    }
 
-    return TRUE;
+    e = &ring->events[head & (LOG_RING_SIZE - 1)];
+    QueryPerformanceCounter(&e->timestamp);
+    e->threadId = ring->owner;
+    e->level = level;
+    e->message = message;
+    e->keys[0] = key1;
+    e->keys[1] = key2;
+    e->keys[2] = key3;
+    e->values[0] = value1;
+    e->values[1] = value2;
+    e->values[2] = value3;
+
+    // Publish: the log thread must see the event before the new head
+    InterlockedExchange(&ring->head, head + 1);
 }
 
-// Thread: Read from pipe (cmd stdout) and send to socket
-DWORD WINAPI PipeToSocketThread(LPVOID lpParam) {
-    ThreadParams* params = (ThreadParams*)lpParam;
-    SOCKET clientSocket = params->sock;
-    char buffer[BUFSIZE];
-    DWORD bytesRead;
-    DWORD bytesAvail;
-    
-    while (WaitForSingleObject(g_StopEvent, 0) != WAIT_OBJECT_0) {
-        // Check if data is available without blocking
-        if (PeekNamedPipe(g_hChildStd_OUT_Rd, NULL, 0, NULL, &bytesAvail, NULL) && bytesAvail > 0) {
-            if (ReadFile(g_hChildStd_OUT_Rd, buffer, BUFSIZE - 1, &bytesRead, NULL) && bytesRead > 0) {
-                buffer[bytesRead] = '\0';
-                if (send(clientSocket, buffer, bytesRead, 0) == SOCKET_ERROR) {
-                    printf("Send failed: %d\n", WSAGetLastError());
-                    break;
-                }
-            }
-        } else {
-            Sleep(10); // Small delay to avoid busy-wait
-        }
+// Give the calling thread's ring back for reuse (worker threads on exit)
+void LogThreadDetach(void) {
+    LogRing* ring;
+
+    if (g_LogTlsIndex == TLS_OUT_OF_INDEXES)
+        return;
+    ring = (LogRing*)TlsGetValue(g_LogTlsIndex);
+    if (ring != NULL) {
+        TlsSetValue(g_LogTlsIndex, NULL);
+        InterlockedExchange(&ring->owner, 0);
     }
-    
-    return 0;
 }
 
-// Thread: Receive from socket and write to pipe (cmd stdin)
-DWORD WINAPI SocketToPipeThread(LPVOID lpParam) {
-    ThreadParams* params = (ThreadParams*)lpParam;
-    SOCKET clientSocket = params->sock;
-    char buffer[BUFSIZE];
-    int bytesRecv;
-    DWORD bytesWritten;
-    
-    // Set socket to non-blocking mode
-    u_long mode = 1;
-    ioctlsocket(clientSocket, FIONBIO, &mode);
-    
-    while (WaitForSingleObject(g_StopEvent, 0) != WAIT_OBJECT_0) {
-        bytesRecv = recv(clientSocket, buffer, BUFSIZE - 1, 0);
-        
-        if (bytesRecv > 0) {
-            buffer[bytesRecv] = '\0';
-            if (!WriteFile(g_hChildStd_IN_Wr, buffer, bytesRecv, &bytesWritten, NULL)) {
-                printf("WriteFile failed: %d\n", GetLastError());
-                break;
-            }
-        } else if (bytesRecv == 0) {
-            // Connection closed
+static void LogOutput(const char* text, int length) {
+    DWORD written;
+    WriteFile(g_LogFile, text, length, &written, NULL);
+}
+
+static int LogFormatEvent(const LogEvent* e, char* out, int size) {
+    FILETIME ft;
+    SYSTEMTIME st;
+    ULARGE_INTEGER t;
+    int n, i;
+
+    // QPC ticks -> wall clock relative to the time the logger started
+    t.QuadPart = g_LogStartTime.QuadPart +
+                 (ULONGLONG)((e->timestamp.QuadPart - g_LogStartTicks.QuadPart) * 10000000.0 /
+                             g_LogFrequency.QuadPart);
+    ft.dwLowDateTime = t.LowPart;
+    ft.dwHighDateTime = t.HighPart;
+    FileTimeToSystemTime(&ft, &st);
+
+    n = _snprintf(out, size, "%04d-%02d-%02d %02d:%02d:%02d.%03d %-5s tid=%lu %s",
+                  st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond,
+                  st.wMilliseconds, g_LogLevelNames[e->level], e->threadId, e->message);
+    // _snprintf() returns -1 when it truncates: the line is full then
+    if (n < 0 || n > size - 2)
+        n = size - 2;
+    for (i = 0; i < 3 && e->keys[i] != NULL && n < size - 2; i++) {
+        int k = _snprintf(out + n, size - n, " %s=%lld", e->keys[i], e->values[i]);
+        if (k < 0) {
+            n = size - 2;
             break;
-        } else {
-            int error = WSAGetLastError();
-            if (error != WSAEWOULDBLOCK) {
-                printf("Recv failed: %d\n", error);
-                break;
+        }
+        n += k;
+    }
+    if (n > size - 2)
+        n = size - 2;
+    out[n++] = '\r';
+    out[n++] = '\n';
+    return n;
+}
+
+// Move everything published so far from all rings to the log output
+static void LogDrain(void) {
+    static char text[64 * 1024];
+    LogRing* ring;
+    LONG dropped = 0;
+    int used = 0;
+
+    for (ring = g_LogRings; ring != NULL; ring = ring->next) {
+        LONG head = InterlockedCompareExchange(&ring->head, 0, 0);
+        LONG tail = ring->tail;
+
+        while (tail != head) {
+            if (used > (int)sizeof(text) - LOG_LINE_MAX) {
+                LogOutput(text, used);
+                used = 0;
             }
-            Sleep(10); // Small delay
+            used += LogFormatEvent(&ring->events[tail & (LOG_RING_SIZE - 1)],
+                                   text + used, LOG_LINE_MAX);
+            tail++;
+        }
+        // Release the slots only after the events were copied out
+        InterlockedExchange(&ring->tail, tail);
+
+        dropped += ring->dropped - ring->reportedDrops;
+        ring->reportedDrops += ring->dropped - ring->reportedDrops;
+    }
+    dropped += InterlockedExchange(&g_LogLostEvents, 0);
+
+    if (dropped > 0) {
+        if (used > (int)sizeof(text) - LOG_LINE_MAX) {
+            LogOutput(text, used);
+            used = 0;
         }
+        used += _snprintf(text + used, LOG_LINE_MAX, "log: %ld events dropped (ring full)\r\n", dropped);
     }
-    
+    if (used > 0)
+        LogOutput(text, used);
+}
+
+static DWORD WINAPI LogThread(LPVOID lpParam) {
+    while (WaitForSingleObject(g_LogStopEvent, LOG_FLUSH_MS) == WAIT_TIMEOUT)
+        LogDrain();
+    LogDrain();
     return 0;
 }
 
-void RunServer(BOOL asService) {
-    WSADATA wsaData;
-    SOCKET listenSocket = INVALID_SOCKET;
-    SOCKET clientSocket = INVALID_SOCKET;
-    struct sockaddr_in serverAddr;
-    int result;
-    
-    if (!asService)
-        printf("Starting server on port %d...\n", DEFAULT_PORT);
+// Start the logger. path == NULL logs to the console.
+BOOL LogInit(const char* path) {
+    FILETIME now;
 
-    // Initialize Winsock
-    result = WSAStartup(MAKEWORD(2, 2), &wsaData);
-    if (result != 0) {
-        if (!asService)
-            printf("WSAStartup failed: %d\n", result);
-        return;
+    if (path != NULL) {
+        // Appends are atomic: an activated server shares its launcher's log
+        g_LogFile = CreateFileA(path, FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                                OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (g_LogFile == INVALID_HANDLE_VALUE)
+            return FALSE;
+    } else {
+        g_LogFile = GetStdHandle(STD_OUTPUT_HANDLE);
     }
 
-    // Create socket
-    listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (listenSocket == INVALID_SOCKET) {
-        if (!asService)
-            printf("Socket creation failed: %d\n", WSAGetLastError());
-        WSACleanup();
+    QueryPerformanceFrequency(&g_LogFrequency);
+    QueryPerformanceCounter(&g_LogStartTicks);
+    GetSystemTimeAsFileTime(&now);
+    g_LogStartTime.LowPart = now.dwLowDateTime;
+    g_LogStartTime.HighPart = now.dwHighDateTime;
+
+    g_LogTlsIndex = TlsAlloc();
+    g_LogStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    g_LogThread = CreateThread(NULL, 0, LogThread, NULL, 0, NULL);
+    return g_LogThread != NULL;
+}
+
+// "<directory of my.exe>\\RemoteConsole.log"
+void DefaultLogPath(char* path, DWORD size) {
+    char* slash;
+    DWORD n = GetModuleFileNameA(NULL, path, size);
+    if (n == 0 || n >= size) {
+        strcpy(path, DEFAULT_LOG_FILE);
         return;
     }
+    slash = strrchr(path, '\\');
+    if (slash != NULL && (DWORD)(slash + 1 - path) + sizeof(DEFAULT_LOG_FILE) <= size)
+        strcpy(slash + 1, DEFAULT_LOG_FILE);
+}
 
-    // Setup server address
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_addr.s_addr = INADDR_ANY;
-    serverAddr.sin_port = htons(DEFAULT_PORT);
+// Flush pending events and stop the log thread
+void LogShutdown(void) {
+    LogRing* ring;
+    DWORD index;
 
-    // Bind socket
-    result = bind(listenSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
-    if (result == SOCKET_ERROR) {
-        if (!asService)
-            printf("Bind failed: %d\n", WSAGetLastError());
-        closesocket(listenSocket);
-        WSACleanup();
+    if (g_LogThread == NULL)
         return;
+    SetEvent(g_LogStopEvent);
+    WaitForSingleObject(g_LogThread, INFINITE);
+    CloseHandle(g_LogThread);
+    CloseHandle(g_LogStopEvent);
+    g_LogThread = NULL;
+
+    // TlsFree() clears the slot in every thread, so all rings are free
+    // for whoever logs after the next LogInit()
+    index = g_LogTlsIndex;
+    g_LogTlsIndex = TLS_OUT_OF_INDEXES;
+    if (index != TLS_OUT_OF_INDEXES)
+        TlsFree(index);
+    for (ring = g_LogRings; ring != NULL; ring = ring->next)
+        InterlockedExchange(&ring->owner, 0);
+    if (g_LogFile != GetStdHandle(STD_OUTPUT_HANDLE))
+        CloseHandle(g_LogFile);
+}
+
+// Job object for one session: everything the shell starts stays inside it,
+// is limited as configured and dies with the session
+static HANDLE CreateSessionJob(void) {
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits;
+    JOBOBJECT_CPU_RATE_CONTROL_INFORMATION cpuRate;
+    HANDLE hJob = CreateJobObjectA(NULL, NULL);
+
+    if (hJob == NULL)
+        return NULL;
+
+    ZeroMemory(&limits, sizeof(limits));
+    limits.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+    if (g_JobMemoryMB > 0) {
+        limits.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_JOB_MEMORY;
+        limits.JobMemoryLimit = (SIZE_T)g_JobMemoryMB * 1024 * 1024;
+    }
+    if (g_JobProcessLimit > 0) {
+        limits.BasicLimitInformation.LimitFlags |= JOB_OBJECT_LIMIT_ACTIVE_PROCESS;
+        limits.BasicLimitInformation.ActiveProcessLimit = g_JobProcessLimit;
+    }
+    if (!SetInformationJobObject(hJob, JobObjectExtendedLimitInformation, &limits, sizeof(limits))) {
+        LOG_VAL(LOG_ERROR, "job limits rejected", "error", GetLastError());
+        CloseHandle(hJob);
+        return NULL;
     }
 
-    // Listen
-    result = listen(listenSocket, SOMAXCONN);
-    if (result == SOCKET_ERROR) {
-        if (!asService)
-            printf("Listen failed: %d\n", WSAGetLastError());
-        closesocket(listenSocket);
-        WSACleanup();
-        return;
+    // Weight-based CPU sharing between sessions (Windows 8 and later)
+    if (g_JobCpuWeight > 0) {
+        ZeroMemory(&cpuRate, sizeof(cpuRate));
+        cpuRate.ControlFlags = JOB_OBJECT_CPU_RATE_CONTROL_ENABLE | JOB_OBJECT_CPU_RATE_CONTROL_WEIGHT_BASED;
+        cpuRate.Weight = g_JobCpuWeight;
+        if (!SetInformationJobObject(hJob, JobObjectCpuRateControlInformation, &cpuRate, sizeof(cpuRate)))
+            LOG_VAL(LOG_WARN, "job CPU weight not applied", "error", GetLastError());
     }
+    return hJob;
+}
 
-    if (!asService)
-        printf("Server listening on port %d. Waiting for client...\n", DEFAULT_PORT);
+// One shell pipe. The server end is overlapped so the worker's completion
+// port drives it, which anonymous pipes cannot do; the shell gets an
+// ordinary synchronous handle to the other end.
+static BOOL CreateShellPipe(HANDLE* serverEnd, HANDLE* shellEnd, BOOL shellWrites,
+                            SECURITY_ATTRIBUTES* inherit) {
+    static volatile LONG serial = 0;
+    char name[64];
 
-    // Accept client connection
-    clientSocket = accept(listenSocket, NULL, NULL);
-    if (clientSocket == INVALID_SOCKET) {
-        if (!asService)
-            printf("Accept failed: %d\n", WSAGetLastError());
-        closesocket(listenSocket);
-        WSACleanup();
-        return;
+    sprintf(name, "\\\\.\\pipe\\RemoteConsole.%lu.%ld", GetCurrentProcessId(), InterlockedIncrement(&serial));
+    *serverEnd = CreateNamedPipeA(name,
+                                  (shellWrites ? PIPE_ACCESS_INBOUND : PIPE_ACCESS_OUTBOUND) |
+                                  FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                  PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                  1, RELAY_PIPE_SIZE, RELAY_PIPE_SIZE, 0, NULL);
+    if (*serverEnd == INVALID_HANDLE_VALUE) {
+        *serverEnd = NULL;
+        return FALSE;
+    }
+    *shellEnd = CreateFileA(name, shellWrites ? GENERIC_WRITE | FILE_READ_ATTRIBUTES
+                                              : GENERIC_READ | FILE_WRITE_ATTRIBUTES,
+                            0, inherit, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (*shellEnd == INVALID_HANDLE_VALUE) {
+        CloseHandle(*serverEnd);
+        *serverEnd = NULL;
+        *shellEnd = NULL;
+        return FALSE;
     }
+    return TRUE;
+}
 
-    if (!asService)
-        printf("Client connected!\n");
+// Attribute list that limits what a child inherits to handles[]. The ends
+// a child gets are inheritable, and workers start shells and commands on
+// several threads at once: without the list a child would also inherit
+// the ends another session is handing out at that moment, and that
+// session would never see its pipe break. NULL on failure.
+static LPPROC_THREAD_ATTRIBUTE_LIST InheritListCreate(HANDLE* handles, int count) {
+    LPPROC_THREAD_ATTRIBUTE_LIST list;
+    SIZE_T size = 0;
 
-    // Create child process with redirected pipes
-    if (!CreateChildProcessWithPipes()) {
-        if (!asService)
-            printf("Failed to create child process\n");
-        closesocket(clientSocket);
-        closesocket(listenSocket);
-        WSACleanup();
-        return;
+    InitializeProcThreadAttributeList(NULL, 1, 0, &size);
+    list = (LPPROC_THREAD_ATTRIBUTE_LIST)HeapAlloc(GetProcessHeap(), 0, size);
+    if (list == NULL)
+        return NULL;
+    if (!InitializeProcThreadAttributeList(list, 1, 0, &size)) {
+        HeapFree(GetProcessHeap(), 0, list);
+        return NULL;
     }
+    if (!UpdateProcThreadAttribute(list, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, handles,
+                                   count * sizeof(HANDLE), NULL, NULL)) {
+        DeleteProcThreadAttributeList(list);
+        HeapFree(GetProcessHeap(), 0, list);
+        return NULL;
+    }
+    return list;
+}
 
-    // Create stop event
-    g_StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+static void InheritListFree(LPPROC_THREAD_ATTRIBUTE_LIST list) {
+    DeleteProcThreadAttributeList(list);
+    HeapFree(GetProcessHeap(), 0, list);
+}
 
-    // Create threads for bidirectional communication
-    ThreadParams params;
-    params.sock = clientSocket;
-    
-    HANDLE hThreads[2];
-    hThreads[0] = CreateThread(NULL, 0, PipeToSocketThread, &params, 0, NULL);
-    hThreads[1] = CreateThread(NULL, 0, SocketToPipeThread, &params, 0, NULL);
+// Create child process (cmd.exe) with redirected pipes
+BOOL CreateChildProcessWithPipes(Session* session) {
+    SECURITY_ATTRIBUTES saAttr;
+    PROCESS_INFORMATION piProcInfo;
+    STARTUPINFOEXA siStartInfo;
+    HANDLE hStdoutWr = NULL;
+    HANDLE hStdinRd = NULL;
+    HANDLE inherit[2];
+    BOOL bSuccess = FALSE;
 
-    // Wait for threads to complete
-    WaitForMultipleObjects(2, hThreads, TRUE, INFINITE);
+    // Only the shell's ends are inherited
+    saAttr.nLength = sizeof(SECURITY_ATTRIBUTES);
+    saAttr.bInheritHandle = TRUE;
+    saAttr.lpSecurityDescriptor = NULL;
 
-    // Cleanup
-    CloseHandle(hThreads[0]);
-    CloseHandle(hThreads[1]);
-    CloseHandle(g_StopEvent);
-    CloseHandle(g_hChildStd_IN_Wr);
-    CloseHandle(g_hChildStd_OUT_Rd);
+    if (!CreateShellPipe(&session->hStdoutRd, &hStdoutWr, TRUE, &saAttr) ||
+        !CreateShellPipe(&session->hStdinWr, &hStdinRd, FALSE, &saAttr))
+        goto fail;
+
+    // Set up process info
+    ZeroMemory(&piProcInfo, sizeof(PROCESS_INFORMATION));
+    ZeroMemory(&siStartInfo, sizeof(siStartInfo));
     
-    closesocket(clientSocket);
-    closesocket(listenSocket);
-    WSACleanup();
+    siStartInfo.StartupInfo.cb = sizeof(siStartInfo);
+    siStartInfo.StartupInfo.hStdError = hStdoutWr;
+    siStartInfo.StartupInfo.hStdOutput = hStdoutWr;
+    siStartInfo.StartupInfo.hStdInput = hStdinRd;
+    siStartInfo.StartupInfo.dwFlags |= STARTF_USESTDHANDLES | STARTF_USESHOWWINDOW;
+    siStartInfo.StartupInfo.wShowWindow = SW_HIDE;
 
-    if (!asService)
-        printf("Server stopped.\n");
+    session->hJob = CreateSessionJob();
+    if (session->hJob == NULL)
+        goto fail;
+
+    // Create cmd.exe process, suspended until it is inside the job so that
+    // nothing it starts can escape. Shells run below normal priority: the
+    // I/O threads must win against a busy session.
+    char cmdline[] = "cmd.exe";
+    inherit[0] = hStdoutWr;
+    inherit[1] = hStdinRd;
+    siStartInfo.lpAttributeList = InheritListCreate(inherit, 2);
+    if (siStartInfo.lpAttributeList == NULL) {
+        LOG_VAL(LOG_ERROR, "cannot limit inherited handles", "error", GetLastError());
+        goto fail;
+    }
+    bSuccess = CreateProcessA(NULL, cmdline, NULL, NULL, TRUE, 
+                              CREATE_NO_WINDOW | CREATE_SUSPENDED | BELOW_NORMAL_PRIORITY_CLASS |
+                              EXTENDED_STARTUPINFO_PRESENT,
+                              NULL, NULL, &siStartInfo.StartupInfo, &piProcInfo);
+    if (!bSuccess)
+        LOG_VAL(LOG_ERROR, "CreateProcess failed", "error", GetLastError());
+    InheritListFree(siStartInfo.lpAttributeList);
+    if (!bSuccess)
+        goto fail;
+    if (!AssignProcessToJobObject(session->hJob, piProcInfo.hProcess)) {
+        LOG_VAL(LOG_ERROR, "AssignProcessToJobObject failed", "error", GetLastError());
+        TerminateProcess(piProcInfo.hProcess, 1);
+        CloseHandle(piProcInfo.hThread);
+        CloseHandle(piProcInfo.hProcess);
+        goto fail;
+    }
+    ResumeThread(piProcInfo.hThread);
+
+    // Close handles not needed by parent; the process handle stays with the
+    // session so the shell can be terminated or handed over
+    session->hProcess = piProcInfo.hProcess;
+    CloseHandle(piProcInfo.hThread);
+    CloseHandle(hStdoutWr);
+    CloseHandle(hStdinRd);
+
+    return TRUE;
+
+fail:
+    if (hStdoutWr) CloseHandle(hStdoutWr);
+    if (hStdinRd) CloseHandle(hStdinRd);
+    if (session->hStdoutRd) { CloseHandle(session->hStdoutRd); session->hStdoutRd = NULL; }
+    if (session->hStdinWr) { CloseHandle(session->hStdinWr); session->hStdinWr = NULL; }
+    if (session->hJob) { CloseHandle(session->hJob); session->hJob = NULL; }
+    return FALSE;
 }
 
-void RunClient(const char* serverIP) {
-    WSADATA wsaData;
-    SOCKET connectSocket = INVALID_SOCKET;
-    struct sockaddr_in serverAddr;
-    int result;
-    char sendBuffer[BUFSIZE];
-    char recvBuffer[BUFSIZE];
-    
-    printf("Connecting to server %s:%d...\n", serverIP, DEFAULT_PORT);
+// "cmd.exe /d /c <command>" for a command a client sent in UTF-8; heap
+// string, NULL if the command is empty or memory ran out
+static WCHAR* CommandLineFromUtf8(const char* command, DWORD length) {
+    static const WCHAR prefix[] = L"cmd.exe /d /c ";
+    const int prefixLen = sizeof(prefix) / sizeof(prefix[0]) - 1;
+    WCHAR* commandLine;
+    int wideLen;
 
-    // Initialize Winsock
-    result = WSAStartup(MAKEWORD(2, 2), &wsaData);
-    if (result != 0) {
-        printf("WSAStartup failed: %d\n", result);
-        return;
+    wideLen = length > 0 ? MultiByteToWideChar(CP_UTF8, 0, command, length, NULL, 0) : 0;
+    if (wideLen <= 0)
+        return NULL;
+    commandLine = (WCHAR*)HeapAlloc(GetProcessHeap(), 0, (prefixLen + wideLen + 1) * sizeof(WCHAR));
+    if (commandLine == NULL)
+        return NULL;
+    memcpy(commandLine, prefix, prefixLen * sizeof(WCHAR));
+    MultiByteToWideChar(CP_UTF8, 0, command, length, commandLine + prefixLen, wideLen);
+    commandLine[prefixLen + wideLen] = L'\0';
+    return commandLine;
+}
+
+// Start a command for a session under the same rules as its shell: hidden,
+// below normal priority and suspended until it is inside the session's job
+// (and innerJob, if given, nested in it). Output and errors share hStdout;
+// it and hStdin, if given, are all the command inherits.
+static BOOL StartCommand(Session* session, WCHAR* commandLine, HANDLE hStdin, HANDLE hStdout,
+                         HANDLE innerJob, HANDLE* hProcess) {
+    PROCESS_INFORMATION piProcInfo;
+    STARTUPINFOEXW siStartInfo;
+    HANDLE inherit[2];
+    BOOL started;
+
+    ZeroMemory(&piProcInfo, sizeof(piProcInfo));
+    ZeroMemory(&siStartInfo, sizeof(siStartInfo));
+    siStartInfo.StartupInfo.cb = sizeof(siStartInfo);
+    siStartInfo.StartupInfo.hStdError = hStdout;
+    siStartInfo.StartupInfo.hStdOutput = hStdout;
+    siStartInfo.StartupInfo.hStdInput = hStdin;
+    siStartInfo.StartupInfo.dwFlags |= STARTF_USESTDHANDLES | STARTF_USESHOWWINDOW;
+    siStartInfo.StartupInfo.wShowWindow = SW_HIDE;
+
+    inherit[0] = hStdout;
+    inherit[1] = hStdin;
+    siStartInfo.lpAttributeList = InheritListCreate(inherit, hStdin != NULL ? 2 : 1);
+    if (siStartInfo.lpAttributeList == NULL) {
+        LOG_VAL2(LOG_WARN, "cannot limit inherited handles", "session", session->id, "error", GetLastError());
+        return FALSE;
     }
+    started = CreateProcessW(NULL, commandLine, NULL, NULL, TRUE,
+                             CREATE_NO_WINDOW | CREATE_SUSPENDED | BELOW_NORMAL_PRIORITY_CLASS |
+                             EXTENDED_STARTUPINFO_PRESENT,
+                             NULL, NULL, &siStartInfo.StartupInfo, &piProcInfo);
+    if (!started)
+        LOG_VAL2(LOG_WARN, "command failed to start", "session", session->id, "error", GetLastError());
+    InheritListFree(siStartInfo.lpAttributeList);
+    if (!started)
+        return FALSE;
+    if (!AssignProcessToJobObject(session->hJob, piProcInfo.hProcess) ||
+        (innerJob != NULL && !AssignProcessToJobObject(innerJob, piProcInfo.hProcess))) {
+        LOG_VAL2(LOG_WARN, "command not admitted to the session's job", "session", session->id,
+                 "error", GetLastError());
+        TerminateProcess(piProcInfo.hProcess, 1);
+        CloseHandle(piProcInfo.hThread);
+        CloseHandle(piProcInfo.hProcess);
+        return FALSE;
+    }
+    ResumeThread(piProcInfo.hThread);
+    CloseHandle(piProcInfo.hThread);
+    *hProcess = piProcInfo.hProcess;
+    return TRUE;
+}
 
-    // Create socket
-    connectSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (connectSocket == INVALID_SOCKET) {
-        printf("Socket creation failed: %d\n", WSAGetLastError());
-        WSACleanup();
+// Send the whole buffer on a (possibly non-blocking) socket; calls, if
+// given, counts the send() calls it took
+static BOOL SendAllCounted(SOCKET sock, const char* data, int length, LONG* calls) {
+    while (length > 0) {
+        int sent = send(sock, data, length, 0);
+        if (calls != NULL)
+            (*calls)++;
+        if (sent == SOCKET_ERROR) {
+            if (WSAGetLastError() != WSAEWOULDBLOCK)
+                return FALSE;
+            Sleep(1);
+            continue;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return TRUE;
+}
+
+static BOOL SendAll(SOCKET sock, const char* data, int length) {
+    return SendAllCounted(sock, data, length, NULL);
+}
+
+static void ConsoleWrite(HANDLE hConsole, const char* data, int length) {
+    DWORD written;
+    if (length <= 0)
         return;
+    if (!WriteConsoleA(hConsole, data, length, &written, NULL))
+        WriteFile(hConsole, data, length, &written, NULL);
+}
+
+// ---------------------------------------------------------------------------
+// Text transcoding
+//
+// cmd.exe reads and writes the OEM code page; the wire carries UTF-8 in both
+// directions. Shell output is OEM -> UTF-8 on the server, client keystrokes
+// are UTF-8 -> OEM. Both sides scan for runs of ASCII 16 bytes at a time
+// with SSE2 (build with -DNO_SIMD for the scalar baseline) and only fall
+// back to per-character work for the bytes in between. -load -transcodetest
+// runs both scans on the same text and compares them.
+// ---------------------------------------------------------------------------
+
+static BOOL g_TranscodeScalar = FALSE;  // -transcodetest: skip the SSE2 scan
+
+// Length of the leading run of ASCII bytes
+static int AsciiPrefixLength(const unsigned char* data, int length) {
+    int i = 0;
+#ifdef HAVE_SSE2
+    for (; !g_TranscodeScalar && i + 16 <= length; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(data + i)));
+        if (mask != 0)
+            return i + CountTrailingZeros(mask);
     }
+#endif
+    while (i < length && data[i] < 0x80)
+        i++;
+    return i;
+}
 
-    // Setup server address
-    serverAddr.sin_family = AF_INET;
-    serverAddr.sin_port = htons(DEFAULT_PORT);
-    inet_pton(AF_INET, serverIP, &serverAddr.sin_addr);
+static void OutputTranscoderInit(OutputTranscoder* t, UINT codePage) {
+    CPINFO cpInfo;
+    int b;
 
-    // Connect to server
-    result = connect(connectSocket, (struct sockaddr*)&serverAddr, sizeof(serverAddr));
-    if (result == SOCKET_ERROR) {
-        printf("Connection failed: %d\n", WSAGetLastError());
-        closesocket(connectSocket);
-        WSACleanup();
+    ZeroMemory(t, sizeof(*t));
+    t->codePage = codePage;
+    t->dbcs = GetCPInfo(codePage, &cpInfo) && cpInfo.MaxCharSize > 1;
+    if (t->dbcs)
         return;
+
+    // Single-byte code page: precompute UTF-8 for the upper half once
+    for (b = 0x80; b <= 0xFF; b++) {
+        char c = (char)b;
+        WCHAR wc;
+        int n = 0;
+        if (MultiByteToWideChar(codePage, 0, &c, 1, &wc, 1) == 1)
+            n = WideCharToMultiByte(CP_UTF8, 0, &wc, 1, (char*)t->high[b - 0x80], 3, NULL, NULL);
+        if (n <= 0) {
+            memcpy(t->high[b - 0x80], "\xEF\xBF\xBD", 3);
+            n = 3;
+        }
+        t->high[b - 0x80][3] = (unsigned char)n;
     }
+}
 
-    printf("Connected to server!\n");
-    printf("Enter commands (type 'exit' to quit):\n\n");
+// Convert a DBCS run (no trailing lead byte) through UTF-16
+static int TranscodeDbcsRun(OutputTranscoder* t, const char* run, int length, char* out) {
+    int wideLen = MultiByteToWideChar(t->codePage, 0, run, length, t->wide, BUFSIZE + 2);
+    if (wideLen <= 0)
+        return 0;
+    return WideCharToMultiByte(CP_UTF8, 0, t->wide, wideLen, out, UTF8_OUT_SIZE(length), NULL, NULL);
+}
 
-    // Set socket to non-blocking
-    u_long mode = 1;
-    ioctlsocket(connectSocket, FIONBIO, &mode);
+// Convert a chunk of shell output to UTF-8. out must hold UTF8_OUT_SIZE(length)
+// bytes. A DBCS lead byte at the end of the chunk is kept for the next call.
+static int TranscodeOutput(OutputTranscoder* t, const char* in, int length, char* out) {
+    const unsigned char* p = (const unsigned char*)in;
+    int i = 0, o = 0;
 
-    HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
-    DWORD fdwMode = ENABLE_LINE_INPUT | ENABLE_ECHO_INPUT | ENABLE_PROCESSED_INPUT;
-    SetConsoleMode(hStdin, fdwMode);
+    if (t->hasLeadByte && length > 0) {
+        char pair[2];
+        pair[0] = (char)t->leadByte;
+        pair[1] = in[0];
+        o += TranscodeDbcsRun(t, pair, 2, out + o);
+        t->hasLeadByte = FALSE;
+        i = 1;
+    }
 
-    BOOL running = TRUE;
-    while (running) {
-        // Check for keyboard input
+    while (i < length) {
+        int n = AsciiPrefixLength(p + i, length - i);
+        memcpy(out + o, in + i, n);
+        i += n;
+        o += n;
+        if (i == length)
+            break;
+
+        if (!t->dbcs) {
+            // Single-byte: table lookup until the next ASCII byte
+            while (i < length && p[i] >= 0x80) {
+                const unsigned char* u = t->high[p[i] - 0x80];
+                memcpy(out + o, u, 3);
+                o += u[3];
+                i++;
+            }
+        } else {
+            // DBCS: trail bytes may be ASCII, so walk character by character
+            int start = i;
+            while (i < length && p[i] >= 0x80) {
+                if (IsDBCSLeadByteEx(t->codePage, p[i])) {
+                    if (i + 1 == length)
+                        break;
+                    i += 2;
+                } else {
+                    i++;
+                }
+            }
+            if (i > start)
+                o += TranscodeDbcsRun(t, in + start, i - start, out + o);
+            if (i == length - 1 && p[i] >= 0x80 && IsDBCSLeadByteEx(t->codePage, p[i])) {
+                t->leadByte = p[i];
+                t->hasLeadByte = TRUE;
+                i++;
+            }
+        }
+    }
+    return o;
+}
+
+// Length of a valid UTF-8 sequence at p, 0 if it is cut off, -1 if invalid
+static int Utf8SequenceLength(const unsigned char* p, int avail) {
+    unsigned char c = p[0];
+    int need, i;
+
+    if (c < 0x80)
+        return 1;
+    if (c >= 0xC2 && c <= 0xDF)
+        need = 2;
+    else if (c >= 0xE0 && c <= 0xEF)
+        need = 3;
+    else if (c >= 0xF0 && c <= 0xF4)
+        need = 4;
+    else
+        return -1;
+
+    for (i = 1; i < need; i++) {
+        if (i >= avail)
+            return 0;
+        if ((p[i] & 0xC0) != 0x80)
+            return -1;
+    }
+    if (avail >= 2) {
+        if ((c == 0xE0 && p[1] < 0xA0) ||   // overlong
+            (c == 0xED && p[1] > 0x9F) ||   // UTF-16 surrogates
+            (c == 0xF0 && p[1] < 0x90) ||   // overlong
+            (c == 0xF4 && p[1] > 0x8F))     // above U+10FFFF
+            return -1;
+    }
+    return need;
+}
+
+// Copy valid UTF-8 from in to out, replacing invalid bytes with U+FFFD.
+// A sequence cut off at the end of the chunk is held back and completed by
+// the next call. out must hold UTF8_OUT_SIZE(length) bytes.
+static int Utf8Sanitize(Utf8Stream* s, const char* in, int length, char* out) {
+    const unsigned char* p = (const unsigned char*)in;
+    int i = 0, o = 0;
+
+    while (s->carryLen > 0 && i < length) {
+        int r;
+        s->carry[s->carryLen++] = p[i++];
+        r = Utf8SequenceLength(s->carry, s->carryLen);
+        if (r > 0) {
+            memcpy(out + o, s->carry, r);
+            o += r;
+            s->carryLen = 0;
+        } else if (r < 0) {
+            // The new byte broke the sequence: drop the prefix, rescan the byte
+            memcpy(out + o, "\xEF\xBF\xBD", 3);
+            o += 3;
+            s->carryLen = 0;
+            i--;
+        }
+    }
+
+    while (i < length) {
+        int n = AsciiPrefixLength(p + i, length - i);
+        int r;
+        memcpy(out + o, in + i, n);
+        i += n;
+        o += n;
+        if (i == length)
+            break;
+
+        r = Utf8SequenceLength(p + i, length - i);
+        if (r > 0) {
+            memcpy(out + o, in + i, r);
+            o += r;
+        } else if (r == 0) {
+            s->carryLen = length - i;
+            memcpy(s->carry, in + i, s->carryLen);
+            break;
+        } else {
+            memcpy(out + o, "\xEF\xBF\xBD", 3);
+            o += 3;
+            r = 1;
+        }
+        i += r;
+    }
+    return o;
+}
+
+// Convert UTF-8 from the client to the shell's code page. out must hold
+// UTF8_OUT_SIZE(length) bytes. Returns the number of bytes in out.
+static int TranscodeInput(InputTranscoder* t, const char* in, int length, char* out) {
+    int n, wideLen;
+
+    n = Utf8Sanitize(&t->utf8, in, length, t->utf8Buffer);
+    if (AsciiPrefixLength((const unsigned char*)t->utf8Buffer, n) == n) {
+        memcpy(out, t->utf8Buffer, n);
+        return n;
+    }
+    wideLen = MultiByteToWideChar(CP_UTF8, 0, t->utf8Buffer, n, t->wide, UTF8_OUT_SIZE(BUFSIZE));
+    if (wideLen <= 0)
+        return 0;
+    return WideCharToMultiByte(t->codePage, 0, t->wide, wideLen, out, UTF8_OUT_SIZE(length), NULL, NULL);
+}
+
+// ---------------------------------------------------------------------------
+// Framing
+//
+// A client that opens with FRAME_MAGIC (the server answers with the same
+// four bytes) talks in frames: a type byte, a 24-bit little-endian payload
+// length and the payload. Shell output and keystrokes (FRAME_DATA) and the
+// -pipe streams are handed out as they arrive, without copying; control
+// frames are collected whole. Clients that do not say hello, telnet included, keep the plain
+// byte stream.
+// ---------------------------------------------------------------------------
+
+static void FrameHeader(char* out, int type, DWORD length) {
+    out[0] = (char)type;
+    out[1] = (char)(length & 0xFF);
+    out[2] = (char)((length >> 8) & 0xFF);
+    out[3] = (char)((length >> 16) & 0xFF);
+}
+
+// Integers in frame payloads are 32-bit little-endian
+static void PutU32(char* out, DWORD value) {
+    out[0] = (char)(value & 0xFF);
+    out[1] = (char)((value >> 8) & 0xFF);
+    out[2] = (char)((value >> 16) & 0xFF);
+    out[3] = (char)((value >> 24) & 0xFF);
+}
+
+static DWORD GetU32(const char* in) {
+    const unsigned char* p = (const unsigned char*)in;
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((DWORD)p[3] << 24);
+}
+
+// Frames whose payload is handed out piece by piece as it arrives
+static BOOL FrameIsStream(int type) {
+    return type == FRAME_DATA || type == FRAME_EXEC_INPUT || type == FRAME_EXEC_OUTPUT;
+}
+
+// Consume frame bytes. Returns the bytes used and sets *type once something
+// is ready: a piece of a stream frame's payload (pointing into data) or a
+// whole control frame (pointing into the reader, valid until the next call).
+// *type is 0 when more input is needed and -1 on a malformed stream.
+static int FrameRead(FrameReader* r, const char* data, int length, int* type,
+                     const char** payload, DWORD* payloadLength) {
+    int used = 0;
+    DWORD n;
+
+    *type = 0;
+    if (r->delivered) {
+        HeapFree(GetProcessHeap(), 0, r->control);
+        r->control = NULL;
+        r->delivered = FALSE;
+    }
+    while (used < length) {
+        if (r->headerLen < FRAME_HEADER_SIZE) {
+            r->header[r->headerLen++] = (unsigned char)data[used++];
+            if (r->headerLen < FRAME_HEADER_SIZE)
+                continue;
+            r->type = r->header[0];
+            r->remaining = r->header[1] | (r->header[2] << 8) | ((DWORD)r->header[3] << 16);
+            r->controlLen = 0;
+            if (!FrameIsStream(r->type)) {
+                if (r->remaining > (r->watchClient && r->type == FRAME_WATCH_DIFF ? WATCH_MAX_UPDATE : FRAME_MAX_CONTROL)) {
+                    *type = -1;
+                    return used;
+                }
+                r->control = (char*)HeapAlloc(GetProcessHeap(), 0, r->remaining + 1);
+                if (r->control == NULL) {
+                    *type = -1;
+                    return used;
+                }
+            }
+        } else {
+            n = (DWORD)(length - used) < r->remaining ? (DWORD)(length - used) : r->remaining;
+            if (FrameIsStream(r->type)) {
+                *type = r->type;
+                *payload = data + used;
+                *payloadLength = n;
+                r->remaining -= n;
+                used += n;
+                if (r->remaining == 0)
+                    r->headerLen = 0;
+                return used;
+            }
+            // A control frame that was half received when the server handed
+            // the session over has no buffer here; its rest is skipped
+            if (r->control != NULL)
+                memcpy(r->control + r->controlLen, data + used, n);
+            r->controlLen += n;
+            r->remaining -= n;
+            used += n;
+        }
+        if (r->headerLen == FRAME_HEADER_SIZE && r->remaining == 0) {
+            r->headerLen = 0;
+            if (FrameIsStream(r->type) || r->control == NULL)
+                continue;
+            r->control[r->controlLen] = '\0';
+            r->delivered = TRUE;
+            *type = r->type;
+            *payload = r->control;
+            *payloadLength = r->controlLen;
+            return used;
+        }
+    }
+    return used;
+}
+
+static void FrameReaderFree(FrameReader* r) {
+    if (r->control != NULL)
+        HeapFree(GetProcessHeap(), 0, r->control);
+    r->control = NULL;
+    r->delivered = FALSE;
+}
+
+// One line of watch output, terminator included
+typedef struct {
+    const char* text;
+    DWORD length;
+    DWORD hash;
+} TextLine;
+
+// Split text into lines; *lines is a heap array the caller frees. Returns
+// the number of lines or -1 if out of memory.
+static int SplitLines(const char* text, DWORD length, TextLine** lines) {
+    DWORD i, start = 0;
+    int count = 0, n = 0;
+
+    for (i = 0; i < length; i++)
+        if (text[i] == '\n')
+            count++;
+    if (length > 0 && text[length - 1] != '\n')
+        count++;
+    *lines = (TextLine*)HeapAlloc(GetProcessHeap(), 0, (count + 1) * sizeof(TextLine));
+    if (*lines == NULL)
+        return -1;
+    for (i = 0; i < length; i++) {
+        if (text[i] == '\n' || i == length - 1) {
+            TextLine* line = &(*lines)[n++];
+            DWORD j, hash = 2166136261u;     // FNV-1a
+            line->text = text + start;
+            line->length = i + 1 - start;
+            for (j = 0; j < line->length; j++)
+                hash = (hash ^ (unsigned char)line->text[j]) * 16777619u;
+            line->hash = hash;
+            start = i + 1;
+        }
+    }
+    return count;
+}
+
+static BOOL LinesEqual(const TextLine* a, const TextLine* b) {
+    return a->hash == b->hash && a->length == b->length && memcmp(a->text, b->text, a->length) == 0;
+}
+
+// ---------------------------------------------------------------------------
+// Timers
+//
+// Each worker keeps its sessions' heartbeats and timeouts and its watches'
+// next runs on a hierarchical timer wheel: TIMER_LEVELS rings of
+// TIMER_SLOTS lists, where ring L holds the timers due within
+// TIMER_SLOTS^(L+1) ticks. Setting or cancelling a timer is a list
+// operation. A tick runs one slot of ring 0, and every TIMER_SLOTS ticks
+// one slot of the next ring out is spread over the ring below. Nothing is
+// ever scanned per timer, so a worker with 100,000 sessions does no more
+// per tick than one with a handful until their timers actually fire. The
+// wheel is the I/O thread's and its wait timeout is the next due slot.
+// ---------------------------------------------------------------------------
+
+static void TimerInsert(TimerWheel* w, Timer* timer) {
+    ULONGLONG delta;
+    Timer** slot;
+    int level = 0;
+
+    if (timer->expires < w->tick)
+        timer->expires = w->tick;
+    delta = timer->expires - w->tick;
+    if (delta >= (ULONGLONG)1 << (TIMER_BITS * TIMER_LEVELS)) {
+        delta = ((ULONGLONG)1 << (TIMER_BITS * TIMER_LEVELS)) - 1;
+        timer->expires = w->tick + delta;
+    }
+    while (delta >= (ULONGLONG)1 << (TIMER_BITS * (level + 1)))
+        level++;
+    slot = &w->slots[level][(timer->expires >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1)];
+    timer->level = level;
+    timer->next = *slot;
+    if (timer->next != NULL)
+        timer->next->link = &timer->next;
+    timer->link = slot;
+    *slot = timer;
+    w->counts[level]++;
+    w->count++;
+}
+
+static void TimerCancel(TimerWheel* w, Timer* timer) {
+    if (timer->link == NULL)
+        return;
+    *timer->link = timer->next;
+    if (timer->next != NULL)
+        timer->next->link = timer->link;
+    timer->link = NULL;
+    w->counts[timer->level]--;
+    w->count--;
+}
+
+// (Re)arm a timer for due, a GetTickCount64() time; it fires at the first
+// tick not before it
+static void TimerSet(TimerWheel* w, Timer* timer, ULONGLONG due) {
+    TimerCancel(w, timer);
+    if (w->count == 0) {
+        // Nothing to cascade: skip the ticks an idle worker slept through
+        ULONGLONG tick = GetTickCount64() / TIMER_TICK_MS;
+        if (w->tick < tick)
+            w->tick = tick;
+    }
+    timer->expires = (due + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    TimerInsert(w, timer);
+}
+
+// Move to the next tick. When ring 0 wraps around, the slot of ring 1 that
+// is now current moves into it, and likewise further out.
+static void TimerAdvance(TimerWheel* w) {
+    int level;
+
+    w->tick++;
+    for (level = 1; level < TIMER_LEVELS; level++) {
+        int index;
+        Timer* timer;
+
+        if (((w->tick >> (TIMER_BITS * (level - 1))) & (TIMER_SLOTS - 1)) != 0)
+            break;
+        index = (int)(w->tick >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1);
+        timer = w->slots[level][index];
+        w->slots[level][index] = NULL;
+        while (timer != NULL) {
+            Timer* next = timer->next;
+            w->counts[level]--;
+            w->count--;
+            TimerInsert(w, timer);
+            timer = next;
+        }
+    }
+}
+
+// Take the next timer that is due at now off the wheel; NULL once none is.
+// Whatever fires may set timers again, including its own.
+static Timer* TimerExpired(TimerWheel* w, ULONGLONG now) {
+    ULONGLONG tick = now / TIMER_TICK_MS;
+
+    if (w->count == 0) {
+        if (w->tick < tick)
+            w->tick = tick;
+        return NULL;
+    }
+    for (;;) {
+        Timer* timer = w->slots[0][w->tick & (TIMER_SLOTS - 1)];
+        if (timer != NULL) {
+            TimerCancel(w, timer);
+            return timer;
+        }
+        if (w->tick >= tick)
+            return NULL;
+        TimerAdvance(w);
+    }
+}
+
+// Milliseconds until a timer may be due, for the completion port wait. With
+// outer rings in use this is at most the next wrap of ring 0, when one of
+// their slots moves in.
+static DWORD TimerTimeout(const TimerWheel* w, ULONGLONG now) {
+    ULONGLONG due;
+    int i;
+
+    if (w->count == 0)
+        return INFINITE;
+    due = w->count > w->counts[0] ? (w->tick | (TIMER_SLOTS - 1)) + 1 : w->tick + TIMER_SLOTS;
+    for (i = 0; w->tick + i < due; i++) {
+        if (w->slots[0][(w->tick + i) & (TIMER_SLOTS - 1)] != NULL) {
+            due = w->tick + i;
+            break;
+        }
+    }
+    due *= TIMER_TICK_MS;
+    return due <= now ? 0 : (DWORD)(due - now);
+}
+
+// ---------------------------------------------------------------------------
+// Workers
+//
+// One worker per processor (-workers N), each with two threads pinned to
+// that processor: an accept thread that keeps an AcceptEx posted on every
+// listener and an I/O thread that runs the worker's completion port. A new
+// connection gets its shell on the accept thread and is then handed to the
+// I/O thread, which relays for it until it closes. Sessions never have
+// threads of their own.
+// ---------------------------------------------------------------------------
+
+// Commands posted to a worker's completion port (no OVERLAPPED)
+enum { WORKER_START, WORKER_STOP, WORKER_PARK, WORKER_RESUME, WORKER_RELEASE, WORKER_EXIT,
+       WORKER_EXEC_EXITED };
+
+typedef struct {
+    int index;
+    HANDLE hAcceptThread;
+    HANDLE hIoThread;
+    HANDLE iocp;
+    HANDLE hReadEvent;              // ReadAvailable(): reads that bypass the port
+    HANDLE hParked;                 // set once every session is parked (handoff)
+    LONG accepted;
+    BOOL parking;
+    int commands;                   // watches and -pipe commands that kept it from parking
+    Session* sessions;              // owned by the I/O thread
+    int sessionCount;
+    TimerWheel timers;              // sessions' heartbeats and timeouts, watches' next runs
+    RelayChunk* freeChunks[RELAY_CLASSES];
+    int freeCount[RELAY_CLASSES];
+    OutputTranscoder output;        // tables and scratch; the carry lives in the session
+    InputTranscoder input;
+    SOCKET acceptSock[MAX_LISTENERS];
+    OVERLAPPED acceptOv[MAX_LISTENERS];
+    char addresses[MAX_LISTENERS][2 * ACCEPT_ADDR_SIZE];
+} Worker;
+
+static Worker* g_Workers[MAX_WORKERS];
+
+// Processor of worker N: the Nth processor the server may run on
+static DWORD_PTR WorkerAffinity(int worker) {
+    DWORD_PTR processMask = 0, systemMask = 0, bit;
+    int count = 0, n;
+
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask) || processMask == 0)
+        return 0;
+    for (bit = 1; bit != 0; bit <<= 1)
+        if (processMask & bit)
+            count++;
+    n = worker % count;
+    for (bit = 1; bit != 0; bit <<= 1) {
+        if ((processMask & bit) && n-- == 0)
+            return bit;
+    }
+    return 0;
+}
+
+static void WorkerPostAll(DWORD command) {
+    int i;
+    for (i = 0; i < g_WorkerCount; i++)
+        if (g_Workers[i] != NULL)
+            PostQueuedCompletionStatus(g_Workers[i]->iocp, command, 0, NULL);
+}
+
+// ---------------------------------------------------------------------------
+// Relay chunks
+//
+// Each worker pools chunks of RELAY_MIN_BUFFER..RELAY_MAX_BUFFER bytes in
+// powers of two and keeps at most RELAY_POOL_KEEP free ones per size. A
+// session takes a chunk when data arrives and returns it as soon as the
+// data is delivered, so idle sessions hold no buffers at all. The size
+// requested follows the traffic: a chunk that fills up doubles the next one
+// for that direction, a mostly empty one halves it, which keeps bulk
+// transfers at few large syscalls and keystrokes in small chunks.
+// ---------------------------------------------------------------------------
+
+static RelayChunk* ChunkGet(Worker* worker, DWORD wanted) {
+    RelayChunk* chunk;
+    DWORD size = RELAY_MIN_BUFFER;
+    int c = 0;
+
+    if (wanted > RELAY_MAX_BUFFER) {
+        // Only a whole frame (a large watch update) gets this big: sized
+        // exactly, built in place and never pooled
+        chunk = (RelayChunk*)HeapAlloc(GetProcessHeap(), 0, sizeof(RelayChunk) + FRAME_HEADER_SIZE + wanted);
+        if (chunk == NULL)
+            return NULL;
+        chunk->size = wanted;
+        chunk->out = chunk->data;
+        chunk->length = 0;
+        chunk->offset = 0;
+        chunk->source = SOURCE_NONE;
+        return chunk;
+    }
+    while (size < wanted && size < RELAY_MAX_BUFFER) {
+        size *= 2;
+        c++;
+    }
+    chunk = worker->freeChunks[c];
+    if (chunk != NULL) {
+        worker->freeChunks[c] = chunk->next;
+        worker->freeCount[c]--;
+    } else {
+        chunk = (RelayChunk*)HeapAlloc(GetProcessHeap(), 0,
+                                       sizeof(RelayChunk) + size + FRAME_HEADER_SIZE + RELAY_OUT_SIZE(size));
+        if (chunk == NULL)
+            return NULL;
+        chunk->size = size;
+        chunk->out = chunk->data + size;
+    }
+    chunk->length = 0;
+    chunk->offset = 0;
+    chunk->source = SOURCE_NONE;
+    return chunk;
+}
+
+static void ChunkPut(Worker* worker, RelayChunk* chunk) {
+    DWORD size = RELAY_MIN_BUFFER;
+    int c = 0;
+
+    while (size < chunk->size) {
+        size *= 2;
+        c++;
+    }
+    if (c >= RELAY_CLASSES || worker->freeCount[c] >= RELAY_POOL_KEEP) {
+        HeapFree(GetProcessHeap(), 0, chunk);
+        return;
+    }
+    chunk->next = worker->freeChunks[c];
+    worker->freeChunks[c] = chunk;
+    worker->freeCount[c]++;
+}
+
+static void ChunkPoolFree(Worker* worker) {
+    int c;
+    for (c = 0; c < RELAY_CLASSES; c++) {
+        while (worker->freeChunks[c] != NULL) {
+            RelayChunk* chunk = worker->freeChunks[c];
+            worker->freeChunks[c] = chunk->next;
+            HeapFree(GetProcessHeap(), 0, chunk);
+        }
+        worker->freeCount[c] = 0;
+    }
+}
+
+// Chunk size for the next transfer after one of used bytes in size
+static DWORD NextChunkSize(DWORD size, DWORD used) {
+    if (used >= size && size < RELAY_MAX_BUFFER)
+        return size * 2;
+    if (used < size / 4 && size > RELAY_MIN_BUFFER)
+        return size / 2;
+    return size;
+}
+
+// The transcoders work in BUFSIZE steps; out must hold RELAY_OUT_SIZE(length)
+static int TranscodeOutputBuffer(OutputTranscoder* t, const char* in, int length, char* out) {
+    int i, o = 0;
+    for (i = 0; i < length; i += BUFSIZE)
+        o += TranscodeOutput(t, in + i, length - i < BUFSIZE ? length - i : BUFSIZE, out + o);
+    return o;
+}
+
+static int TranscodeInputBuffer(InputTranscoder* t, const char* in, int length, char* out) {
+    int i, o = 0;
+    for (i = 0; i < length; i += BUFSIZE)
+        o += TranscodeInput(t, in + i, length - i < BUFSIZE ? length - i : BUFSIZE, out + o);
+    return o;
+}
+
+// Payload of length bytes sits at out + FRAME_HEADER_SIZE: put the frame
+// header in front of it for a framed client, leave it out for anyone else
+static void ChunkSeal(const Session* session, RelayChunk* chunk, int type, DWORD length) {
+    chunk->length = FRAME_HEADER_SIZE + length;
+    if (session->protocol == PROTO_FRAMED) {
+        FrameHeader(chunk->out, type, length);
+        chunk->offset = 0;
+    } else {
+        chunk->offset = FRAME_HEADER_SIZE;
+    }
+}
+
+// syscalls per MB moved, for the session summary
+static LONGLONG SyscallsPerMB(LONG syscalls, LONGLONG bytes) {
+    return bytes > 0 ? (LONGLONG)syscalls * 1048576 / bytes : 0;
+}
+
+// ---------------------------------------------------------------------------
+// Sessions
+//
+// A session is driven entirely by completions on its worker's port. While
+// idle it has exactly two reads posted, neither holding a pooled buffer: a
+// zero-byte WSARecv that completes when the client sends something, and a
+// SESSION_PEEK_SIZE read from the shell into the session itself. Data in
+// either direction is moved in a chunk that is returned once the send or
+// the write to the shell completes; the next read is posted only then, so
+// a slow side holds back the other through the pipe and socket buffers.
+// ---------------------------------------------------------------------------
+
+static void WatchStop(Worker* worker, Session* session, const char* reason);
+static void SessionControl(Worker* worker, Session* session, int type, const char* payload, DWORD length);
+static void ExecInput(Worker* worker, Session* session, const char* data, DWORD length);
+static void ExecPump(Worker* worker, Session* session);
+static void ExecPostRead(Worker* worker, Session* session);
+static void ExecFree(Worker* worker, Exec* exec);
+static BOOL DuplicateToProcess(HANDLE source, HANDLE targetProcess, ULONGLONG* target);
+static DWORD FindServerProcessId(int port);
+static void LocalStart(Worker* worker, Session* session);
+static BOOL LocalAdopt(Session* session, ULONGLONG section, const ULONGLONG* events);
+static void LocalPostRead(Worker* worker, Session* session);
+static void LocalPostSend(Worker* worker, Session* session, RelayChunk* chunk);
+static int LocalRecv(Session* session, char* buffer, DWORD size);
+static void LocalClose(Session* session);
+static void LocalLinkFree(LocalLink* link);
+
+// Sessions come from slabs of SESSION_SLAB that are never given back; a
+// closed session goes on the free list for the next client
+static Session* g_FreeSessions = NULL;
+
+static Session* SessionAlloc(void) {
+    Session* session;
+    int i;
+
+    EnterCriticalSection(&g_SessionLock);
+    if (g_FreeSessions == NULL) {
+        Session* slab = (Session*)HeapAlloc(GetProcessHeap(), 0, SESSION_SLAB * sizeof(Session));
+        for (i = 0; slab != NULL && i < SESSION_SLAB; i++) {
+            slab[i].next = g_FreeSessions;
+            g_FreeSessions = &slab[i];
+        }
+    }
+    session = g_FreeSessions;
+    if (session != NULL)
+        g_FreeSessions = session->next;
+    LeaveCriticalSection(&g_SessionLock);
+
+    if (session == NULL)
+        return NULL;
+    ZeroMemory(session, sizeof(*session));
+    session->sock = INVALID_SOCKET;
+    session->outHint = RELAY_MIN_BUFFER;
+    session->inHint = RELAY_MIN_BUFFER;
+    for (i = 0; i < IO_COUNT; i++)
+        session->io[i].type = i;
+    return session;
+}
+
+// Release the server's references. The shell is terminated unless it now
+// belongs to a successor process (keepShell). Nothing may be in flight.
+static void SessionFree(Session* session, BOOL keepShell) {
+    if (session->sock != INVALID_SOCKET)
+        closesocket(session->sock);
+    if (session->hJob) {
+        // Takes down everything the shell started, not just cmd.exe
+        if (!keepShell)
+            TerminateJobObject(session->hJob, 0);
+        CloseHandle(session->hJob);
+    }
+    if (session->hProcess) {
+        if (!keepShell)
+            TerminateProcess(session->hProcess, 0);
+        CloseHandle(session->hProcess);
+    }
+    if (session->hStdinWr) CloseHandle(session->hStdinWr);
+    if (session->hStdoutRd) CloseHandle(session->hStdoutRd);
+    if (session->local) LocalLinkFree(session->local);
+    FrameReaderFree(&session->frames);
+
+    EnterCriticalSection(&g_SessionLock);
+    session->next = g_FreeSessions;
+    g_FreeSessions = session;
+    LeaveCriticalSection(&g_SessionLock);
+}
+
+// Route the session's socket and pipes to its worker's completion port
+static BOOL SessionAttach(Session* session) {
+    HANDLE port = g_Workers[session->worker]->iocp;
+    ULONG_PTR key = (ULONG_PTR)session;
+
+    return CreateIoCompletionPort((HANDLE)session->sock, port, key, 0) != NULL &&
+           CreateIoCompletionPort(session->hStdoutRd, port, key, 0) != NULL &&
+           CreateIoCompletionPort(session->hStdinWr, port, key, 0) != NULL;
+}
+
+static void SessionLink(Worker* worker, Session* session) {
+    session->prev = NULL;
+    session->next = worker->sessions;
+    if (worker->sessions != NULL)
+        worker->sessions->prev = session;
+    worker->sessions = session;
+    worker->sessionCount++;
+}
+
+static void SessionUnlink(Worker* worker, Session* session) {
+    if (session->prev != NULL)
+        session->prev->next = session->next;
+    else
+        worker->sessions = session->next;
+    if (session->next != NULL)
+        session->next->prev = session->prev;
+    worker->sessionCount--;
+}
+
+// Handoff: signal the main thread once no session has anything in flight
+static void WorkerCheckParked(Worker* worker) {
+    Session* session;
+
+    if (!worker->parking)
+        return;
+    for (session = worker->sessions; session != NULL; session = session->next)
+        if (session->pending > 0)
+            return;
+    SetEvent(worker->hParked);
+}
+
+// Tear the session down: in-flight operations complete with errors and are
+// counted down by SessionSettle(), which frees it after the last one
+static void SessionClose(Session* session) {
+    if (session->closing)
+        return;
+    session->closing = TRUE;
+    TimerCancel(&g_Workers[session->worker]->timers, &session->timer);
+    WatchStop(g_Workers[session->worker], session, NULL);
+    if (session->local != NULL)
+        LocalClose(session);
+    closesocket(session->sock);
+    session->sock = INVALID_SOCKET;
+    if (session->hJob)
+        TerminateJobObject(session->hJob, 0);
+    CancelIoEx(session->hStdoutRd, NULL);
+    CancelIoEx(session->hStdinWr, NULL);
+}
+
+static void SessionSettle(Worker* worker, Session* session) {
+    if (session->pending > 0) {
+        return;
+    } else if (session->closing) {
+        LOG_VAL3(LOG_INFO, "session closed", "session", session->id,
+                 "bytes_out", session->bytesOut, "bytes_in", session->bytesIn);
+        LOG_VAL3(LOG_INFO, "session output", "session", session->id,
+                 "out_syscalls_per_mb", SyscallsPerMB(session->syscallsOut, session->bytesOut),
+                 "out_peak_buffer", session->peakOut);
+        LOG_VAL3(LOG_INFO, "session input", "session", session->id,
+                 "in_syscalls_per_mb", SyscallsPerMB(session->syscallsIn, session->bytesIn),
+                 "in_peak_buffer", session->peakIn);
+        while (session->sendQueue != NULL) {
+            RelayChunk* chunk = session->sendQueue;
+            session->sendQueue = chunk->next;
+            ChunkPut(worker, chunk);
+        }
+        if (session->exec != NULL) {
+            ExecFree(worker, session->exec);
+            session->exec = NULL;
+        }
+        SessionUnlink(worker, session);
+        SessionFree(session, FALSE);
+        InterlockedDecrement(&g_SessionCount);
+        WorkerCheckParked(worker);
+    } else if (session->parking) {
+        WorkerCheckParked(worker);
+    }
+}
+
+static void SessionIoBegin(Session* session, SessionIo* io, RelayChunk* chunk) {
+    ZeroMemory(&io->ov, sizeof(io->ov));
+    io->active = TRUE;
+    io->chunk = chunk;
+    session->pending++;
+}
+
+// The operation failed without being queued: no completion will come
+static void SessionIoFailed(Worker* worker, Session* session, SessionIo* io) {
+    io->active = FALSE;
+    if (io->chunk != NULL)
+        ChunkPut(worker, io->chunk);
+    io->chunk = NULL;
+    session->pending--;
+    SessionClose(session);
+}
+
+// Wait for shell output without holding a pooled buffer
+static void PostPipeRead(Worker* worker, Session* session) {
+    SessionIo* io = &session->io[IO_PIPE_READ];
+
+    if (session->closing)
+        return;
+    if (session->parking) {
+        session->parkedReads |= 1 << IO_PIPE_READ;  // posted on WORKER_RESUME
+        return;
+    }
+    SessionIoBegin(session, io, NULL);
+    session->syscallsOut++;
+    if (!ReadFile(session->hStdoutRd, session->peek, SESSION_PEEK_SIZE, NULL, &io->ov) &&
+        GetLastError() != ERROR_IO_PENDING) {
+        LOG_VAL2(LOG_INFO, "shell exited", "session", session->id, "error", GetLastError());
+        SessionIoFailed(worker, session, io);
+    }
+}
+
+// Wait for client input: a zero-byte receive only reports that data is there
+static void PostSocketRead(Worker* worker, Session* session) {
+    SessionIo* io = &session->io[IO_SOCK_RECV];
+    WSABUF none;
+    DWORD flags = 0;
+
+    if (session->closing)
+        return;
+    if (session->parking) {
+        session->parkedReads |= 1 << IO_SOCK_RECV;
+        return;
+    }
+    if (session->local != NULL) {
+        LocalPostRead(worker, session);
+        return;
+    }
+    none.buf = NULL;
+    none.len = 0;
+    SessionIoBegin(session, io, NULL);
+    if (WSARecv(session->sock, &none, 1, NULL, &flags, &io->ov, NULL) == SOCKET_ERROR &&
+        WSAGetLastError() != WSA_IO_PENDING) {
+        LOG_VAL2(LOG_WARN, "recv failed", "session", session->id, "error", WSAGetLastError());
+        SessionIoFailed(worker, session, io);
+    }
+}
+
+static void PostSend(Worker* worker, Session* session, RelayChunk* chunk) {
+    SessionIo* io = &session->io[IO_SOCK_SEND];
+    WSABUF buffer;
+
+    if (session->local != NULL && session->local->sending) {
+        LocalPostSend(worker, session, chunk);
+        return;
+    }
+    buffer.buf = chunk->out + chunk->offset;
+    buffer.len = chunk->length - chunk->offset;
+    SessionIoBegin(session, io, chunk);
+    session->syscallsOut++;
+    if (WSASend(session->sock, &buffer, 1, NULL, 0, &io->ov, NULL) == SOCKET_ERROR &&
+        WSAGetLastError() != WSA_IO_PENDING) {
+        LOG_VAL2(LOG_WARN, "send failed", "session", session->id, "error", WSAGetLastError());
+        SessionIoFailed(worker, session, io);
+    }
+}
+
+// One send is in flight at a time; whatever else is ready for the client
+// (control frames, the framing hello) waits behind it in order
+static void SessionQueueSend(Worker* worker, Session* session, RelayChunk* chunk) {
+    if (session->closing) {
+        ChunkPut(worker, chunk);
+        return;
+    }
+    if (!session->io[IO_SOCK_SEND].active) {
+        PostSend(worker, session, chunk);
+        return;
+    }
+    chunk->next = NULL;
+    if (session->sendQueue == NULL)
+        session->sendQueue = chunk;
+    else
+        session->sendQueueTail->next = chunk;
+    session->sendQueueTail = chunk;
+}
+
+// Queue a control frame for a framed client
+static BOOL SessionSendFrame(Worker* worker, Session* session, int type, const char* payload, DWORD length) {
+    RelayChunk* chunk = ChunkGet(worker, length);
+
+    if (chunk == NULL)
+        return FALSE;
+    memcpy(chunk->out + FRAME_HEADER_SIZE, payload, length);
+    ChunkSeal(session, chunk, type, length);
+    SessionQueueSend(worker, session, chunk);
+    return TRUE;
+}
+
+static void PostPipeWrite(Worker* worker, Session* session, RelayChunk* chunk) {
+    SessionIo* io = &session->io[IO_PIPE_WRITE];
+
+    SessionIoBegin(session, io, chunk);
+    session->syscallsIn++;
+    if (!WriteFile(session->hStdinWr, chunk->out + chunk->offset, chunk->length - chunk->offset,
+                   NULL, &io->ov) &&
+        GetLastError() != ERROR_IO_PENDING) {
+        LOG_VAL2(LOG_WARN, "WriteFile to shell failed", "session", session->id, "error", GetLastError());
+        SessionIoFailed(worker, session, io);
+    }
+}
+
+// Read what is already waiting in the pipe. The event handle has its low
+// bit set, which keeps this read's completion off the port.
+static DWORD ReadAvailable(Worker* worker, Session* session, char* buffer, DWORD size) {
+    OVERLAPPED ov;
+    DWORD avail = 0, got = 0;
+
+    session->syscallsOut++;
+    if (!PeekNamedPipe(session->hStdoutRd, NULL, 0, NULL, &avail, NULL) || avail == 0)
+        return 0;
+    ZeroMemory(&ov, sizeof(ov));
+    ov.hEvent = (HANDLE)((ULONG_PTR)worker->hReadEvent | 1);
+    session->syscallsOut++;
+    if (!ReadFile(session->hStdoutRd, buffer, avail < size ? avail : size, NULL, &ov) &&
+        GetLastError() != ERROR_IO_PENDING)
+        return 0;
+    if (!GetOverlappedResult(session->hStdoutRd, &ov, &got, TRUE))
+        return 0;
+    return got;
+}
+
+// Shell output arrived in session->peek: move it and whatever else is
+// waiting to the client in one chunk
+static void OnPipeRead(Worker* worker, Session* session, DWORD bytes, DWORD error) {
+    RelayChunk* chunk;
+    DWORD length;
+
+    if (error == ERROR_OPERATION_ABORTED && !session->closing) {
+        // Cancelled for a handoff; if that gave up meanwhile, read again
+        PostPipeRead(worker, session);
+        return;
+    }
+    if (error != 0) {
+        LOG_VAL2(LOG_INFO, "shell exited", "session", session->id, "error", error);
+        SessionClose(session);
+        return;
+    }
+    chunk = ChunkGet(worker, session->outHint);
+    if (chunk == NULL) {
+        LOG_VAL(LOG_ERROR, "out of relay buffers", "session", session->id);
+        SessionClose(session);
+        return;
+    }
+    memcpy(chunk->data, session->peek, bytes);
+    length = bytes;
+    if (bytes == SESSION_PEEK_SIZE)
+        length += ReadAvailable(worker, session, chunk->data + length, chunk->size - length);
+
+    session->bytesOut += length;
+    session->outHint = NextChunkSize(chunk->size, length);
+    if (chunk->size > session->peakOut)
+        session->peakOut = chunk->size;
+
+    worker->output.leadByte = session->outLeadByte;
+    worker->output.hasLeadByte = session->outHasLeadByte;
+    length = TranscodeOutputBuffer(&worker->output, chunk->data, length, chunk->out + FRAME_HEADER_SIZE);
+    session->outLeadByte = worker->output.leadByte;
+    session->outHasLeadByte = worker->output.hasLeadByte;
+
+    if (length == 0) {
+        ChunkPut(worker, chunk);
+        PostPipeRead(worker, session);
+        return;
+    }
+    ChunkSeal(session, chunk, FRAME_DATA, length);
+    chunk->source = SOURCE_SHELL;
+    SessionQueueSend(worker, session, chunk);
+}
+
+static void OnSent(Worker* worker, Session* session, RelayChunk* chunk, DWORD bytes, DWORD error) {
+    if (error == 0 && bytes == 0 && session->local != NULL && session->local->sending) {
+        // The ring was full; the client has read from it since
+        PostSend(worker, session, chunk);
+        return;
+    }
+    if (error != 0 || bytes == 0) {
+        LOG_VAL2(LOG_WARN, "send failed", "session", session->id, "error", error);
+        ChunkPut(worker, chunk);
+        SessionClose(session);
+        return;
+    }
+    chunk->offset += bytes;
+    if (chunk->offset < chunk->length) {
+        PostSend(worker, session, chunk);
+        return;
+    }
+    if (chunk->source == SOURCE_SHELL)
+        PostPipeRead(worker, session);
+    else if (chunk->source == SOURCE_EXEC)
+        ExecPostRead(worker, session);
+    else if (chunk->source == SOURCE_LOCAL && session->local != NULL)
+        session->local->sending = TRUE;     // the client reads the rings from here on
+    ChunkPut(worker, chunk);
+    chunk = session->sendQueue;
+    if (chunk != NULL) {
+        session->sendQueue = chunk->next;
+        PostSend(worker, session, chunk);
+    }
+}
+
+// The client's first bytes decide the protocol: FRAME_MAGIC asks for
+// frames, LOCAL_MAGIC for the local transport, after which another hello
+// may follow, and anything else is a plain client. Returns the bytes the
+// hello took; a partial match that turns out not to be one is input after
+// all and is transcoded into out (*o bytes so far).
+static int SessionHello(Worker* worker, Session* session, const char* data, int length, char* out, int* o) {
+    RelayChunk* reply;
+    BOOL local = FALSE;
+    int used = 0;
+
+    while (used < length && session->helloLen < FRAME_MAGIC_SIZE) {
+        // The two magics differ only in their last byte
+        local = session->helloLen == FRAME_MAGIC_SIZE - 1 && session->local == NULL &&
+                data[used] == LOCAL_MAGIC[FRAME_MAGIC_SIZE - 1];
+        if (data[used] != FRAME_MAGIC[session->helloLen] && !local) {
+            session->protocol = PROTO_RAW;
+            *o += TranscodeInputBuffer(&worker->input, FRAME_MAGIC, session->helloLen, out + *o);
+            return used;
+        }
+        session->helloLen++;
+        used++;
+    }
+    if (session->helloLen < FRAME_MAGIC_SIZE)
+        return used;
+    if (local) {
+        session->helloLen = 0;
+        LocalStart(worker, session);
+        return used;
+    }
+
+    // Output already on its way went out plain; the reply marks where
+    // frames begin
+    session->protocol = PROTO_FRAMED;
+    reply = ChunkGet(worker, FRAME_MAGIC_SIZE);
+    if (reply == NULL) {
+        SessionClose(session);
+        return used;
+    }
+    memcpy(reply->out, FRAME_MAGIC, FRAME_MAGIC_SIZE);
+    reply->length = FRAME_MAGIC_SIZE;
+    SessionQueueSend(worker, session, reply);
+    LOG_VAL(LOG_INFO, "client uses frames", "session", session->id);
+    return used;
+}
+
+// The zero-byte receive completed: the client's data is waiting
+static void OnSocketReadable(Worker* worker, Session* session, DWORD error) {
+    RelayChunk* chunk;
+    const char* payload;
+    DWORD payloadLength;
+    int received, used = 0, o = 0, type;
+
+    if (error == ERROR_OPERATION_ABORTED && !session->closing) {
+        PostSocketRead(worker, session);    // see OnPipeRead()
+        return;
+    }
+    if (error != 0) {
+        LOG_VAL2(LOG_WARN, "recv failed", "session", session->id, "error", error);
+        SessionClose(session);
+        return;
+    }
+    if (session->parking) {
+        // Stays queued for the successor, or is read again on resume
+        PostSocketRead(worker, session);
+        return;
+    }
+
+    chunk = ChunkGet(worker, session->inHint);
+    if (chunk == NULL) {
+        LOG_VAL(LOG_ERROR, "out of relay buffers", "session", session->id);
+        SessionClose(session);
+        return;
+    }
+    if (session->local != NULL) {
+        received = LocalRecv(session, chunk->data, chunk->size);
+    } else {
+        session->syscallsIn++;
+        received = recv(session->sock, chunk->data, chunk->size, 0);
+    }
+    if (received <= 0) {
+        int recvError = received == 0 ? 0 : WSAGetLastError();
+        ChunkPut(worker, chunk);
+        if (recvError == WSAEWOULDBLOCK) {
+            PostSocketRead(worker, session);
+        } else {
+            if (received == 0)
+                LOG_VAL(LOG_INFO, "client disconnected", "session", session->id);
+            else
+                LOG_VAL2(LOG_WARN, "recv failed", "session", session->id, "error", recvError);
+            SessionClose(session);
+        }
+        return;
+    }
+
+    session->bytesIn += received;
+    session->lastHeard = GetTickCount64();
+    session->pings = 0;
+    session->inHint = NextChunkSize(chunk->size, (DWORD)received);
+    if (chunk->size > session->peakIn)
+        session->peakIn = chunk->size;
+
+    worker->input.utf8 = session->inCarry;
+    while (session->protocol == PROTO_UNKNOWN && used < received && !session->closing)
+        used += SessionHello(worker, session, chunk->data + used, received - used, chunk->out, &o);
+    if (session->protocol != PROTO_FRAMED) {
+        session->lastInput = session->lastHeard;
+        o += TranscodeInputBuffer(&worker->input, chunk->data + used, received - used, chunk->out + o);
+    } else {
+        while (used < received && !session->closing) {
+            used += FrameRead(&session->frames, chunk->data + used, received - used,
+                              &type, &payload, &payloadLength);
+            if (type > 0 && type != FRAME_PONG)
+                session->lastInput = session->lastHeard;
+            if (type == FRAME_DATA) {
+                o += TranscodeInputBuffer(&worker->input, payload, payloadLength, chunk->out + o);
+            } else if (type == FRAME_EXEC_INPUT) {
+                ExecInput(worker, session, payload, payloadLength);
+            } else if (type < 0) {
+                LOG_VAL(LOG_WARN, "malformed frame", "session", session->id);
+                SessionClose(session);
+            } else if (type > 0) {
+                SessionControl(worker, session, type, payload, payloadLength);
+            }
+        }
+        if (!session->closing)
+            ExecPump(worker, session);
+    }
+    session->inCarry = worker->input.utf8;
+    chunk->length = o;
+
+    if (session->closing) {
+        ChunkPut(worker, chunk);
+        return;
+    }
+    if (chunk->length == 0) {
+        ChunkPut(worker, chunk);
+        PostSocketRead(worker, session);
+        return;
+    }
+    PostPipeWrite(worker, session, chunk);
+}
+
+static void OnPipeWritten(Worker* worker, Session* session, RelayChunk* chunk, DWORD bytes, DWORD error) {
+    if (error != 0) {
+        LOG_VAL2(LOG_WARN, "WriteFile to shell failed", "session", session->id, "error", error);
+        ChunkPut(worker, chunk);
+        SessionClose(session);
+        return;
+    }
+    chunk->offset += bytes;
+    if (chunk->offset < chunk->length) {
+        PostPipeWrite(worker, session, chunk);
+        return;
+    }
+    ChunkPut(worker, chunk);
+    PostSocketRead(worker, session);
+}
+
+// ---------------------------------------------------------------------------
+// Watch
+//
+// FRAME_WATCH makes the server run a command (cmd.exe /c, inside the
+// session's job) every interval and send only what changed in its output
+// since the last update: an edit script of copied, skipped and inserted
+// lines that the client applies to the view it already has. Runs happen on
+// the worker's completion port like any other session I/O and the next one
+// is a timer on the worker's wheel. One watch per session, stopped by the
+// client or with the session; a handoff is refused while it runs.
+// ---------------------------------------------------------------------------
+
+struct Watch {
+    SessionIo io;                   // reads the running command's output; first
+    Timer timer;                    // next run, set while no run is going
+    Session* session;
+    WCHAR* commandLine;             // cmd.exe /d /c <command>
+    DWORD interval;                 // ms
+    HANDLE hOutput;                 // running command's stdout, NULL between runs
+    HANDLE hProcess;
+    char* output;                   // this run's output as the shell wrote it
+    DWORD outputLen;
+    DWORD outputSize;
+    char* shown;                    // UTF-8 text the client has now
+    DWORD shownLen;
+    LONG runs;
+    LONGLONG bytesFull;             // what sending every update whole would take
+    LONGLONG bytesSent;
+};
+
+// Writes the edit script of a watch update
+typedef struct {
+    char* out;
+    char* run;                      // last 'C' or 'S' record, extended while it repeats
+    BOOL changed;
+} DiffWriter;
+
+// Copy ('C') or skip ('S') count old lines
+static void DiffRun(DiffWriter* d, char op, DWORD count) {
+    if (op != 'C')
+        d->changed = TRUE;
+    if (d->run != NULL && *d->run == op) {
+        PutU32(d->run + 1, GetU32(d->run + 1) + count);
+        return;
+    }
+    d->run = d->out;
+    d->out[0] = op;
+    PutU32(d->out + 1, count);
+    d->out += 5;
+}
+
+static void DiffInsert(DiffWriter* d, const TextLine* line) {
+    d->changed = TRUE;
+    d->run = NULL;
+    d->out[0] = 'I';
+    PutU32(d->out + 1, line->length);
+    memcpy(d->out + 5, line->text, line->length);
+    d->out += 5 + line->length;
+}
+
+// Edit script from old to cur. Greedy, looking WATCH_WINDOW lines ahead for
+// text that moved up or down: any script is correct, a good one is short.
+// Needs 5 * (oldCount + curCount) bytes plus the text of cur at most.
+static void DiffLines(DiffWriter* d, const TextLine* old, int oldCount, const TextLine* cur, int curCount) {
+    int i = 0, j = 0, k;
+
+    while (j < curCount) {
+        if (i < oldCount && LinesEqual(&old[i], &cur[j])) {
+            DiffRun(d, 'C', 1);
+            i++;
+            j++;
+            continue;
+        }
+        // Lines removed: this one comes back a little further down the old text
+        for (k = i + 1; k < oldCount && k <= i + WATCH_WINDOW; k++)
+            if (LinesEqual(&old[k], &cur[j]))
+                break;
+        if (k < oldCount && k <= i + WATCH_WINDOW) {
+            DiffRun(d, 'S', k - i);
+            i = k;
+            continue;
+        }
+        // Lines inserted: the old line comes back a little further down
+        for (k = j + 1; i < oldCount && k < curCount && k <= j + WATCH_WINDOW; k++)
+            if (LinesEqual(&old[i], &cur[k]))
+                break;
+        if (i < oldCount && k < curCount && k <= j + WATCH_WINDOW) {
+            while (j < k)
+                DiffInsert(d, &cur[j++]);
+            continue;
+        }
+        // Changed in place
+        DiffInsert(d, &cur[j++]);
+        if (i < oldCount) {
+            DiffRun(d, 'S', 1);
+            i++;
+        }
+    }
+    if (i < oldCount)
+        d->changed = TRUE;          // the client drops what the script does not reach
+}
+
+static void WatchFree(Watch* watch) {
+    if (watch->hOutput) CloseHandle(watch->hOutput);
+    if (watch->hProcess) CloseHandle(watch->hProcess);
+    if (watch->commandLine) HeapFree(GetProcessHeap(), 0, watch->commandLine);
+    if (watch->output) HeapFree(GetProcessHeap(), 0, watch->output);
+    if (watch->shown) HeapFree(GetProcessHeap(), 0, watch->shown);
+    HeapFree(GetProcessHeap(), 0, watch);
+}
+
+// End the session's watch, telling the client why unless reason is NULL. A
+// run still going is killed; the completion of its read frees the watch.
+static void WatchStop(Worker* worker, Session* session, const char* reason) {
+    Watch* watch = session->watch;
+
+    if (watch == NULL)
+        return;
+    session->watch = NULL;
+    TimerCancel(&worker->timers, &watch->timer);
+    LOG_VAL3(LOG_INFO, "watch stopped", "session", session->id,
+             "bytes_full", watch->bytesFull, "bytes_sent", watch->bytesSent);
+    if (reason != NULL)
+        SessionSendFrame(worker, session, FRAME_WATCH_END, reason, (DWORD)strlen(reason));
+    if (watch->io.active) {
+        if (watch->hProcess)
+            TerminateProcess(watch->hProcess, 1);
+        CancelIoEx(watch->hOutput, &watch->io.ov);
+    } else {
+        WatchFree(watch);
+    }
+}
+
+// Send the client what changed since the last update, if anything did
+static BOOL WatchSendUpdate(Worker* worker, Watch* watch) {
+    Session* session = watch->session;
+    TextLine* old = NULL;
+    TextLine* cur = NULL;
+    RelayChunk* chunk = NULL;
+    DiffWriter diff;
+    char* text;
+    int textLen, oldCount, curCount;
+    BOOL ok = FALSE;
+
+    // UTF-8 like everything else the client gets; every run starts afresh
+    text = (char*)HeapAlloc(GetProcessHeap(), 0, RELAY_OUT_SIZE(watch->outputLen));
+    if (text == NULL)
+        return FALSE;
+    worker->output.hasLeadByte = FALSE;
+    textLen = TranscodeOutputBuffer(&worker->output, watch->output, watch->outputLen, text);
+
+    oldCount = SplitLines(watch->shown, watch->shownLen, &old);
+    curCount = SplitLines(text, textLen, &cur);
+    if (oldCount < 0 || curCount < 0)
+        goto done;
+    chunk = ChunkGet(worker, 8 + textLen + 5 * (oldCount + curCount));
+    if (chunk == NULL)
+        goto done;
+    diff.out = chunk->out + FRAME_HEADER_SIZE + 8;
+    diff.run = NULL;
+    diff.changed = FALSE;
+    DiffLines(&diff, old, oldCount, cur, curCount);
+    watch->runs++;
+    watch->bytesFull += textLen;
+    if (diff.changed || watch->runs == 1) {
+        DWORD length = (DWORD)(diff.out - chunk->out) - FRAME_HEADER_SIZE;
+        PutU32(chunk->out + FRAME_HEADER_SIZE, curCount);
+        PutU32(chunk->out + FRAME_HEADER_SIZE + 4, textLen);
+        ChunkSeal(session, chunk, FRAME_WATCH_DIFF, length);
+        watch->bytesSent += chunk->length;
+        SessionQueueSend(worker, session, chunk);
+    } else {
+        ChunkPut(worker, chunk);
+    }
+    if (watch->shown)
+        HeapFree(GetProcessHeap(), 0, watch->shown);
+    watch->shown = text;
+    watch->shownLen = textLen;
+    text = NULL;
+    ok = TRUE;
+
+done:
+    if (old) HeapFree(GetProcessHeap(), 0, old);
+    if (cur) HeapFree(GetProcessHeap(), 0, cur);
+    if (text) HeapFree(GetProcessHeap(), 0, text);
+    return ok;
+}
+
+static void WatchFinishRun(Worker* worker, Watch* watch) {
+    BOOL sent;
+
+    CloseHandle(watch->hOutput);
+    CloseHandle(watch->hProcess);
+    watch->hOutput = NULL;
+    watch->hProcess = NULL;
+    TimerSet(&worker->timers, &watch->timer, GetTickCount64() + watch->interval);
+    sent = WatchSendUpdate(worker, watch);
+    watch->outputLen = 0;
+    if (!sent)
+        WatchStop(worker, watch->session, "server out of memory");
+}
+
+// Read more of the command's output. Past WATCH_MAX_OUTPUT the reads land
+// in the slack at the end of the buffer and are dropped.
+static void WatchPostRead(Worker* worker, Watch* watch) {
+    Session* session = watch->session;
+    DWORD offset = watch->outputLen < WATCH_MAX_OUTPUT ? watch->outputLen : WATCH_MAX_OUTPUT;
+
+    if (watch->outputSize < offset + WATCH_READ_SIZE) {
+        DWORD size = watch->outputSize ? watch->outputSize * 2 : 4 * WATCH_READ_SIZE;
+        char* output;
+        while (size < offset + WATCH_READ_SIZE)
+            size *= 2;
+        if (size > WATCH_MAX_OUTPUT + WATCH_READ_SIZE)
+            size = WATCH_MAX_OUTPUT + WATCH_READ_SIZE;
+        output = watch->output ? (char*)HeapReAlloc(GetProcessHeap(), 0, watch->output, size)
+                               : (char*)HeapAlloc(GetProcessHeap(), 0, size);
+        if (output == NULL) {
+            WatchStop(worker, session, "server out of memory");
+            return;
+        }
+        watch->output = output;
+        watch->outputSize = size;
+    }
+    SessionIoBegin(session, &watch->io, NULL);
+    if (!ReadFile(watch->hOutput, watch->output + offset, WATCH_READ_SIZE, NULL, &watch->io.ov) &&
+        GetLastError() != ERROR_IO_PENDING) {
+        // Broken pipe: the command is done and everything it wrote is in
+        watch->io.active = FALSE;
+        session->pending--;
+        WatchFinishRun(worker, watch);
+    }
+}
+
+// Start the command once more, its output going to a pipe on the port
+static void WatchRun(Worker* worker, Watch* watch) {
+    Session* session = watch->session;
+    SECURITY_ATTRIBUTES saAttr;
+    HANDLE hOutputWr = NULL;
+    BOOL started;
+
+    saAttr.nLength = sizeof(SECURITY_ATTRIBUTES);
+    saAttr.bInheritHandle = TRUE;
+    saAttr.lpSecurityDescriptor = NULL;
+    if (!CreateShellPipe(&watch->hOutput, &hOutputWr, TRUE, &saAttr)) {
+        WatchStop(worker, session, "cannot create a pipe for the command");
+        return;
+    }
+    // The command reads nothing
+    started = StartCommand(session, watch->commandLine, NULL, hOutputWr, NULL, &watch->hProcess);
+    CloseHandle(hOutputWr);
+    if (!started) {
+        WatchStop(worker, session, "cannot start the command");
+        return;
+    }
+    if (CreateIoCompletionPort(watch->hOutput, worker->iocp, (ULONG_PTR)session, 0) == NULL) {
+        TerminateProcess(watch->hProcess, 1);
+        WatchStop(worker, session, "cannot read the command's output");
+        return;
+    }
+    watch->outputLen = 0;
+    WatchPostRead(worker, watch);
+}
+
+// FRAME_WATCH: u32 interval in ms, then the command in UTF-8
+static void WatchStart(Worker* worker, Session* session, const char* payload, DWORD length) {
+    Watch* watch;
+
+    if (length <= 4)
+        return;
+    WatchStop(worker, session, NULL);
+    watch = (Watch*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(Watch));
+    if (watch != NULL)
+        watch->commandLine = CommandLineFromUtf8(payload + 4, length - 4);
+    if (watch == NULL || watch->commandLine == NULL) {
+        if (watch != NULL)
+            WatchFree(watch);
+        SessionSendFrame(worker, session, FRAME_WATCH_END, "bad watch request", 17);
+        return;
+    }
+    watch->interval = GetU32(payload);
+    if (watch->interval < WATCH_MIN_INTERVAL_MS)
+        watch->interval = WATCH_MIN_INTERVAL_MS;
+    watch->io.type = IO_WATCH_READ;
+    watch->timer.kind = TIMER_WATCH;
+    watch->timer.owner = watch;
+    watch->session = session;
+    session->watch = watch;
+    LOG_VAL2(LOG_INFO, "watch started", "session", session->id, "interval_ms", watch->interval);
+    WatchRun(worker, watch);
+}
+
+// A read of the command's output completed. A stopped watch only waited
+// for this to be freed.
+static void OnWatchRead(Worker* worker, Session* session, SessionIo* io, DWORD bytes, DWORD error) {
+    Watch* watch = (Watch*)io;
+
+    if (watch != session->watch) {
+        WatchFree(watch);
+        return;
+    }
+    if (error != 0) {
+        WatchFinishRun(worker, watch);
+        return;
+    }
+    watch->outputLen += bytes;
+    if (watch->outputLen > WATCH_MAX_OUTPUT)
+        watch->outputLen = WATCH_MAX_OUTPUT;
+    WatchPostRead(worker, watch);
+}
+
+// ---------------------------------------------------------------------------
+// Exec (-pipe)
+//
+// FRAME_EXEC runs one command beside the shell, in a job nested in the
+// session's, with its stdin and stdout on overlapped pipes: the client's
+// FRAME_EXEC_INPUT goes to stdin unchanged and the command's output comes
+// back as FRAME_EXEC_OUTPUT, both as raw bytes. Input is written in
+// EXEC_WRITE_SIZE chunks with up to EXEC_WRITE_DEPTH writes in flight, so
+// the pipe never waits for the next recv. The client may have at most
+// EXEC_WINDOW bytes outstanding and gets FRAME_CREDIT back as writes
+// complete; since that bounds what the server buffers, the socket is always
+// read and keystrokes or FRAME_EXEC_KILL never queue behind a bulk upload.
+// ---------------------------------------------------------------------------
+
+struct Exec {
+    HANDLE hProcess;                // cmd.exe /c <command>
+    HANDLE hJob;                    // nested in the session's job: kills the whole command
+    HANDLE hWait;                   // process exit -> WORKER_EXEC_EXITED
+    HANDLE hInput;                  // command's stdin (server end), NULL once closed
+    HANDLE hOutput;                 // command's stdout and stderr (server end)
+    SessionIo read;
+    SessionIo writes[EXEC_WRITE_DEPTH];
+    int writesActive;
+    RelayChunk* inputQueue;         // received, not yet being written
+    RelayChunk* inputTail;
+    DWORD buffered;                 // input bytes received and not yet credited
+    DWORD credit;                   // written bytes not yet credited
+    DWORD outHint;
+    BOOL eof;                       // FRAME_EXEC_EOF: close stdin once drained
+    BOOL exited;
+    BOOL outputDone;
+    LONGLONG bytesIn;
+    LONGLONG bytesOut;
+};
+
+static void CALLBACK ExecExitCallback(PVOID context, BOOLEAN timedOut) {
+    Session* session = (Session*)context;
+    PostQueuedCompletionStatus(g_Workers[session->worker]->iocp, WORKER_EXEC_EXITED, (ULONG_PTR)session, NULL);
+}
+
+static void ExecSendExit(Worker* worker, Session* session, DWORD code, const char* message) {
+    char payload[4 + 128];
+    DWORD length = message != NULL ? (DWORD)strlen(message) : 0;
+
+    if (length > sizeof(payload) - 4)
+        length = sizeof(payload) - 4;
+    PutU32(payload, code);
+    memcpy(payload + 4, message, length);
+    SessionSendFrame(worker, session, FRAME_EXEC_EXIT, payload, 4 + length);
+}
+
+// Return FRAME_CREDIT for what was written, in batches
+static void ExecGrant(Worker* worker, Session* session, BOOL now) {
+    Exec* exec = session->exec;
+    char payload[4];
+
+    if (exec->credit == 0 || (!now && exec->credit < EXEC_WINDOW / 4))
+        return;
+    PutU32(payload, exec->credit);
+    exec->buffered -= exec->credit;
+    exec->credit = 0;
+    SessionSendFrame(worker, session, FRAME_CREDIT, payload, 4);
+}
+
+// The command's stdin is gone (EOF sent or the command stopped reading):
+// what is still queued is dropped but credited, so the client can finish
+static void ExecCloseInput(Worker* worker, Session* session) {
+    Exec* exec = session->exec;
+
+    while (exec->inputQueue != NULL) {
+        RelayChunk* chunk = exec->inputQueue;
+        exec->inputQueue = chunk->next;
+        exec->credit += chunk->length;
+        ChunkPut(worker, chunk);
+    }
+    exec->inputTail = NULL;
+    if (exec->hInput != NULL && exec->writesActive == 0) {
+        CloseHandle(exec->hInput);
+        exec->hInput = NULL;
+    }
+}
+
+static void ExecFree(Worker* worker, Exec* exec) {
+    int i;
+
+    for (i = 0; i < EXEC_WRITE_DEPTH; i++)
+        if (exec->writes[i].chunk != NULL)
+            ChunkPut(worker, exec->writes[i].chunk);
+    while (exec->inputQueue != NULL) {
+        RelayChunk* chunk = exec->inputQueue;
+        exec->inputQueue = chunk->next;
+        ChunkPut(worker, chunk);
+    }
+    if (exec->hWait) UnregisterWaitEx(exec->hWait, NULL);
+    if (exec->hInput) CloseHandle(exec->hInput);
+    if (exec->hOutput) CloseHandle(exec->hOutput);
+    if (exec->hProcess) CloseHandle(exec->hProcess);
+    if (exec->hJob) CloseHandle(exec->hJob);
+    HeapFree(GetProcessHeap(), 0, exec);
+}
+
+// Done once the command has exited, its output is all read and no write is
+// in flight: report the exit code and drop the exec
+static void ExecSettle(Worker* worker, Session* session) {
+    Exec* exec = session->exec;
+    DWORD code = 1;
+
+    if (exec == NULL || !exec->exited || !exec->outputDone || exec->writesActive > 0)
+        return;
+    GetExitCodeProcess(exec->hProcess, &code);
+    LOG_VAL3(LOG_INFO, "command finished", "session", session->id,
+             "bytes_in", exec->bytesIn, "bytes_out", exec->bytesOut);
+    if (!session->closing)
+        ExecSendExit(worker, session, code, NULL);
+    session->exec = NULL;
+    ExecFree(worker, exec);
+}
+
+static void ExecPostRead(Worker* worker, Session* session) {
+    Exec* exec = session->exec;
+    SessionIo* io;
+    RelayChunk* chunk;
+
+    if (exec == NULL || exec->outputDone || exec->read.active || session->closing)
+        return;
+    io = &exec->read;
+    chunk = ChunkGet(worker, exec->outHint);
+    if (chunk == NULL) {
+        LOG_VAL(LOG_ERROR, "out of relay buffers", "session", session->id);
+        SessionClose(session);
+        return;
+    }
+    SessionIoBegin(session, io, chunk);
+    if (!ReadFile(exec->hOutput, chunk->out + FRAME_HEADER_SIZE, chunk->size, NULL, &io->ov) &&
+        GetLastError() != ERROR_IO_PENDING) {
+        // Broken pipe: the command and everything it started are done writing
+        io->active = FALSE;
+        io->chunk = NULL;
+        session->pending--;
+        ChunkPut(worker, chunk);
+        exec->outputDone = TRUE;
+        ExecSettle(worker, session);
+    }
+}
+
+static void OnExecRead(Worker* worker, Session* session, RelayChunk* chunk, DWORD bytes, DWORD error) {
+    Exec* exec = session->exec;
+
+    if (error != 0 || session->closing) {
+        ChunkPut(worker, chunk);
+        exec->outputDone = TRUE;
+        ExecSettle(worker, session);
+        return;
+    }
+    if (bytes == 0) {
+        ChunkPut(worker, chunk);
+        ExecPostRead(worker, session);
+        return;
+    }
+    exec->bytesOut += bytes;
+    exec->outHint = NextChunkSize(chunk->size, bytes);
+    ChunkSeal(session, chunk, FRAME_EXEC_OUTPUT, bytes);
+    chunk->source = SOURCE_EXEC;
+    SessionQueueSend(worker, session, chunk);
+}
+
+static void ExecPostWrite(Worker* worker, Session* session, SessionIo* io, RelayChunk* chunk) {
+    Exec* exec = session->exec;
+
+    SessionIoBegin(session, io, chunk);
+    exec->writesActive++;
+    if (!WriteFile(exec->hInput, chunk->data + chunk->offset, chunk->length - chunk->offset, NULL, &io->ov) &&
+        GetLastError() != ERROR_IO_PENDING) {
+        io->active = FALSE;
+        io->chunk = NULL;
+        session->pending--;
+        exec->writesActive--;
+        exec->credit += chunk->length;
+        ChunkPut(worker, chunk);
+        ExecCloseInput(worker, session);
+    }
+}
+
+// Keep up to EXEC_WRITE_DEPTH writes going; close stdin after the last one
+static void ExecPump(Worker* worker, Session* session) {
+    Exec* exec = session->exec;
+    int i;
+
+    if (exec == NULL)
+        return;
+    for (i = 0; i < EXEC_WRITE_DEPTH && exec->hInput != NULL && exec->inputQueue != NULL; i++) {
+        RelayChunk* chunk;
+        if (exec->writes[i].active)
+            continue;
+        chunk = exec->inputQueue;
+        exec->inputQueue = chunk->next;
+        if (exec->inputQueue == NULL)
+            exec->inputTail = NULL;
+        ExecPostWrite(worker, session, &exec->writes[i], chunk);
+    }
+    if (exec->eof && exec->inputQueue == NULL)
+        ExecCloseInput(worker, session);
+    ExecGrant(worker, session, exec->hInput == NULL);
+}
+
+static void OnExecWritten(Worker* worker, Session* session, SessionIo* io, RelayChunk* chunk,
+                          DWORD bytes, DWORD error) {
+    Exec* exec = session->exec;
+
+    exec->writesActive--;
+    if (error != 0 || session->closing) {
+        exec->credit += chunk->length;
+        ChunkPut(worker, chunk);
+        ExecCloseInput(worker, session);
+    } else {
+        chunk->offset += bytes;
+        exec->bytesIn += bytes;
+        if (chunk->offset < chunk->length) {
+            ExecPostWrite(worker, session, io, chunk);
+            return;
+        }
+        exec->credit += chunk->length;
+        ChunkPut(worker, chunk);
+    }
+    if (!session->closing)
+        ExecPump(worker, session);
+    ExecSettle(worker, session);
+}
+
+// A piece of FRAME_EXEC_INPUT: append it to the queue; ExecPump() writes it
+static void ExecInput(Worker* worker, Session* session, const char* data, DWORD length) {
+    Exec* exec = session->exec;
+
+    if (exec == NULL)
+        return;
+    exec->buffered += length;
+    if (exec->buffered > EXEC_WINDOW) {
+        LOG_VAL(LOG_WARN, "client ignored flow control", "session", session->id);
+        SessionClose(session);
+        return;
+    }
+    if (exec->hInput == NULL || exec->eof) {
+        exec->credit += length;     // nobody reads it any more
+        return;
+    }
+    while (length > 0) {
+        RelayChunk* tail = exec->inputTail;
+        DWORD n;
+        if (tail == NULL || tail->length == tail->size) {
+            tail = ChunkGet(worker, EXEC_WRITE_SIZE);
+            if (tail == NULL) {
+                LOG_VAL(LOG_ERROR, "out of relay buffers", "session", session->id);
+                SessionClose(session);
+                return;
+            }
+            tail->next = NULL;
+            if (exec->inputTail != NULL)
+                exec->inputTail->next = tail;
+            else
+                exec->inputQueue = tail;
+            exec->inputTail = tail;
+        }
+        n = tail->size - tail->length < length ? tail->size - tail->length : length;
+        memcpy(tail->data + tail->length, data, n);
+        tail->length += n;
+        data += n;
+        length -= n;
+    }
+}
+
+// FRAME_EXEC: start the command and give the client its first window
+static void ExecStart(Worker* worker, Session* session, const char* payload, DWORD length) {
+    SECURITY_ATTRIBUTES saAttr;
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits;
+    HANDLE hInputRd = NULL, hOutputWr = NULL;
+    WCHAR* commandLine = NULL;
+    Exec* exec;
+    char window[4];
+    BOOL started = FALSE;
+    int i;
+
+    if (session->exec != NULL) {
+        ExecSendExit(worker, session, (DWORD)-1, "a command is already running");
+        return;
+    }
+    exec = (Exec*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(Exec));
+    if (exec == NULL) {
+        ExecSendExit(worker, session, (DWORD)-1, "server out of memory");
+        return;
+    }
+    exec->read.type = IO_EXEC_READ;
+    for (i = 0; i < EXEC_WRITE_DEPTH; i++)
+        exec->writes[i].type = IO_EXEC_WRITE;
+    exec->outHint = RELAY_MIN_BUFFER;
+
+    saAttr.nLength = sizeof(SECURITY_ATTRIBUTES);
+    saAttr.bInheritHandle = TRUE;
+    saAttr.lpSecurityDescriptor = NULL;
+    ZeroMemory(&limits, sizeof(limits));
+    limits.BasicLimitInformation.LimitFlags = JOB_OBJECT_LIMIT_KILL_ON_JOB_CLOSE;
+    commandLine = CommandLineFromUtf8(payload, length);
+    exec->hJob = CreateJobObjectA(NULL, NULL);
+    if (commandLine != NULL && exec->hJob != NULL &&
+        SetInformationJobObject(exec->hJob, JobObjectExtendedLimitInformation, &limits, sizeof(limits)) &&
+        CreateShellPipe(&exec->hInput, &hInputRd, FALSE, &saAttr) &&
+        CreateShellPipe(&exec->hOutput, &hOutputWr, TRUE, &saAttr))
+        started = StartCommand(session, commandLine, hInputRd, hOutputWr, exec->hJob, &exec->hProcess);
+    if (hInputRd) CloseHandle(hInputRd);
+    if (hOutputWr) CloseHandle(hOutputWr);
+    if (commandLine) HeapFree(GetProcessHeap(), 0, commandLine);
+    if (!started ||
+        CreateIoCompletionPort(exec->hInput, worker->iocp, (ULONG_PTR)session, 0) == NULL ||
+        CreateIoCompletionPort(exec->hOutput, worker->iocp, (ULONG_PTR)session, 0) == NULL ||
+        !RegisterWaitForSingleObject(&exec->hWait, exec->hProcess, ExecExitCallback, session,
+                                     INFINITE, WT_EXECUTEONLYONCE)) {
+        if (exec->hJob)
+            TerminateJobObject(exec->hJob, 1);
+        exec->hWait = NULL;
+        ExecFree(worker, exec);
+        ExecSendExit(worker, session, (DWORD)-1, "cannot start the command");
+        return;
+    }
+    session->pending++;             // the exit notification
+    session->exec = exec;
+    LOG_VAL(LOG_INFO, "command started", "session", session->id);
+    ExecPostRead(worker, session);
+    PutU32(window, EXEC_WINDOW);
+    SessionSendFrame(worker, session, FRAME_CREDIT, window, 4);
+}
+
+// WORKER_EXEC_EXITED: the command's process is gone. Whatever it left
+// running goes with its job, which also ends its output.
+static void ExecExited(Worker* worker, Session* session) {
+    Exec* exec = session->exec;
+
+    session->pending--;
+    TerminateJobObject(exec->hJob, 0);
+    exec->exited = TRUE;
+    ExecSettle(worker, session);
+}
+
+static void ExecKill(Session* session) {
+    if (session->exec != NULL)
+        TerminateJobObject(session->exec->hJob, 1);
+}
+
+// ---------------------------------------------------------------------------
+// Local transport
+//
+// A client on the same host can move a session's data off TCP. Right after
+// connecting it sends LOCAL_MAGIC. The server finds the process that owns
+// the other end of the loopback connection in the TCP table. It creates a
+// section holding one ring of LOCAL_RING_SIZE bytes for each direction,
+// plus four auto-reset events, and duplicates them into that process. The
+// reply is LOCAL_MAGIC, a status and the handle values. It goes over TCP,
+// behind whatever output was already on its way. After it, all of the
+// session's data runs through the rings as a fresh byte stream, so the
+// client may still say FRAME_MAGIC. The socket stays open but carries
+// nothing. If it closes, or resets because the client died, the session
+// ends as it would on TCP. If the request cannot be met (the peer is not
+// local, or its process cannot be opened), the status says why and the
+// session carries on over TCP.
+//
+// Each ring has one writer and one reader, and each side advances its own
+// free-running counter. The events work like a futex: they are only for
+// sleeping. A side that finds its ring empty (or full) sets its waiting
+// flag, looks again and sleeps. The other side signals only when it sees
+// the flag. The server sleeps in a wait completion packet, so a signal
+// arrives on the worker's port as the completion of the receive or send it
+// stands for. The client counters in shared memory are never trusted.
+// ---------------------------------------------------------------------------
+
+#define RING_BROKEN ((DWORD)-1)
+
+// Bytes in the ring, or RING_BROKEN if the counters make no sense
+static DWORD RingUsed(const LocalRing* ring, DWORD size) {
+    DWORD used = ring->head - ring->tail;
+    return used <= size ? used : RING_BROKEN;
+}
+
+// Copy in what fits; the caller wakes the reader
+static DWORD RingWrite(LocalRing* ring, char* data, DWORD size, const char* in, DWORD length) {
+    DWORD used = RingUsed(ring, size);
+    DWORD at = ring->head & (size - 1), first;
+
+    if (used == RING_BROKEN)
+        return RING_BROKEN;
+    MemoryBarrier();                // the reader is done with the space before it is reused
+    if (length > size - used)
+        length = size - used;
+    first = size - at < length ? size - at : length;
+    memcpy(data + at, in, first);
+    memcpy(data, in + first, length - first);
+    MemoryBarrier();                // the bytes are there before the head says so
+    ring->head += length;
+    return length;
+}
+
+// Copy out what is there; the caller wakes the writer
+static DWORD RingRead(LocalRing* ring, const char* data, DWORD size, char* out, DWORD length) {
+    DWORD used = RingUsed(ring, size);
+    DWORD at = ring->tail & (size - 1), first;
+
+    if (used == RING_BROKEN)
+        return RING_BROKEN;
+    MemoryBarrier();                // the head is read before the bytes it covers
+    if (length > used)
+        length = used;
+    first = size - at < length ? size - at : length;
+    memcpy(out, data + at, first);
+    memcpy(out + first, data, length - first);
+    MemoryBarrier();
+    ring->tail += length;
+    return length;
+}
+
+// After moving a counter: wake the other side if it went to sleep. The
+// fence orders the counter before the flag, as the sleeper's exchange
+// orders its flag before looking at the counter again.
+static void RingWake(volatile LONG* waiting, HANDLE event) {
+    MemoryBarrier();
+    if (*waiting != 0 && InterlockedExchange(waiting, 0) != 0)
+        SetEvent(event);
+}
+
+// Wait completion packets (Windows 8 and later, from ntdll like
+// NtSetInformationFile): an event signalled while a packet is associated
+// with it queues one completion to the port
+typedef LONG (WINAPI *NtCreateWaitCompletionPacketFn)(HANDLE*, ACCESS_MASK, PVOID);
+typedef LONG (WINAPI *NtAssociateWaitCompletionPacketFn)(HANDLE, HANDLE, HANDLE, PVOID, PVOID, LONG,
+                                                         ULONG_PTR, BOOLEAN*);
+
+static NtCreateWaitCompletionPacketFn g_CreateWaitPacket = NULL;
+static NtAssociateWaitCompletionPacketFn g_AssociateWaitPacket = NULL;
+
+static BOOL LocalLoadApi(void) {
+    HMODULE ntdll;
+
+    if (g_AssociateWaitPacket != NULL)
+        return TRUE;
+    ntdll = GetModuleHandleA("ntdll.dll");
+    g_CreateWaitPacket = (NtCreateWaitCompletionPacketFn)GetProcAddress(ntdll, "NtCreateWaitCompletionPacket");
+    if (g_CreateWaitPacket == NULL)
+        return FALSE;
+    g_AssociateWaitPacket = (NtAssociateWaitCompletionPacketFn)GetProcAddress(ntdll,
+                                                                             "NtAssociateWaitCompletionPacket");
+    return g_AssociateWaitPacket != NULL;
+}
+
+// Process at the other end of a loopback connection, 0 if the peer is not
+// on this host. The client's end of the connection is a row of its own in
+// the TCP table, with the addresses the other way round.
+static DWORD LocalPeerProcessId(SOCKET sock) {
+    static const unsigned char mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    SOCKADDR_STORAGE peer, self;
+    int peerLength = sizeof(peer), selfLength = sizeof(self);
+    const unsigned char* address;
+    ULONG family = AF_INET;
+    u_short peerPort, selfPort;
+    DWORD v4 = 0, size = 0, pid = 0, i;
+    void* table;
+
+    if (getpeername(sock, (struct sockaddr*)&peer, &peerLength) != 0 ||
+        getsockname(sock, (struct sockaddr*)&self, &selfLength) != 0)
+        return 0;
+    if (peer.ss_family == AF_INET6) {
+        address = (const unsigned char*)&((struct sockaddr_in6*)&peer)->sin6_addr;
+        peerPort = ((struct sockaddr_in6*)&peer)->sin6_port;
+        selfPort = ((struct sockaddr_in6*)&self)->sin6_port;
+        if (memcmp(address, mapped, sizeof(mapped)) == 0)
+            memcpy(&v4, address + 12, 4);           // an IPv4 client of a dual-stack listener
+        else if (memcmp(address, &in6addr_loopback, 16) == 0)
+            family = AF_INET6;
+        else
+            return 0;
+    } else {
+        v4 = ((struct sockaddr_in*)&peer)->sin_addr.s_addr;
+        peerPort = ((struct sockaddr_in*)&peer)->sin_port;
+        selfPort = ((struct sockaddr_in*)&self)->sin_port;
+    }
+    if (family == AF_INET && ((const unsigned char*)&v4)[0] != 127)
+        return 0;
+
+    if (GetExtendedTcpTable(NULL, &size, FALSE, family, TCP_TABLE_OWNER_PID_CONNECTIONS, 0) != ERROR_INSUFFICIENT_BUFFER)
+        return 0;
+    size += size / 4;               // room for connections made meanwhile
+    table = HeapAlloc(GetProcessHeap(), 0, size);
+    if (table == NULL)
+        return 0;
+    if (GetExtendedTcpTable(table, &size, FALSE, family, TCP_TABLE_OWNER_PID_CONNECTIONS, 0) == NO_ERROR) {
+        if (family == AF_INET) {
+            MIB_TCPTABLE_OWNER_PID* v4Table = (MIB_TCPTABLE_OWNER_PID*)table;
+            for (i = 0; i < v4Table->dwNumEntries && pid == 0; i++) {
+                MIB_TCPROW_OWNER_PID* row = &v4Table->table[i];
+                if (row->dwLocalAddr == v4 && (u_short)row->dwLocalPort == peerPort &&
+                    (u_short)row->dwRemotePort == selfPort)
+                    pid = row->dwOwningPid;
+            }
+        } else {
+            MIB_TCP6TABLE_OWNER_PID* v6Table = (MIB_TCP6TABLE_OWNER_PID*)table;
+            for (i = 0; i < v6Table->dwNumEntries && pid == 0; i++) {
+                MIB_TCP6ROW_OWNER_PID* row = &v6Table->table[i];
+                if (memcmp(row->ucLocalAddr, address, 16) == 0 && (u_short)row->dwLocalPort == peerPort &&
+                    (u_short)row->dwRemotePort == selfPort)
+                    pid = row->dwOwningPid;
+            }
+        }
+    }
+    HeapFree(GetProcessHeap(), 0, table);
+    return pid;
+}
+
+static void LocalLinkFree(LocalLink* link) {
+    int i;
+
+    if (link->readPacket) CloseHandle(link->readPacket);
+    if (link->writePacket) CloseHandle(link->writePacket);
+    if (link->shared) UnmapViewOfFile(link->shared);
+    if (link->hSection) CloseHandle(link->hSection);
+    for (i = 0; i < LOCAL_EVENTS; i++)
+        if (link->events[i]) CloseHandle(link->events[i]);
+    HeapFree(GetProcessHeap(), 0, link);
+}
+
+// Map the section and make the packets for a link whose section and events
+// are set. The ring size is ours: the client can write ringSize, so it is
+// never read back, and the view must be large enough for it.
+static BOOL LocalMap(LocalLink* link) {
+    MEMORY_BASIC_INFORMATION view;
+
+    link->watch.type = IO_LOCAL_WATCH;
+    link->shared = (LocalShared*)MapViewOfFile(link->hSection, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    if (link->shared == NULL || !LocalLoadApi() ||
+        g_CreateWaitPacket(&link->readPacket, GENERIC_ALL, NULL) < 0 ||
+        g_CreateWaitPacket(&link->writePacket, GENERIC_ALL, NULL) < 0)
+        return FALSE;
+    if (VirtualQuery(link->shared, &view, sizeof(view)) != sizeof(view) ||
+        view.RegionSize < sizeof(LocalShared) + 2 * LOCAL_RING_SIZE) {
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return FALSE;
+    }
+    link->size = LOCAL_RING_SIZE;
+    link->toServer = (char*)(link->shared + 1);
+    link->toClient = link->toServer + link->size;
+    return TRUE;
+}
+
+// Sleep on one of our events: its signal completes io on the worker's port
+static BOOL LocalSleep(Worker* worker, Session* session, HANDLE packet, HANDLE event, SessionIo* io) {
+    BOOLEAN signalled = FALSE;
+    return g_AssociateWaitPacket(packet, worker->iocp, event, session, &io->ov, 0, 0, &signalled) >= 0;
+}
+
+// The client hung up, or the socket says it is gone: what it sent is read
+// before the session ends, and a send waiting for room fails
+static void LocalHangUp(LocalLink* link) {
+    InterlockedExchange(&link->shared->closed, 1);
+    SetEvent(link->events[LOCAL_SERVER_DATA]);
+    SetEvent(link->events[LOCAL_SERVER_SPACE]);
+}
+
+// LOCAL_MAGIC: set up the rings if the client is on this host and queue the
+// reply, which tells the client where to find them or why not
+static void LocalStart(Worker* worker, Session* session) {
+    LocalLink* link = NULL;
+    RelayChunk* reply;
+    HANDLE hClient = NULL;
+    ULONGLONG handles[1 + LOCAL_EVENTS];
+    DWORD status = NO_ERROR, pid;
+    int duplicated = 0, i;
+
+    ZeroMemory(handles, sizeof(handles));
+    pid = LocalPeerProcessId(session->sock);
+    if (pid == 0 || !LocalLoadApi()) {
+        status = ERROR_NOT_SUPPORTED;
+    } else if ((hClient = OpenProcess(PROCESS_DUP_HANDLE, FALSE, pid)) == NULL ||
+               (link = (LocalLink*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(LocalLink))) == NULL) {
+        status = GetLastError();
+    } else {
+        link->hSection = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0,
+                                            sizeof(LocalShared) + 2 * LOCAL_RING_SIZE, NULL);
+        for (i = 0; i < LOCAL_EVENTS; i++)
+            if ((link->events[i] = CreateEvent(NULL, FALSE, FALSE, NULL)) == NULL)
+                break;
+        if (link->hSection == NULL || i < LOCAL_EVENTS || !LocalMap(link)) {
+            status = GetLastError();
+        } else {
+            // For the client only; we go by LOCAL_RING_SIZE
+            link->shared->ringSize = LOCAL_RING_SIZE;
+            for (; duplicated < 1 + LOCAL_EVENTS; duplicated++)
+                if (!DuplicateToProcess(duplicated == 0 ? link->hSection : link->events[duplicated - 1],
+                                        hClient, &handles[duplicated]))
+                    break;
+            if (duplicated < 1 + LOCAL_EVENTS)
+                status = GetLastError();
+        }
+    }
+    if (status != NO_ERROR) {
+        // Handles already in the client go away again
+        for (i = 0; i < duplicated; i++)
+            DuplicateHandle(hClient, (HANDLE)(ULONG_PTR)handles[i], NULL, NULL, 0, FALSE, DUPLICATE_CLOSE_SOURCE);
+        ZeroMemory(handles, sizeof(handles));
+        if (link != NULL)
+            LocalLinkFree(link);
+        LOG_VAL2(LOG_INFO, "local transport declined", "session", session->id, "error", status);
+    } else {
+        session->local = link;
+        LOG_VAL2(LOG_INFO, "client uses the local transport", "session", session->id, "pid", pid);
+    }
+    if (hClient != NULL)
+        CloseHandle(hClient);
+
+    reply = ChunkGet(worker, LOCAL_REPLY_SIZE);
+    if (reply == NULL) {
+        SessionClose(session);
+        return;
+    }
+    memcpy(reply->out, LOCAL_MAGIC, FRAME_MAGIC_SIZE);
+    PutU32(reply->out + FRAME_MAGIC_SIZE, status);
+    for (i = 0; i < 1 + LOCAL_EVENTS; i++) {
+        PutU32(reply->out + FRAME_MAGIC_SIZE + 4 + 8 * i, (DWORD)handles[i]);
+        PutU32(reply->out + FRAME_MAGIC_SIZE + 8 + 8 * i, (DWORD)(handles[i] >> 32));
+    }
+    reply->length = LOCAL_REPLY_SIZE;
+    reply->source = SOURCE_LOCAL;
+    SessionQueueSend(worker, session, reply);
+}
+
+// -takeover: the predecessor's link, with handles it duplicated into us
+static BOOL LocalAdopt(Session* session, ULONGLONG section, const ULONGLONG* events) {
+    LocalLink* link = (LocalLink*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(LocalLink));
+    int i;
+
+    if (link == NULL)
+        return FALSE;
+    link->hSection = (HANDLE)(ULONG_PTR)section;
+    for (i = 0; i < LOCAL_EVENTS; i++)
+        link->events[i] = (HANDLE)(ULONG_PTR)events[i];
+    link->sending = TRUE;           // the reply went out before the handoff
+    session->local = link;
+    return LocalMap(link);
+}
+
+// The socket carries nothing once the rings are in use: its receive only
+// completes when the client closes it or goes away
+static void LocalPostWatch(Worker* worker, Session* session) {
+    SessionIo* io = &session->local->watch;
+    WSABUF none;
+    DWORD flags = 0;
+
+    none.buf = NULL;
+    none.len = 0;
+    SessionIoBegin(session, io, NULL);
+    if (WSARecv(session->sock, &none, 1, NULL, &flags, &io->ov, NULL) == SOCKET_ERROR &&
+        WSAGetLastError() != WSA_IO_PENDING) {
+        LOG_VAL2(LOG_WARN, "recv failed", "session", session->id, "error", WSAGetLastError());
+        SessionIoFailed(worker, session, io);
+    }
+}
+
+static void OnLocalWatch(Worker* worker, Session* session, DWORD error) {
+    char byte;
+
+    if (error == ERROR_OPERATION_ABORTED && !session->closing) {
+        if (!session->parking)
+            LocalPostWatch(worker, session);
+        return;
+    }
+    if (error == 0 && recv(session->sock, &byte, 1, MSG_PEEK) == SOCKET_ERROR &&
+        WSAGetLastError() == WSAEWOULDBLOCK) {
+        LocalPostWatch(worker, session);
+        return;
+    }
+    // Closed, reset, or bytes where none belong: the client is done
+    LocalHangUp(session->local);
+}
+
+// Wait for client input on the ring; see PostSocketRead()
+static void LocalPostRead(Worker* worker, Session* session) {
+    LocalLink* link = session->local;
+    LocalRing* ring = &link->shared->toServer;
+    SessionIo* io = &session->io[IO_SOCK_RECV];
+
+    if (!link->watch.active)
+        LocalPostWatch(worker, session);
+    if (session->closing)
+        return;
+    SessionIoBegin(session, io, NULL);
+    if (!LocalSleep(worker, session, link->readPacket, link->events[LOCAL_SERVER_DATA], io)) {
+        LOG_VAL(LOG_WARN, "cannot wait for the local ring", "session", session->id);
+        SessionIoFailed(worker, session, io);
+        return;
+    }
+    // Input that came after the last look would have found no flag
+    InterlockedExchange(&ring->readerWaiting, 1);
+    if (RingUsed(ring, link->size) != 0 || link->shared->closed)
+        SetEvent(link->events[LOCAL_SERVER_DATA]);
+}
+
+// recv() on the ring: SOCKET_ERROR and WSAEWOULDBLOCK while it is empty, 0
+// once the client has hung up and all it sent has been read
+static int LocalRecv(Session* session, char* buffer, DWORD size) {
+    LocalLink* link = session->local;
+    LocalRing* ring = &link->shared->toServer;
+    DWORD got;
+
+    ring->readerWaiting = 0;
+    got = RingRead(ring, link->toServer, link->size, buffer, size);
+    if (got == RING_BROKEN) {
+        WSASetLastError(WSAECONNABORTED);
+        return SOCKET_ERROR;
+    }
+    if (got > 0) {
+        RingWake(&ring->writerWaiting, link->events[LOCAL_CLIENT_SPACE]);
+        return (int)got;
+    }
+    if (link->shared->closed)
+        return 0;
+    WSASetLastError(WSAEWOULDBLOCK);
+    return SOCKET_ERROR;
+}
+
+// WSASend() on the ring. What fits is copied and completes at once; with
+// the ring full, the send sleeps and completes with 0 bytes once the client
+// has made room, and OnSent() tries again.
+static void LocalPostSend(Worker* worker, Session* session, RelayChunk* chunk) {
+    LocalLink* link = session->local;
+    LocalRing* ring = &link->shared->toClient;
+    SessionIo* io = &session->io[IO_SOCK_SEND];
+    DWORD put;
+
+    SessionIoBegin(session, io, chunk);
+    if (link->shared->closed) {
+        LOG_VAL(LOG_INFO, "client disconnected", "session", session->id);
+        SessionIoFailed(worker, session, io);
+        return;
+    }
+    put = RingWrite(ring, link->toClient, link->size, chunk->out + chunk->offset, chunk->length - chunk->offset);
+    if (put == RING_BROKEN) {
+        LOG_VAL(LOG_WARN, "local ring broken", "session", session->id);
+        SessionIoFailed(worker, session, io);
+        return;
+    }
+    if (put > 0) {
+        RingWake(&ring->readerWaiting, link->events[LOCAL_CLIENT_DATA]);
+        session->syscallsOut++;
+        PostQueuedCompletionStatus(worker->iocp, put, (ULONG_PTR)session, &io->ov);
+        return;
+    }
+    if (!LocalSleep(worker, session, link->writePacket, link->events[LOCAL_SERVER_SPACE], io)) {
+        LOG_VAL(LOG_WARN, "cannot wait for the local ring", "session", session->id);
+        SessionIoFailed(worker, session, io);
+        return;
+    }
+    InterlockedExchange(&ring->writerWaiting, 1);
+    if (RingUsed(ring, link->size) != link->size || link->shared->closed)
+        SetEvent(link->events[LOCAL_SERVER_SPACE]);
+}
+
+// Wake whatever sleeps on the rings, on both sides; our own sleeps complete
+// and are counted down like cancelled receives
+static void LocalClose(Session* session) {
+    LocalLink* link = session->local;
+    int i;
+
+    InterlockedExchange(&link->shared->closed, 1);
+    for (i = 0; i < LOCAL_EVENTS; i++)
+        SetEvent(link->events[i]);
+}
+
+// Handoff: stop waiting for input, like cancelling a receive. What the
+// client writes meanwhile stays in the ring for the successor.
+static void LocalPark(Session* session) {
+    LocalLink* link = session->local;
+
+    if (session->io[IO_SOCK_RECV].active)
+        SetEvent(link->events[LOCAL_SERVER_DATA]);
+    if (link->watch.active)
+        CancelIoEx((HANDLE)session->sock, &link->watch.ov);
+}
+
+// ---------------------------------------------------------------------------
+// Heartbeats and timeouts
+//
+// Every session has one timer on its worker's wheel, set for the earliest
+// check that may be due: a keepalive check, -idletimeout or
+// -sessiontimeout. Input only records the time. The timer works out what is
+// due when it fires and sets itself again, so traffic costs nothing extra.
+// A framed client that has been silent for g_KeepaliveMs gets a FRAME_PING.
+// Once KEEPALIVE_PROBES pings go unanswered, the client is dead. Plain
+// clients (telnet) cannot answer pings, so their socket gets TCP keepalive
+// at the same interval instead. That fails the pending receive once the
+// peer is gone. A session the server ends is closed like any other, and
+// its job takes down everything the shell started.
+// ---------------------------------------------------------------------------
+
+// TCP keepalive: after g_KeepaliveMs of silence the stack probes the peer
+// every second and resets the connection if nobody answers
+static void SessionKeepalive(Session* session) {
+    struct tcp_keepalive settings;
+    DWORD returned;
+
+    if (g_KeepaliveMs == 0)
+        return;
+    settings.onoff = 1;
+    settings.keepalivetime = g_KeepaliveMs;
+    settings.keepaliveinterval = 1000;
+    if (WSAIoctl(session->sock, SIO_KEEPALIVE_VALS, &settings, sizeof(settings), NULL, 0,
+                 &returned, NULL, NULL) != 0)
+        LOG_VAL2(LOG_WARN, "cannot enable TCP keepalive", "session", session->id, "error", WSAGetLastError());
+}
+
+// The earlier of two due times; 0 is none
+static ULONGLONG EarlierDue(ULONGLONG a, ULONGLONG b) {
+    return a == 0 || (b != 0 && b < a) ? b : a;
+}
+
+// The session's timer fired: end the session if a limit has passed, ping a
+// silent client, and set the timer for whatever comes next
+static void SessionTimer(Worker* worker, Session* session, ULONGLONG now) {
+    ULONGLONG next = 0;
+
+    if (session->closing)
+        return;
+    if (session->parking) {
+        // Handoff: start nothing; a resumed session is checked again soon
+        TimerSet(&worker->timers, &session->timer, now + 1000);
+        return;
+    }
+    if (g_SessionLimitMs != 0) {
+        if (now - session->started >= g_SessionLimitMs) {
+            LOG_VAL2(LOG_INFO, "session reaped: time limit", "session", session->id,
+                     "reaped_time_limit", InterlockedIncrement(&g_ReapedLimit));
+            SessionClose(session);
+            return;
+        }
+        next = session->started + g_SessionLimitMs;
+    }
+    if (g_IdleTimeoutMs != 0) {
+        // A running watch or -pipe command is not idle, whatever the keyboard does
+        if (session->watch != NULL || session->exec != NULL)
+            session->lastInput = now;
+        if (now - session->lastInput >= g_IdleTimeoutMs) {
+            LOG_VAL2(LOG_INFO, "session reaped: idle", "session", session->id,
+                     "reaped_idle", InterlockedIncrement(&g_ReapedIdle));
+            SessionClose(session);
+            return;
+        }
+        next = EarlierDue(next, session->lastInput + g_IdleTimeoutMs);
+    }
+    if (g_KeepaliveMs != 0 && session->protocol != PROTO_RAW) {
+        ULONGLONG due;
+
+        // Output waiting for the client to read it is watched by TCP's own
+        // retransmissions; a slow reader is not a dead one
+        if (session->io[IO_SOCK_SEND].active) {
+            session->lastHeard = now;
+            session->pings = 0;
+        }
+        if (session->protocol == PROTO_FRAMED &&
+            now - session->lastHeard >= (ULONGLONG)g_KeepaliveMs * (session->pings + 1)) {
+            if (session->pings >= KEEPALIVE_PROBES) {
+                LOG_VAL2(LOG_INFO, "session reaped: peer dead", "session", session->id,
+                         "reaped_dead", InterlockedIncrement(&g_ReapedDead));
+                SessionClose(session);
+                return;
+            }
+            SessionSendFrame(worker, session, FRAME_PING, NULL, 0);
+            session->pings++;
+        }
+        // A client yet to say what it speaks is looked at again later
+        due = session->lastHeard + (ULONGLONG)g_KeepaliveMs * (session->pings + 1);
+        next = EarlierDue(next, due > now ? due : now + g_KeepaliveMs);
+    }
+    if (next != 0)
+        TimerSet(&worker->timers, &session->timer, next);
+}
+
+// A session joins its worker (new or taken over): keepalive on, timer set
+static void SessionTimerStart(Worker* worker, Session* session) {
+    ULONGLONG now = GetTickCount64();
+
+    session->timer.kind = TIMER_SESSION;
+    session->timer.owner = session;
+    session->lastHeard = now;
+    if (session->started == 0) {
+        session->started = now;
+        session->lastInput = now;
+    }
+    SessionKeepalive(session);
+    SessionTimer(worker, session, now);
+}
+
+// A control frame from a framed client
+static void SessionControl(Worker* worker, Session* session, int type, const char* payload, DWORD length) {
+    switch (type) {
+        case FRAME_WATCH:
+            WatchStart(worker, session, payload, length);
+            break;
+        case FRAME_WATCH_STOP:
+            WatchStop(worker, session, "stopped");
+            break;
+        case FRAME_EXEC:
+            ExecStart(worker, session, payload, length);
+            break;
+        case FRAME_EXEC_EOF:
+            if (session->exec != NULL) {
+                session->exec->eof = TRUE;
+                ExecPump(worker, session);
+            }
+            break;
+        case FRAME_EXEC_KILL:
+            ExecKill(session);
+            break;
+        case FRAME_PONG:
+            break;          // arrival was all that counted
+        default:
+            break;          // from a newer client; nothing to do here
+    }
+}
+
+static void SessionIoDone(Worker* worker, Session* session, SessionIo* io, DWORD bytes, DWORD error) {
+    RelayChunk* chunk = io->chunk;
+
+    io->active = FALSE;
+    io->chunk = NULL;
+    session->pending--;
+    if (io->type == IO_WATCH_READ) {
+        OnWatchRead(worker, session, io, bytes, error);
+    } else if (io->type == IO_EXEC_READ) {
+        OnExecRead(worker, session, chunk, bytes, error);
+    } else if (io->type == IO_EXEC_WRITE) {
+        OnExecWritten(worker, session, io, chunk, bytes, error);
+    } else if (session->closing) {
+        if (chunk != NULL)
+            ChunkPut(worker, chunk);
+    } else {
+        switch (io->type) {
+            case IO_PIPE_READ: OnPipeRead(worker, session, bytes, error); break;
+            case IO_SOCK_SEND: OnSent(worker, session, chunk, bytes, error); break;
+            case IO_SOCK_RECV: OnSocketReadable(worker, session, error); break;
+            case IO_PIPE_WRITE: OnPipeWritten(worker, session, chunk, bytes, error); break;
+            case IO_LOCAL_WATCH: OnLocalWatch(worker, session, error); break;
+        }
+    }
+    SessionSettle(worker, session);
+}
+
+// Handle a command posted to the worker; FALSE ends the I/O thread
+static BOOL WorkerControl(Worker* worker, DWORD command, Session* session) {
+    Session* next;
+    int reads;
+
+    switch (command) {
+        case WORKER_START:
+            SessionLink(worker, session);
+            LOG_VAL3(LOG_INFO, "client connected", "session", session->id,
+                     "worker", worker->index, "sessions", g_SessionCount);
+            SessionTimerStart(worker, session);
+            PostPipeRead(worker, session);
+            PostSocketRead(worker, session);
+            SessionSettle(worker, session);
+            break;
+
+        case WORKER_STOP:
+            for (session = worker->sessions; session != NULL; session = next) {
+                next = session->next;
+                SessionClose(session);
+                SessionSettle(worker, session);
+            }
+            break;
+
+        case WORKER_PARK:
+            // Watches and -pipe commands cannot be handed over. With any
+            // running the worker reports at once without parking anything,
+            // and the handoff is refused.
+            worker->commands = 0;
+            for (session = worker->sessions; session != NULL; session = session->next)
+                if (session->watch != NULL || session->exec != NULL)
+                    worker->commands++;
+            if (worker->commands > 0) {
+                SetEvent(worker->hParked);
+                break;
+            }
+            // Reads only wait for data, so cancelling them loses nothing;
+            // sends and writes carry data and are left to finish
+            worker->parking = TRUE;
+            for (session = worker->sessions; session != NULL; session = session->next) {
+                session->parking = TRUE;
+                if (session->local != NULL)
+                    LocalPark(session);
+                else if (session->io[IO_SOCK_RECV].active)
+                    CancelIoEx((HANDLE)session->sock, &session->io[IO_SOCK_RECV].ov);
+                if (session->io[IO_PIPE_READ].active)
+                    CancelIoEx(session->hStdoutRd, &session->io[IO_PIPE_READ].ov);
+            }
+            WorkerCheckParked(worker);
+            break;
+
+        case WORKER_RESUME:
+            worker->parking = FALSE;
+            for (session = worker->sessions; session != NULL; session = next) {
+                next = session->next;
+                session->parking = FALSE;
+                // Only the reads parking held back: after a handoff that
+                // timed out, a send still in flight or a cancelled read yet
+                // to complete posts the next one itself
+                reads = session->parkedReads;
+                session->parkedReads = 0;
+                if ((reads & (1 << IO_PIPE_READ)) && !session->io[IO_PIPE_READ].active)
+                    PostPipeRead(worker, session);
+                if ((reads & (1 << IO_SOCK_RECV)) && !session->io[IO_SOCK_RECV].active)
+                    PostSocketRead(worker, session);
+                SessionSettle(worker, session);
+            }
+            break;
+
+        case WORKER_RELEASE:
+            // Handed off: drop our references, the successor relays now
+            while (worker->sessions != NULL) {
+                session = worker->sessions;
+                SessionUnlink(worker, session);
+                TimerCancel(&worker->timers, &session->timer);
+                SessionFree(session, TRUE);
+                InterlockedDecrement(&g_SessionCount);
+            }
+            worker->parking = FALSE;
+            break;
+
+        case WORKER_EXEC_EXITED:
+            ExecExited(worker, session);
+            SessionSettle(worker, session);
+            break;
+
+        case WORKER_EXIT:
+            return FALSE;
+    }
+    return TRUE;
+}
+
+// Fire every timer that is due
+static void WorkerRunTimers(Worker* worker) {
+    ULONGLONG now = GetTickCount64();
+    Timer* timer;
+
+    while ((timer = TimerExpired(&worker->timers, now)) != NULL) {
+        if (timer->kind == TIMER_WATCH) {
+            WatchRun(worker, (Watch*)timer->owner);
+        } else {
+            Session* session = (Session*)timer->owner;
+            SessionTimer(worker, session, now);
+            SessionSettle(worker, session);
+        }
+    }
+}
+
+static DWORD WINAPI IoWorkerThread(LPVOID lpParam) {
+    Worker* worker = (Worker*)lpParam;
+    DWORD_PTR affinity = WorkerAffinity(worker->index);
+    OVERLAPPED* ov;
+    ULONG_PTR key;
+    DWORD bytes;
+
+    // Keystrokes and output go ahead of any shell's CPU work, and stay on
+    // the processor that accepted the connection
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_ABOVE_NORMAL);
+    if (affinity != 0)
+        SetThreadAffinityMask(GetCurrentThread(), affinity);
+
+    for (;;) {
+        BOOL ok = GetQueuedCompletionStatus(worker->iocp, &bytes, &key, &ov,
+                                            TimerTimeout(&worker->timers, GetTickCount64()));
+        if (ov != NULL)
+            SessionIoDone(worker, (Session*)key, (SessionIo*)ov, bytes, ok ? 0 : GetLastError());
+        else if (!ok && GetLastError() == WAIT_TIMEOUT)
+            ;       // a timer is due
+        else if (!ok || !WorkerControl(worker, bytes, (Session*)key))
+            break;
+        WorkerRunTimers(worker);
+    }
+    LogThreadDetach();
+    return 0;
+}
+
+// Microseconds since this process was created, for -activated start times
+static LONGLONG ProcessAgeMicroseconds(void) {
+    FILETIME created, exited, kernel, user, now;
+    ULARGE_INTEGER from, to;
+
+    if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+        return 0;
+    GetSystemTimePreciseAsFileTime(&now);
+    from.LowPart = created.dwLowDateTime;
+    from.HighPart = created.dwHighDateTime;
+    to.LowPart = now.dwLowDateTime;
+    to.HighPart = now.dwHighDateTime;
+    return (LONGLONG)(to.QuadPart - from.QuadPart) / 10;
+}
+
+// New client: spawn its shell and pass it to the worker's I/O thread.
+// Runs on the accept thread.
+static void StartSession(SOCKET clientSocket, int worker) {
+    Session* session = SessionAlloc();
+    u_long nonBlocking = 1;
+
+    if (session == NULL) {
+        closesocket(clientSocket);
+        return;
+    }
+    session->id = InterlockedIncrement(&g_NextSessionId);
+    session->sock = clientSocket;
+    session->worker = worker;
+
+    if (!CreateChildProcessWithPipes(session)) {
+        LOG_VAL(LOG_ERROR, "failed to create child process", "session", session->id);
+        SessionFree(session, FALSE);
+        return;
+    }
+    // recv() after the zero-byte receive must never block the I/O thread
+    ioctlsocket(session->sock, FIONBIO, &nonBlocking);
+    if (!SessionAttach(session)) {
+        LOG_VAL2(LOG_ERROR, "cannot attach session to its worker", "session", session->id, "error", GetLastError());
+        SessionFree(session, FALSE);
+        return;
+    }
+    InterlockedIncrement(&g_SessionCount);
+    if (g_Activated && InterlockedExchange(&g_ActivationServed, 1) == 0)
+        LOG_VAL2(LOG_INFO, "activated: first session started", "session", session->id,
+                 "since_start_us", ProcessAgeMicroseconds());
+    PostQueuedCompletionStatus(g_Workers[worker]->iocp, WORKER_START, (ULONG_PTR)session, NULL);
+}
+
+// Ask every session to stop and wait (bounded) until they are gone
+static void StopAllSessions(void) {
+    DWORD waited = 0;
+
+    WorkerPostAll(WORKER_STOP);
+    while (g_SessionCount > 0 && waited < 5000) {
+        Sleep(10);
+        waited += 10;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Listeners and accept threads
+//
+// Every listener is shared by all workers. Each accept thread keeps one
+// AcceptEx posted per listener, so the kernel hands each new connection to
+// exactly one waiting worker, which then creates the session (shell
+// included) on its processor. No thread serializes accepts.
+// ---------------------------------------------------------------------------
+
+// Split "host", "host:port", "[v6]:port" or a bare IPv6 address.
+// port must hold 16 bytes.
+static void ParseEndpoint(const char* text, char* host, int hostSize, char* port, int defaultPort) {
+    const char* colon = strrchr(text, ':');
+    int length;
+
+    sprintf(port, "%d", defaultPort);
+    if (text[0] == '[') {
+        const char* end = strchr(text, ']');
+        length = end != NULL ? (int)(end - text - 1) : (int)strlen(text + 1);
+        if (end != NULL && end[1] == ':')
+            sprintf(port, "%.15s", end + 2);
+        text++;
+    } else if (colon != NULL && strchr(text, ':') == colon) {
+        length = (int)(colon - text);
+        sprintf(port, "%.15s", colon + 1);
+    } else {
+        length = (int)strlen(text);
+    }
+    if (length >= hostSize)
+        length = hostSize - 1;
+    memcpy(host, text, length);
+    host[length] = '\0';
+}
+
+static SOCKET CreateListenSocket(const struct sockaddr* address, int addressLength) {
+    SOCKET listenSocket;
+    DWORD v6Only = 0;
+
+    // Create socket
+    listenSocket = WSASocketA(address->sa_family, SOCK_STREAM, IPPROTO_TCP, NULL, 0,
+                              WSA_FLAG_OVERLAPPED | WSA_FLAG_NO_HANDLE_INHERIT);
+    if (listenSocket == INVALID_SOCKET) {
+        LOG_VAL(LOG_ERROR, "socket creation failed", "error", WSAGetLastError());
+        return INVALID_SOCKET;
+    }
+
+    // The IPv6 wildcard also takes IPv4 connections
+    if (address->sa_family == AF_INET6 &&
+        memcmp(&((const struct sockaddr_in6*)address)->sin6_addr, &in6addr_any, sizeof(in6addr_any)) == 0)
+        setsockopt(listenSocket, IPPROTO_IPV6, IPV6_V6ONLY, (const char*)&v6Only, sizeof(v6Only));
+
+    // Bind socket
+    if (bind(listenSocket, address, addressLength) == SOCKET_ERROR) {
+        LOG_VAL(LOG_ERROR, "bind failed", "error", WSAGetLastError());
+        closesocket(listenSocket);
+        return INVALID_SOCKET;
+    }
+
+    // Listen
+    if (listen(listenSocket, SOMAXCONN) == SOCKET_ERROR) {
+        LOG_VAL(LOG_ERROR, "listen failed", "error", WSAGetLastError());
+        closesocket(listenSocket);
+        return INVALID_SOCKET;
+    }
+    return listenSocket;
+}
+
+// One listener per -listen option; without any, a dual-stack socket on
+// [::]:port, or 0.0.0.0:port where IPv6 is unavailable
+static BOOL CreateListenSockets(void) {
+    struct addrinfo hints;
+    struct addrinfo* result;
+    char host[256];
+    char port[16];
+    int i;
+
+    if (g_ListenSpecCount == 0) {
+        struct sockaddr_in6 any6;
+        struct sockaddr_in any4;
+        ZeroMemory(&any6, sizeof(any6));
+        any6.sin6_family = AF_INET6;
+        any6.sin6_port = htons((u_short)g_ListenPort);
+        g_Listeners[0] = CreateListenSocket((struct sockaddr*)&any6, sizeof(any6));
+        g_ListenerFamily[0] = AF_INET6;
+        if (g_Listeners[0] == INVALID_SOCKET) {
+            ZeroMemory(&any4, sizeof(any4));
+            any4.sin_family = AF_INET;
+            any4.sin_addr.s_addr = INADDR_ANY;
+            any4.sin_port = htons((u_short)g_ListenPort);
+            g_Listeners[0] = CreateListenSocket((struct sockaddr*)&any4, sizeof(any4));
+            g_ListenerFamily[0] = AF_INET;
+        }
+        if (g_Listeners[0] == INVALID_SOCKET)
+            return FALSE;
+        LOG_VAL2(LOG_INFO, "listening on any address", "port", g_ListenPort, "ipv6", g_ListenerFamily[0] == AF_INET6);
+        g_ListenerCount = 1;
+        return TRUE;
+    }
+
+    for (i = 0; i < g_ListenSpecCount; i++) {
+        ParseEndpoint(g_ListenSpecs[i], host, sizeof(host), port, g_ListenPort);
+        ZeroMemory(&hints, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo(host[0] != '\0' ? host : NULL, port, &hints, &result) != 0) {
+            LOG_VAL(LOG_ERROR, "cannot resolve listen address", "index", i);
+            return FALSE;
+        }
+        g_Listeners[i] = CreateListenSocket(result->ai_addr, (int)result->ai_addrlen);
+        g_ListenerFamily[i] = result->ai_family;
+        freeaddrinfo(result);
+        if (g_Listeners[i] == INVALID_SOCKET)
+            return FALSE;
+        g_ListenerCount = i + 1;
+        LOG_VAL3(LOG_INFO, "listening", "index", i, "port", atoi(port), "ipv6", g_ListenerFamily[i] == AF_INET6);
+    }
+    return TRUE;
+}
+
+static void CloseListenSockets(void) {
+    int i;
+    for (i = 0; i < g_ListenerCount; i++)
+        closesocket(g_Listeners[i]);
+    g_ListenerCount = 0;
+}
+
+static void PostAccept(Worker* worker, int listener) {
+    DWORD bytes;
+    OVERLAPPED* ov = &worker->acceptOv[listener];
+
+    ResetEvent(ov->hEvent);
+    worker->acceptSock[listener] = WSASocketA(g_ListenerFamily[listener], SOCK_STREAM, IPPROTO_TCP, NULL, 0,
+                                              WSA_FLAG_OVERLAPPED | WSA_FLAG_NO_HANDLE_INHERIT);
+    if (worker->acceptSock[listener] != INVALID_SOCKET &&
+        (AcceptEx(g_Listeners[listener], worker->acceptSock[listener], worker->addresses[listener], 0,
+                  ACCEPT_ADDR_SIZE, ACCEPT_ADDR_SIZE, &bytes, ov) ||
+         WSAGetLastError() == ERROR_IO_PENDING))
+        return;
+
+    // Wake the accept thread so it retries after a pause instead of going deaf
+    LOG_VAL2(LOG_WARN, "AcceptEx failed", "worker", worker->index, "error", WSAGetLastError());
+    if (worker->acceptSock[listener] != INVALID_SOCKET)
+        closesocket(worker->acceptSock[listener]);
+    worker->acceptSock[listener] = INVALID_SOCKET;
+    SetEvent(ov->hEvent);
+}
+
+static void CompleteAccept(Worker* worker, int listener) {
+    SOCKET sock = worker->acceptSock[listener];
+    DWORD bytes;
+
+    worker->acceptSock[listener] = INVALID_SOCKET;
+    if (sock == INVALID_SOCKET) {
+        Sleep(100);
+        return;
+    }
+    if (!GetOverlappedResult((HANDLE)g_Listeners[listener], &worker->acceptOv[listener], &bytes, TRUE)) {
+        if (GetLastError() != ERROR_OPERATION_ABORTED)
+            LOG_VAL2(LOG_WARN, "accept failed", "worker", worker->index, "error", GetLastError());
+        closesocket(sock);
+        return;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_UPDATE_ACCEPT_CONTEXT,
+               (const char*)&g_Listeners[listener], sizeof(SOCKET));
+    worker->accepted++;
+    StartSession(sock, worker->index);
+}
+
+static DWORD WINAPI AcceptThread(LPVOID lpParam) {
+    Worker* worker = (Worker*)lpParam;
+    HANDLE waitHandles[MAX_LISTENERS + 1];
+    DWORD_PTR affinity = WorkerAffinity(worker->index);
+    int i;
+
+    if (affinity != 0)
+        SetThreadAffinityMask(GetCurrentThread(), affinity);
+
+    waitHandles[0] = g_AcceptStopEvent;
+    for (i = 0; i < g_ListenerCount; i++) {
+        waitHandles[i + 1] = worker->acceptOv[i].hEvent;
+        PostAccept(worker, i);
+    }
+
+    for (;;) {
+        DWORD waitResult = WaitForMultipleObjects(g_ListenerCount + 1, waitHandles, FALSE, INFINITE);
+        if (waitResult <= WAIT_OBJECT_0 || waitResult > WAIT_OBJECT_0 + (DWORD)g_ListenerCount)
+            break;
+        i = (int)(waitResult - WAIT_OBJECT_0 - 1);
+        CompleteAccept(worker, i);
+        PostAccept(worker, i);
+    }
+
+    // A connection accepted while stopping still gets its session
+    for (i = 0; i < g_ListenerCount; i++) {
+        if (worker->acceptSock[i] != INVALID_SOCKET) {
+            CancelIoEx((HANDLE)g_Listeners[i], &worker->acceptOv[i]);
+            CompleteAccept(worker, i);
+        }
+    }
+    LogThreadDetach();
+    return 0;
+}
+
+// Create the workers and their I/O threads; accepting starts separately
+static BOOL StartWorkers(void) {
+    int i, j;
+
+    for (i = 0; i < g_WorkerCount; i++) {
+        Worker* worker = (Worker*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, sizeof(Worker));
+        if (worker == NULL)
+            return FALSE;
+        worker->index = i;
+        worker->iocp = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+        worker->hReadEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        worker->hParked = CreateEvent(NULL, TRUE, FALSE, NULL);
+        for (j = 0; j < MAX_LISTENERS; j++)
+            worker->acceptOv[j].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        OutputTranscoderInit(&worker->output, GetOEMCP());
+        worker->input.codePage = GetOEMCP();
+        g_Workers[i] = worker;
+        if (worker->iocp == NULL)
+            return FALSE;
+        worker->hIoThread = CreateThread(NULL, 0, IoWorkerThread, worker, 0, NULL);
+        if (worker->hIoThread == NULL)
+            return FALSE;
+    }
+    LOG_VAL(LOG_INFO, "workers started", "workers", g_WorkerCount);
+    return TRUE;
+}
+
+static BOOL StartAccepting(void) {
+    int i;
+
+    ResetEvent(g_AcceptStopEvent);
+    for (i = 0; i < g_WorkerCount; i++) {
+        g_Workers[i]->hAcceptThread = CreateThread(NULL, 0, AcceptThread, g_Workers[i], 0, NULL);
+        if (g_Workers[i]->hAcceptThread == NULL)
+            return FALSE;
+    }
+    LOG_VAL2(LOG_INFO, "accepting", "workers", g_WorkerCount, "listeners", g_ListenerCount);
+    return TRUE;
+}
+
+static void StopAccepting(void) {
+    int i;
+
+    SetEvent(g_AcceptStopEvent);
+    for (i = 0; i < g_WorkerCount; i++) {
+        if (g_Workers[i] != NULL && g_Workers[i]->hAcceptThread != NULL) {
+            WaitForSingleObject(g_Workers[i]->hAcceptThread, INFINITE);
+            CloseHandle(g_Workers[i]->hAcceptThread);
+            g_Workers[i]->hAcceptThread = NULL;
+        }
+    }
+}
+
+// End the I/O threads once they have worked through their queues
+static void StopWorkers(void) {
+    int i, j;
+
+    WorkerPostAll(WORKER_EXIT);
+    for (i = 0; i < g_WorkerCount; i++) {
+        Worker* worker = g_Workers[i];
+        if (worker == NULL)
+            continue;
+        if (worker->hIoThread != NULL) {
+            WaitForSingleObject(worker->hIoThread, INFINITE);
+            CloseHandle(worker->hIoThread);
+        }
+        LOG_VAL2(LOG_INFO, "worker", "worker", i, "accepted", worker->accepted);
+        ChunkPoolFree(worker);
+        for (j = 0; j < MAX_LISTENERS; j++)
+            CloseHandle(worker->acceptOv[j].hEvent);
+        if (worker->iocp != NULL)
+            CloseHandle(worker->iocp);
+        CloseHandle(worker->hReadEvent);
+        CloseHandle(worker->hParked);
+        HeapFree(GetProcessHeap(), 0, worker);
+        g_Workers[i] = NULL;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Zero-downtime handoff
+// ---------------------------------------------------------------------------
+
+// Move exactly length bytes over the overlapped control pipe
+static BOOL HandoffTransfer(HANDLE pipe, void* data, DWORD length, BOOL write) {
+    OVERLAPPED ov;
+    DWORD done = 0;
+    BOOL ok = TRUE;
+
+    ZeroMemory(&ov, sizeof(ov));
+    ov.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    while (ok && length > 0) {
+        ResetEvent(ov.hEvent);
+        ok = write ? WriteFile(pipe, data, length, NULL, &ov)
+                   : ReadFile(pipe, data, length, NULL, &ov);
+        if (!ok && GetLastError() == ERROR_IO_PENDING) {
+            if (WaitForSingleObject(ov.hEvent, HANDOFF_TIMEOUT_MS) != WAIT_OBJECT_0)
+                CancelIoEx(pipe, &ov);
+            ok = TRUE;
+        }
+        if (ok)
+            ok = GetOverlappedResult(pipe, &ov, &done, TRUE) && done > 0;
+        data = (char*)data + done;
+        length -= done;
+    }
+    CloseHandle(ov.hEvent);
+    return ok;
+}
+
+// Only SYSTEM and administrators may open the control pipe
+#define HANDOFF_PIPE_SDDL "D:P(A;;GA;;;SY)(A;;GA;;;BA)"
+
+// Start waiting for a successor on the control pipe. It has a single
+// instance, created by us: if another process holds the name, no successor
+// can mistake it for the server.
+static HANDLE HandoffListen(OVERLAPPED* ov) {
+    SECURITY_ATTRIBUTES sa;
+    PSECURITY_DESCRIPTOR sd = NULL;
+    HANDLE pipe;
+
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorA(HANDOFF_PIPE_SDDL, SDDL_REVISION_1, &sd, NULL)) {
+        LOG_VAL(LOG_WARN, "handoff pipe unavailable", "error", GetLastError());
+        return INVALID_HANDLE_VALUE;
+    }
+    sa.nLength = sizeof(sa);
+    sa.lpSecurityDescriptor = sd;
+    sa.bInheritHandle = FALSE;
+    pipe = CreateNamedPipeA(HANDOFF_PIPE_NAME,
+                            PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                            PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_REJECT_REMOTE_CLIENTS,
+                            1, 4096, 4096, 0, &sa);
+    if (pipe == INVALID_HANDLE_VALUE)
+        LOG_VAL(LOG_WARN, "handoff pipe unavailable", "error", GetLastError());
+    LocalFree(sd);
+    if (pipe == INVALID_HANDLE_VALUE)
+        return pipe;
+    ResetEvent(ov->hEvent);
+    if (!ConnectNamedPipe(pipe, ov)) {
+        DWORD error = GetLastError();
+        if (error == ERROR_PIPE_CONNECTED)
+            SetEvent(ov->hEvent);
+        else if (error != ERROR_IO_PENDING)
+            LOG_VAL(LOG_WARN, "ConnectNamedPipe failed", "error", error);
+    }
+    return pipe;
+}
+
+// Successor side: the control pipe must be served by the server that
+// listens on our port. Otherwise the integers coming over it are not our
+// handles.
+static BOOL HandoffServerIsListener(HANDLE pipe) {
+    char host[256];
+    char port[16];
+    ULONG serverPid = 0;
+    DWORD owner;
+
+    if (g_ListenSpecCount > 0)
+        ParseEndpoint(g_ListenSpecs[0], host, sizeof(host), port, g_ListenPort);
+    else
+        sprintf(port, "%d", g_ListenPort);
+    owner = FindServerProcessId(atoi(port));
+    if (!GetNamedPipeServerProcessId(pipe, &serverPid) || owner == 0 || serverPid != owner) {
+        LOG_VAL2(LOG_ERROR, "takeover: control pipe not served by the listening server",
+                 "pid", serverPid, "listener_pid", owner);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static BOOL DuplicateToProcess(HANDLE source, HANDLE targetProcess, ULONGLONG* target) {
+    HANDLE dup = NULL;
+    if (!DuplicateHandle(GetCurrentProcess(), source, targetProcess, &dup, 0, FALSE, DUPLICATE_SAME_ACCESS))
+        return FALSE;
+    *target = (ULONGLONG)(ULONG_PTR)dup;
+    return TRUE;
+}
+
+// FileReplaceCompletionInformation (Windows 8.1 and later). A completion
+// port binding belongs to the file object, which duplicated handles share,
+// so a session must leave our port before a successor can bind it to its
+// own, and come back to it if the handoff fails.
+#define FILE_REPLACE_COMPLETION_INFORMATION 61
+
+typedef struct {
+    HANDLE Port;
+    PVOID Key;
+} FileCompletionInformation;
+
+typedef struct {
+    union { LONG Status; PVOID Pointer; } u;
+    ULONG_PTR Information;
+} IoStatusBlock;
+
+typedef LONG (WINAPI *NtSetInformationFileFn)(HANDLE, IoStatusBlock*, PVOID, ULONG, int);
+
+static BOOL ReplaceCompletionPort(HANDLE handle, HANDLE port, ULONG_PTR key) {
+    static NtSetInformationFileFn setInformationFile = NULL;
+    FileCompletionInformation info;
+    IoStatusBlock status;
+
+    if (setInformationFile == NULL)
+        setInformationFile = (NtSetInformationFileFn)GetProcAddress(GetModuleHandleA("ntdll.dll"),
+                                                                    "NtSetInformationFile");
+    if (setInformationFile == NULL)
+        return FALSE;
+    info.Port = port;
+    info.Key = (PVOID)key;
+    return setInformationFile(handle, &status, &info, sizeof(info), FILE_REPLACE_COMPLETION_INFORMATION) >= 0;
+}
+
+// port == NULL detaches the session from every port
+static BOOL SessionRebind(Session* session, HANDLE port) {
+    ULONG_PTR key = port != NULL ? (ULONG_PTR)session : 0;
+    return ReplaceCompletionPort((HANDLE)session->sock, port, key) &&
+           ReplaceCompletionPort(session->hStdoutRd, port, key) &&
+           ReplaceCompletionPort(session->hStdinWr, port, key);
+}
+
+// Old process side. A successor has connected to the control pipe: stop
+// accepting, park every session, duplicate the listeners and sessions into
+// it and, once it confirms, drop our copies without touching the
+// connections or shells. On any failure the sessions are resumed and FALSE
+// is returned.
+static BOOL HandoffToSuccessor(HANDLE pipe) {
+    HandoffHello hello;
+    HandoffHeader header;
+    HandoffSession record;
+    LARGE_INTEGER start, end, frequency;
+    HANDLE hSuccessor = NULL;
+    HANDLE parked[MAX_WORKERS];
+    Session* session;
+    ULONG peerPid = 0;
+    DWORD ack = 0;
+    DWORD released = HANDOFF_RELEASED;
+    BOOL ok = FALSE, parkedAll;
+    int i, j, commands = 0;
+
+    if (!HandoffTransfer(pipe, &hello, sizeof(hello), FALSE) || hello.magic != HANDOFF_MAGIC)
+        return FALSE;
+    QueryPerformanceCounter(&start);
+    LOG_VAL(LOG_INFO, "handoff requested", "pid", hello.processId);
+
+    // Everything is duplicated into hello.processId: it must be the process
+    // at the other end of the pipe, not one it names
+    if (!GetNamedPipeClientProcessId(pipe, &peerPid) || peerPid != hello.processId) {
+        LOG_VAL2(LOG_ERROR, "handoff: successor is not the pipe client", "pid", hello.processId, "peer", peerPid);
+        return FALSE;
+    }
+
+    hSuccessor = OpenProcess(PROCESS_DUP_HANDLE, FALSE, hello.processId);
+    if (hSuccessor == NULL) {
+        LOG_VAL(LOG_ERROR, "handoff: cannot open successor", "error", GetLastError());
+        return FALSE;
+    }
+
+    // Quiesce: no new sessions, and every session parks once the sends and
+    // shell writes it has in flight are done. The worker lists stay put
+    // while parked, so this thread may walk them. A client that stops
+    // reading or a shell that stops taking input never finishes, so the
+    // wait is bounded and the handoff is abandoned after it.
+    StopAccepting();
+    for (i = 0; i < g_WorkerCount; i++) {
+        ResetEvent(g_Workers[i]->hParked);
+        g_Workers[i]->commands = 0;
+        parked[i] = g_Workers[i]->hParked;
+    }
+    WorkerPostAll(WORKER_PARK);
+    parkedAll = WaitForMultipleObjects(g_WorkerCount, parked, TRUE, HANDOFF_PARK_MS) != WAIT_TIMEOUT;
+    for (i = 0; i < g_WorkerCount; i++)
+        commands += g_Workers[i]->commands;
+    if (commands > 0) {
+        // Those workers kept relaying, so their lists may not be walked
+        LOG_VAL(LOG_ERROR, "handoff refused: watch or -pipe commands running", "commands", commands);
+        parkedAll = FALSE;
+        goto resume;
+    }
+    if (!parkedAll) {
+        LOG_VAL(LOG_ERROR, "handoff: sessions did not park", "timeout_ms", HANDOFF_PARK_MS);
+        goto resume;
+    }
+
+    ZeroMemory(&header, sizeof(header));
+    header.magic = HANDOFF_MAGIC;
+    for (i = 0; i < g_WorkerCount; i++)
+        header.sessionCount += g_Workers[i]->sessionCount;
+
+    // Pending connections stay queued on the listeners meanwhile
+    header.listenerCount = g_ListenerCount;
+    for (i = 0; i < g_ListenerCount; i++) {
+        if (WSADuplicateSocketA(g_Listeners[i], hello.processId, &header.listeners[i]) != 0)
+            goto resume;
+    }
+    if (!HandoffTransfer(pipe, &header, sizeof(header), TRUE))
+        goto resume;
+
+    for (i = 0; i < g_WorkerCount; i++) {
+        for (session = g_Workers[i]->sessions; session != NULL; session = session->next) {
+            ZeroMemory(&record, sizeof(record));
+            record.id = session->id;
+            record.outLeadByte = session->outLeadByte;
+            record.outHasLeadByte = session->outHasLeadByte;
+            record.inCarry = session->inCarry;
+            record.protocol = session->protocol;
+            record.helloLen = session->helloLen;
+            memcpy(record.frameHeader, session->frames.header, FRAME_HEADER_SIZE);
+            record.frameHeaderLen = session->frames.headerLen;
+            record.frameType = session->frames.type;
+            record.frameRemaining = session->frames.remaining;
+            record.started = session->started;
+            record.lastInput = session->lastInput;
+            if (!SessionRebind(session, NULL) ||
+                WSADuplicateSocketA(session->sock, hello.processId, &record.socket) != 0 ||
+                !DuplicateToProcess(session->hStdinWr, hSuccessor, &record.hStdinWr) ||
+                !DuplicateToProcess(session->hStdoutRd, hSuccessor, &record.hStdoutRd) ||
+                !DuplicateToProcess(session->hProcess, hSuccessor, &record.hProcess) ||
+                !DuplicateToProcess(session->hJob, hSuccessor, &record.hJob))
+                goto resume;
+            if (session->local != NULL) {
+                // The client keeps its view; the successor maps the same section
+                if (!DuplicateToProcess(session->local->hSection, hSuccessor, &record.localSection))
+                    goto resume;
+                for (j = 0; j < LOCAL_EVENTS; j++)
+                    if (!DuplicateToProcess(session->local->events[j], hSuccessor, &record.localEvents[j]))
+                        goto resume;
+            }
+            if (!HandoffTransfer(pipe, &record, sizeof(record), TRUE))
+                goto resume;
+        }
+    }
+
+    if (!HandoffTransfer(pipe, &ack, sizeof(ack), FALSE) || ack != HANDOFF_MAGIC)
+        goto resume;
+
+    // The successor owns everything now: closing our duplicates leaves the
+    // connections and shells alive. It starts relaying only when told, so
+    // there is no going back from here even if that message is lost.
+    WorkerPostAll(WORKER_RELEASE);
+    if (!HandoffTransfer(pipe, &released, sizeof(released), TRUE))
+        LOG_VAL(LOG_ERROR, "handoff: successor not told to start", "error", GetLastError());
+
+    QueryPerformanceCounter(&end);
+    QueryPerformanceFrequency(&frequency);
+    LOG_VAL2(LOG_INFO, "handoff complete", "sessions", header.sessionCount,
+             "pause_us", (end.QuadPart - start.QuadPart) * 1000000 / frequency.QuadPart);
+    ok = TRUE;
+
+resume:
+    if (!ok) {
+        LOG_VAL(LOG_ERROR, "handoff failed, resuming sessions", "error", GetLastError());
+        // Only parked workers have sessions that may have left their port
+        for (i = 0; i < g_WorkerCount && parkedAll; i++)
+            for (session = g_Workers[i]->sessions; session != NULL; session = session->next)
+                SessionRebind(session, g_Workers[i]->iocp);
+        WorkerPostAll(WORKER_RESUME);
+        StartAccepting();
+    }
+    CloseHandle(hSuccessor);
+    return ok;
+}
+
+// New process side (-takeover): receive the listeners and live sessions
+// from the running server and start relaying for them
+static BOOL TakeOverFromPredecessor(void) {
+    HandoffHello hello;
+    HandoffHeader header;
+    HandoffSession record;
+    Session* session;
+    Session* received = NULL;
+    HANDLE pipe;
+    DWORD ack = HANDOFF_MAGIC;
+    DWORD released = 0;
+    u_long nonBlocking = 1;
+    DWORD i;
+
+    if (!WaitNamedPipeA(HANDOFF_PIPE_NAME, HANDOFF_TIMEOUT_MS)) {
+        LOG_VAL(LOG_ERROR, "takeover: no running server found", "error", GetLastError());
+        return FALSE;
+    }
+    pipe = CreateFileA(HANDOFF_PIPE_NAME, GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                       OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+    if (pipe == INVALID_HANDLE_VALUE) {
+        LOG_VAL(LOG_ERROR, "takeover: cannot open control pipe", "error", GetLastError());
+        return FALSE;
+    }
+    if (!HandoffServerIsListener(pipe)) {
+        CloseHandle(pipe);
+        return FALSE;
+    }
+
+    hello.magic = HANDOFF_MAGIC;
+    hello.processId = GetCurrentProcessId();
+    if (!HandoffTransfer(pipe, &hello, sizeof(hello), TRUE) ||
+        !HandoffTransfer(pipe, &header, sizeof(header), FALSE) ||
+        header.magic != HANDOFF_MAGIC) {
+        LOG_MSG(LOG_ERROR, "takeover: handshake failed");
+        CloseHandle(pipe);
+        return FALSE;
+    }
+
+    for (i = 0; i < header.listenerCount && i < MAX_LISTENERS; i++) {
+        g_Listeners[i] = WSASocketA(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO,
+                                    &header.listeners[i], 0, WSA_FLAG_OVERLAPPED | WSA_FLAG_NO_HANDLE_INHERIT);
+        g_ListenerFamily[i] = header.listeners[i].iAddressFamily;
+        if (g_Listeners[i] == INVALID_SOCKET) {
+            LOG_VAL(LOG_ERROR, "takeover: cannot open listener", "error", WSAGetLastError());
+            CloseListenSockets();
+            CloseHandle(pipe);
+            return FALSE;
+        }
+        g_ListenerCount = i + 1;
+    }
+
+    for (i = 0; i < header.sessionCount; i++) {
+        if (!HandoffTransfer(pipe, &record, sizeof(record), FALSE))
+            break;
+        session = SessionAlloc();
+        if (session == NULL)
+            break;
+        session->id = record.id;
+        session->sock = WSASocketA(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO,
+                                   &record.socket, 0, WSA_FLAG_OVERLAPPED | WSA_FLAG_NO_HANDLE_INHERIT);
+        session->hStdinWr = (HANDLE)(ULONG_PTR)record.hStdinWr;
+        session->hStdoutRd = (HANDLE)(ULONG_PTR)record.hStdoutRd;
+        session->hProcess = (HANDLE)(ULONG_PTR)record.hProcess;
+        session->hJob = (HANDLE)(ULONG_PTR)record.hJob;
+        session->outLeadByte = record.outLeadByte;
+        session->outHasLeadByte = record.outHasLeadByte;
+        session->inCarry = record.inCarry;
+        session->protocol = record.protocol;
+        session->helloLen = record.helloLen;
+        memcpy(session->frames.header, record.frameHeader, FRAME_HEADER_SIZE);
+        session->frames.headerLen = record.frameHeaderLen;
+        session->frames.type = record.frameType;
+        session->frames.remaining = record.frameRemaining;
+        session->started = record.started;
+        session->lastInput = record.lastInput;
+        session->worker = record.id % g_WorkerCount;
+        if (record.id > g_NextSessionId)
+            g_NextSessionId = record.id;
+        session->next = received;
+        received = session;
+        ioctlsocket(session->sock, FIONBIO, &nonBlocking);
+        if (record.localSection != 0 && !LocalAdopt(session, record.localSection, record.localEvents)) {
+            LOG_VAL2(LOG_ERROR, "takeover: cannot map local transport", "session", session->id, "error", GetLastError());
+            break;
+        }
+        if (!SessionAttach(session)) {
+            LOG_VAL2(LOG_ERROR, "takeover: cannot attach session", "session", session->id, "error", GetLastError());
+            break;
+        }
+    }
+
+    // Until the old process says it has let go it may still resume these
+    // sessions (a late ack looks like none to it), so relaying starts only
+    // afterwards
+    if (i < header.sessionCount || !HandoffTransfer(pipe, &ack, sizeof(ack), TRUE) ||
+        !HandoffTransfer(pipe, &released, sizeof(released), FALSE) || released != HANDOFF_RELEASED) {
+        LOG_MSG(LOG_ERROR, "takeover: transfer incomplete");
+        while (received != NULL) {
+            session = received;
+            received = session->next;
+            SessionFree(session, TRUE);
+        }
+        CloseListenSockets();
+        CloseHandle(pipe);
+        return FALSE;
+    }
+
+    while (received != NULL) {
+        session = received;
+        received = session->next;
+        InterlockedIncrement(&g_SessionCount);
+        PostQueuedCompletionStatus(g_Workers[session->worker]->iocp, WORKER_START, (ULONG_PTR)session, NULL);
+    }
+
+    CloseHandle(pipe);
+    LOG_VAL(LOG_INFO, "takeover complete", "sessions", header.sessionCount);
+    return TRUE;
+}
+
+// ---------------------------------------------------------------------------
+// On-demand activation
+//
+// With -ondemand the resident process is only a launcher. It binds the
+// listeners, then sleeps until one of them has a connection waiting
+// (FD_ACCEPT; the launcher never accepts). At that point it starts
+// "my.exe -s -activated" with the same options. The new server inherits
+// the listening sockets, named in RC_LISTEN_SOCKETS the way systemd
+// passes LISTEN_FDS, and the shared stop event, named in RC_STOP_EVENT. It
+// accepts the waiting connection and any that follow. Once it has had no
+// sessions for -idleexit seconds it exits. The launcher keeps the
+// listeners open throughout, so connections made in between queue for the
+// next activation. Any service manager that can start a process with an
+// inherited listening socket can start -activated the same way.
+// ---------------------------------------------------------------------------
+
+// An inheritable handle whose value the launcher put in the environment,
+// NULL if there is none. It must not go on to the shells.
+static HANDLE InheritedHandle(const char* name) {
+    char value[32];
+    HANDLE handle;
+    DWORD length = GetEnvironmentVariableA(name, value, sizeof(value));
+
+    if (length == 0 || length >= sizeof(value))
+        return NULL;
+    handle = (HANDLE)(ULONG_PTR)_strtoui64(value, NULL, 10);
+    if (handle == NULL || !SetHandleInformation(handle, HANDLE_FLAG_INHERIT, 0))
+        return NULL;
+    return handle;
+}
+
+// -activated: take over the listening sockets named in RC_LISTEN_SOCKETS
+static BOOL AdoptListenSockets(void) {
+    char value[32 * MAX_LISTENERS];
+    char* p = value;
+    char* end;
+    DWORD length = GetEnvironmentVariableA(ACTIVATION_SOCKETS_VAR, value, sizeof(value));
+
+    if (length == 0 || length >= sizeof(value)) {
+        LOG_MSG(LOG_ERROR, "activated: no listening sockets passed in " ACTIVATION_SOCKETS_VAR);
+        return FALSE;
+    }
+    while (*p != '\0' && g_ListenerCount < MAX_LISTENERS) {
+        SOCKET sock = (SOCKET)_strtoui64(p, &end, 10);
+        SOCKADDR_STORAGE address;
+        int addressLength = sizeof(address);
+        BOOL listening = FALSE;
+        int optionLength = sizeof(listening);
+
+        if (end == p)
+            break;
+        if (getsockname(sock, (struct sockaddr*)&address, &addressLength) != 0 ||
+            getsockopt(sock, SOL_SOCKET, SO_ACCEPTCONN, (char*)&listening, &optionLength) != 0 ||
+            !listening) {
+            LOG_VAL2(LOG_ERROR, "activated: not a listening socket", "index", g_ListenerCount,
+                     "error", WSAGetLastError());
+            return FALSE;
+        }
+        SetHandleInformation((HANDLE)sock, HANDLE_FLAG_INHERIT, 0);
+        g_Listeners[g_ListenerCount] = sock;
+        g_ListenerFamily[g_ListenerCount] = address.ss_family;
+        LOG_VAL2(LOG_INFO, "activated: listening", "index", g_ListenerCount, "ipv6", address.ss_family == AF_INET6);
+        g_ListenerCount++;
+        p = *end == ',' ? end + 1 : end;
+    }
+    return g_ListenerCount > 0;
+}
+
+// An activated server that has been idle stops accepting first. Since the
+// accept threads start a connection's session before they finish, a
+// session count of zero afterwards means nobody got in. Connections not
+// yet accepted wait in the launcher's listen queue.
+static BOOL ActivatedIdleExit(void) {
+    StopAccepting();
+    if (g_SessionCount == 0)
+        return TRUE;
+    StartAccepting();
+    return FALSE;
+}
+
+// "<my.exe>" -s -activated <the launcher's server options>; heap string.
+// A service launcher also passes on its default log, as the server it
+// starts has no console either.
+static char* ActivatedCommandLine(BOOL asService) {
+    char path[MAX_PATH];
+    char defaultLogPath[MAX_PATH];
+    char* commandLine;
+    size_t size, used;
+    int i;
+
+    if (GetModuleFileNameA(NULL, path, MAX_PATH) == 0)
+        return NULL;
+    size = strlen(path) + MAX_PATH + 40;
+    for (i = 0; i < g_ServerArgc; i++)
+        size += strlen(g_ServerArgv[i]) + 3;
+    commandLine = (char*)HeapAlloc(GetProcessHeap(), 0, size);
+    if (commandLine == NULL)
+        return NULL;
+    used = _snprintf(commandLine, size, "\"%s\" -s -activated", path);
+    if (asService && g_LogPath == NULL) {
+        DefaultLogPath(defaultLogPath, MAX_PATH);
+        used += _snprintf(commandLine + used, size - used, " -log \"%s\"", defaultLogPath);
+    }
+    for (i = 0; i < g_ServerArgc; i++) {
+        const char* arg = g_ServerArgv[i];
+        // Launcher-only options stay here
+        if (strcmp(arg, "-ondemand") == 0 || strcmp(arg, "-service") == 0 ||
+            strcmp(arg, "-takeover") == 0)
+            continue;
+        used += _snprintf(commandLine + used, size - used,
+                          strchr(arg, ' ') != NULL ? " \"%s\"" : " %s", arg);
+    }
+    return commandLine;
+}
+
+// Ctrl+C / console close: shut down like a service stop
+static BOOL WINAPI ServerCtrlHandler(DWORD ctrlType) {
+    if (g_StopEvent != NULL) {
+        SetEvent(g_StopEvent);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+// A service has no console: log next to the executable unless -log was given
+static void ServerLogInit(BOOL asService) {
+    char defaultLogPath[MAX_PATH];
+    const char* logPath = g_LogPath;
+
+    if (logPath == NULL && asService) {
+        DefaultLogPath(defaultLogPath, MAX_PATH);
+        logPath = defaultLogPath;
+    }
+    if (!LogInit(logPath) && logPath != NULL)
+        LogInit(NULL);
+}
+
+void RunServer(BOOL asService) {
+    WSADATA wsaData;
+    SYSTEM_INFO systemInfo;
+    OVERLAPPED handoffOv;
+    HANDLE handoffPipe;
+    HANDLE waitHandles[2];
+    BOOL handedOff = FALSE;
+    BOOL listening;
+    ULONGLONG idleSince;
+    int result;
+
+    ServerLogInit(asService);
+
+    // Started for a connection that is waiting: one worker serves a host
+    // that sees a session now and then, and starts fastest
+    if (g_WorkerCount <= 0 && g_Activated)
+        g_WorkerCount = 1;
+    if (g_WorkerCount <= 0) {
+        GetSystemInfo(&systemInfo);
+        g_WorkerCount = (int)systemInfo.dwNumberOfProcessors;
+    }
+    if (g_WorkerCount > MAX_WORKERS)
+        g_WorkerCount = MAX_WORKERS;
+
+    LOG_VAL2(LOG_INFO, "starting server", "port", g_ListenPort, "workers", g_WorkerCount);
+
+    // Initialize Winsock
+    result = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (result != 0) {
+        LOG_VAL(LOG_ERROR, "WSAStartup failed", "error", result);
+        LogShutdown();
+        return;
+    }
+
+    InitializeCriticalSection(&g_SessionLock);
+    if (g_StopEvent == NULL && g_Activated)
+        g_StopEvent = InheritedHandle(ACTIVATION_STOP_VAR);
+    if (g_StopEvent == NULL)
+        g_StopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    g_AcceptStopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    if (!asService)
+        SetConsoleCtrlHandler(ServerCtrlHandler, TRUE);
+
+    // Workers first: sessions taken over from a predecessor need them
+    listening = StartWorkers() &&
+                (g_Takeover ? TakeOverFromPredecessor() :
+                 g_Activated ? AdoptListenSockets() : CreateListenSockets());
+    if (!listening || !StartAccepting()) {
+        StopAccepting();
+        StopAllSessions();
+        CloseListenSockets();
+        StopWorkers();
+        WSACleanup();
+        LogShutdown();
+        return;
+    }
+
+    LOG_VAL(LOG_INFO, "server listening, waiting for clients", "listeners", g_ListenerCount);
+    if (g_Activated)
+        LOG_VAL2(LOG_INFO, "activated: server ready", "startup_us", ProcessAgeMicroseconds(),
+                 "idle_exit_s", g_IdleExitMs / 1000);
+
+    // No handoff for an activated server: its launcher watches this
+    // process, not a successor, and would start a second server next to it
+    ZeroMemory(&handoffOv, sizeof(handoffOv));
+    handoffOv.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+    handoffPipe = g_Activated ? INVALID_HANDLE_VALUE : HandoffListen(&handoffOv);
+
+    waitHandles[0] = g_StopEvent;
+    waitHandles[1] = handoffOv.hEvent;
+
+    // Accepting happens on the workers; this thread only waits for a stop
+    // request or a successor, and an activated server also for being idle
+    idleSince = GetTickCount64();
+    for (;;) {
+        BOOL idleCheck = g_Activated && g_IdleExitMs != 0;
+        DWORD waitResult = WaitForMultipleObjects(handoffPipe != INVALID_HANDLE_VALUE ? 2 : 1,
+                                                  waitHandles, FALSE, idleCheck ? 1000 : INFINITE);
+        if (waitResult == WAIT_TIMEOUT) {
+            if (g_SessionCount > 0) {
+                idleSince = GetTickCount64();
+            } else if (GetTickCount64() - idleSince >= g_IdleExitMs && ActivatedIdleExit()) {
+                LOG_VAL(LOG_INFO, "activated: idle, exiting", "idle_s", g_IdleExitMs / 1000);
+                break;
+            }
+        } else if (waitResult == WAIT_OBJECT_0 + 1) {
+            handedOff = HandoffToSuccessor(handoffPipe);
+            CloseHandle(handoffPipe);
+            if (handedOff)
+                break;
+            handoffPipe = HandoffListen(&handoffOv);
+        } else {
+            break;
+        }
+    }
+
+    // Cleanup
+    if (!handedOff) {
+        StopAccepting();
+        StopAllSessions();
+        if (handoffPipe != INVALID_HANDLE_VALUE) {
+            CancelIoEx(handoffPipe, &handoffOv);
+            CloseHandle(handoffPipe);
+        }
+    }
+    CloseHandle(handoffOv.hEvent);
+    CloseListenSockets();
+    StopWorkers();
+    CloseHandle(g_AcceptStopEvent);
+    WSACleanup();
+
+    LOG_VAL3(LOG_INFO, "sessions reaped", "idle", g_ReapedIdle, "time_limit", g_ReapedLimit, "dead", g_ReapedDead);
+    LOG_MSG(LOG_INFO, handedOff ? "server handed off and stopped" : "server stopped");
+    LogShutdown();
+}
+
+// -ondemand: hold the listeners and start an activated server whenever a
+// connection is waiting and none is running
+void RunOnDemand(BOOL asService) {
+    WSADATA wsaData;
+    SECURITY_ATTRIBUTES inherit;
+    STARTUPINFOA si;
+    PROCESS_INFORMATION pi;
+    HANDLE waitHandles[2];
+    WSAEVENT acceptEvent = WSA_INVALID_EVENT;
+    char* commandLine = NULL;
+    char value[32 * MAX_LISTENERS];
+    DWORD exitCode;
+    LONG activations = 0;
+    int used = 0, i;
+
+    ServerLogInit(asService);
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        LOG_MSG(LOG_ERROR, "WSAStartup failed");
+        LogShutdown();
+        return;
+    }
+
+    // The stop event is the server's too: a stop reaches both at once
+    inherit.nLength = sizeof(inherit);
+    inherit.lpSecurityDescriptor = NULL;
+    inherit.bInheritHandle = TRUE;
+    g_StopEvent = CreateEvent(&inherit, TRUE, FALSE, NULL);
+    if (!asService)
+        SetConsoleCtrlHandler(ServerCtrlHandler, TRUE);
+
+    if (g_StopEvent == NULL || !CreateListenSockets())
+        goto done;
+    for (i = 0; i < g_ListenerCount; i++) {
+        SetHandleInformation((HANDLE)g_Listeners[i], HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
+        used += _snprintf(value + used, sizeof(value) - used, i == 0 ? "%llu" : ",%llu",
+                          (unsigned long long)g_Listeners[i]);
+    }
+    SetEnvironmentVariableA(ACTIVATION_SOCKETS_VAR, value);
+    _snprintf(value, sizeof(value), "%llu", (unsigned long long)(ULONG_PTR)g_StopEvent);
+    SetEnvironmentVariableA(ACTIVATION_STOP_VAR, value);
+    commandLine = ActivatedCommandLine(asService);
+    acceptEvent = WSACreateEvent();
+    if (commandLine == NULL || acceptEvent == WSA_INVALID_EVENT)
+        goto done;
+
+    LOG_VAL(LOG_INFO, "on demand: waiting for a connection", "listeners", g_ListenerCount);
+    waitHandles[0] = g_StopEvent;
+    for (;;) {
+        ULONGLONG started;
+
+        // Re-selecting reports a connection that is already waiting
+        for (i = 0; i < g_ListenerCount; i++)
+            WSAEventSelect(g_Listeners[i], acceptEvent, FD_ACCEPT);
+        waitHandles[1] = acceptEvent;
+        if (WaitForMultipleObjects(2, waitHandles, FALSE, INFINITE) != WAIT_OBJECT_0 + 1)
+            break;
+        // The server accepts with AcceptEx; the launcher only watched
+        for (i = 0; i < g_ListenerCount; i++)
+            WSAEventSelect(g_Listeners[i], NULL, 0);
+        WSAResetEvent(acceptEvent);
+
+        ZeroMemory(&si, sizeof(si));
+        si.cb = sizeof(si);
+        started = GetTickCount64();
+        if (!CreateProcessA(NULL, commandLine, NULL, NULL, TRUE, asService ? CREATE_NO_WINDOW : 0,
+                            NULL, NULL, &si, &pi)) {
+            LOG_VAL(LOG_ERROR, "on demand: cannot start the server", "error", GetLastError());
+            Sleep(ACTIVATION_RETRY_MS);
+            continue;
+        }
+        CloseHandle(pi.hThread);
+        activations++;
+        LOG_VAL2(LOG_INFO, "on demand: server started", "pid", pi.dwProcessId, "activations", activations);
+
+        waitHandles[1] = pi.hProcess;
+        if (WaitForMultipleObjects(2, waitHandles, FALSE, INFINITE) == WAIT_OBJECT_0 &&
+            WaitForSingleObject(pi.hProcess, ACTIVATION_STOP_MS) == WAIT_TIMEOUT)
+            TerminateProcess(pi.hProcess, 1);
+        exitCode = 0;
+        GetExitCodeProcess(pi.hProcess, &exitCode);
+        CloseHandle(pi.hProcess);
+        LOG_VAL3(LOG_INFO, "on demand: server exited", "pid", pi.dwProcessId, "exit_code", exitCode,
+                 "uptime_s", (GetTickCount64() - started) / 1000);
+        if (WaitForSingleObject(g_StopEvent, 0) == WAIT_OBJECT_0)
+            break;
+        // A server that fails at once would otherwise be restarted for the
+        // same waiting connection in a tight loop
+        if (GetTickCount64() - started < ACTIVATION_RETRY_MS)
+            Sleep(ACTIVATION_RETRY_MS);
+    }
+
+done:
+    if (acceptEvent != WSA_INVALID_EVENT)
+        WSACloseEvent(acceptEvent);
+    if (commandLine != NULL)
+        HeapFree(GetProcessHeap(), 0, commandLine);
+    CloseListenSockets();
+    WSACleanup();
+    LOG_VAL(LOG_INFO, "on demand: stopped", "activations", activations);
+    LogShutdown();
+}
+
+// Cursor position after the console has printed byte c of UTF-8 text at pos
+static COORD AdvanceCursor(COORD pos, char c, SHORT width) {
+    if (((unsigned char)c & 0xC0) == 0x80)
+        return pos;     // continuation byte, same cell as its lead byte
+    switch (c) {
+        case '\r': pos.X = 0; break;
+        case '\n': pos.Y++; break;
+        case '\b': if (pos.X > 0) pos.X--; break;
+        case '\t': pos.X = (SHORT)((pos.X + 8) & ~7); break;
+        default:   pos.X++; break;
+    }
+    if (pos.X >= width) {
+        pos.X = 0;
+        pos.Y++;
+    }
+    return pos;
+}
+
+static BOOL PredictorIsEmpty(const EchoPredictor* p) {
+    return p->sentPos == p->sentLen && p->lineLen == 0;
+}
+
+// Remember where predicted text starts before the first predicted byte is shown
+static void PredictorBegin(EchoPredictor* p) {
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    if (PredictorIsEmpty(p) && GetConsoleScreenBufferInfo(p->hConsole, &csbi))
+        p->anchor = csbi.dwCursorPosition;
+}
+
+// Blank all predicted text on screen and put the cursor back at the anchor
+static void PredictorErase(EchoPredictor* p) {
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    DWORD written;
+    LONG cells;
+
+    if (PredictorIsEmpty(p) || !GetConsoleScreenBufferInfo(p->hConsole, &csbi))
+        return;
+
+    cells = (LONG)(csbi.dwCursorPosition.Y - p->anchor.Y) * csbi.dwSize.X +
+            (csbi.dwCursorPosition.X - p->anchor.X);
+    if (cells > 0)
+        FillConsoleOutputCharacterA(p->hConsole, ' ', (DWORD)cells, p->anchor, &written);
+    SetConsoleCursorPosition(p->hConsole, p->anchor);
+}
+
+// Show the still unconfirmed and the unsent text again at the cursor
+static void PredictorRedraw(EchoPredictor* p) {
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    if (GetConsoleScreenBufferInfo(p->hConsole, &csbi))
+        p->anchor = csbi.dwCursorPosition;
+    ConsoleWrite(p->hConsole, p->sent + p->sentPos, p->sentLen - p->sentPos);
+    ConsoleWrite(p->hConsole, p->line, p->lineLen);
+}
+
+// Append one typed character (UTF-8, 1-4 bytes) to the edited line
+static void PredictorTypeChar(EchoPredictor* p, const char* utf8, int length) {
+    if (p->lineLen + length > BUFSIZE - 2)
+        return;
+    PredictorBegin(p);
+    memcpy(p->line + p->lineLen, utf8, length);
+    p->lineLen += length;
+    ConsoleWrite(p->hConsole, utf8, length);
+}
+
+static void PredictorBackspace(EchoPredictor* p) {
+    if (p->lineLen == 0)
+        return;
+    PredictorErase(p);
+    // Drop the whole last character, not just its final UTF-8 byte
+    while (p->lineLen > 0 && ((unsigned char)p->line[--p->lineLen] & 0xC0) == 0x80)
+        ;
+    PredictorRedraw(p);
+}
+
+// Finish the edited line: it becomes an unconfirmed prediction and is copied
+// (with CRLF) to out for sending. Returns its length.
+static int PredictorCommitLine(EchoPredictor* p, char* out) {
+    int length;
+
+    PredictorBegin(p);
+    p->line[p->lineLen++] = '\r';
+    p->line[p->lineLen++] = '\n';
+    ConsoleWrite(p->hConsole, "\r\n", 2);
+
+    length = p->lineLen;
+    memcpy(out, p->line, length);
+    p->lineLen = 0;
+
+    if (p->sentPos == p->sentLen)
+        p->sentPos = p->sentLen = 0;
+    if (p->sentLen + length <= (int)sizeof(p->sent)) {
+        memcpy(p->sent + p->sentLen, out, length);
+        p->sentLen += length;
+    } else {
+        // Too far ahead of the server: stop predicting, let its echo show
+        PredictorErase(p);
+        p->rolledBack += p->sentLen - p->sentPos;
+        p->sentPos = p->sentLen = 0;
+    }
+    return length;
+}
+
+// Reconcile server output with what is already on screen
+static void PredictorOnServerData(EchoPredictor* p, const char* data, int length) {
+    CONSOLE_SCREEN_BUFFER_INFO csbi;
+    SHORT width = 80;
+    int i = 0;
+
+    if (GetConsoleScreenBufferInfo(p->hConsole, &csbi))
+        width = csbi.dwSize.X;
+
+    // Echoed bytes that match the oldest prediction are already displayed
+    while (i < length && p->sentPos < p->sentLen && data[i] == p->sent[p->sentPos]) {
+        p->anchor = AdvanceCursor(p->anchor, data[i], width);
+        p->sentPos++;
+        p->confirmed++;
+        i++;
+    }
+    if (p->sentPos == p->sentLen)
+        p->sentPos = p->sentLen = 0;
+    if (i == length)
+        return;
+
+    if (PredictorIsEmpty(p)) {
+        ConsoleWrite(p->hConsole, data + i, length - i);
+        return;
+    }
+
+    // Misprediction or unrelated output: roll back, print the server's
+    // bytes, then show the line being edited after them
+    PredictorErase(p);
+    p->rolledBack += p->sentLen - p->sentPos;
+    p->sentPos = p->sentLen = 0;
+    ConsoleWrite(p->hConsole, data + i, length - i);
+    if (p->lineLen > 0)
+        PredictorRedraw(p);
+}
+
+// Client loop with predictive local echo. Keys are read raw and shown at
+// once; the loop sleeps until either console input or socket data arrives.
+static void RunPredictiveClientLoop(SOCKET connectSocket) {
+    HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
+    WSAEVENT sockEvent = WSACreateEvent();
+    HANDLE waitHandles[2];
+    EchoPredictor predictor;
+    INPUT_RECORD records[64];
+    char sendBuffer[BUFSIZE];
+    char recvBuffer[BUFSIZE];
+    char utf8[UTF8_OUT_SIZE(BUFSIZE)];
+    Utf8Stream utf8Stream;
+    WCHAR highSurrogate = 0;
+    BOOL running = TRUE;
+
+    ZeroMemory(&utf8Stream, sizeof(utf8Stream));
+
+    ZeroMemory(&predictor, sizeof(predictor));
+    predictor.hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+
+    SetConsoleMode(hStdin, ENABLE_PROCESSED_INPUT);
+    WSAEventSelect(connectSocket, sockEvent, FD_READ | FD_CLOSE);
+    waitHandles[0] = hStdin;
+    waitHandles[1] = sockEvent;
+
+    while (running) {
+        DWORD waitResult = WaitForMultipleObjects(2, waitHandles, FALSE, INFINITE);
+
+        if (waitResult == WAIT_OBJECT_0) {
+            DWORD count = 0, i;
+            if (!ReadConsoleInputW(hStdin, records, 64, &count))
+                break;
+            for (i = 0; i < count && running; i++) {
+                KEY_EVENT_RECORD* key = &records[i].Event.KeyEvent;
+                WORD repeat;
+                if (records[i].EventType != KEY_EVENT || !key->bKeyDown)
+                    continue;
+                for (repeat = 0; repeat < key->wRepeatCount && running; repeat++) {
+                    WCHAR wc[2];
+                    char typed[4];
+                    int typedLen;
+                    wc[0] = key->uChar.UnicodeChar;
+                    if (key->wVirtualKeyCode == VK_RETURN) {
+                        int length = PredictorCommitLine(&predictor, sendBuffer);
+                        if (strncmp(sendBuffer, "exit", 4) == 0) {
+                            SendAll(connectSocket, "exit\r\n", 6);
+                            running = FALSE;
+                        } else if (!SendAll(connectSocket, sendBuffer, length)) {
+                            printf("Send failed: %d\n", WSAGetLastError());
+                            running = FALSE;
+                        }
+                    } else if (key->wVirtualKeyCode == VK_BACK) {
+                        PredictorBackspace(&predictor);
+                    } else if (wc[0] >= 0xD800 && wc[0] <= 0xDBFF) {
+                        highSurrogate = wc[0];
+                    } else if (wc[0] >= 0x20) {
+                        int wideLen = 1;
+                        if (wc[0] >= 0xDC00 && wc[0] <= 0xDFFF && highSurrogate != 0) {
+                            wc[1] = wc[0];
+                            wc[0] = highSurrogate;
+                            wideLen = 2;
+                        }
+                        highSurrogate = 0;
+                        typedLen = WideCharToMultiByte(CP_UTF8, 0, wc, wideLen, typed, sizeof(typed), NULL, NULL);
+                        if (typedLen > 0)
+                            PredictorTypeChar(&predictor, typed, typedLen);
+                    }
+                }
+            }
+        } else if (waitResult == WAIT_OBJECT_0 + 1) {
+            WSAResetEvent(sockEvent);
+            for (;;) {
+                int result = recv(connectSocket, recvBuffer, BUFSIZE, 0);
+                if (result > 0) {
+                    int utf8Len = Utf8Sanitize(&utf8Stream, recvBuffer, result, utf8);
+                    PredictorOnServerData(&predictor, utf8, utf8Len);
+                    continue;
+                }
+                if (result == 0) {
+                    printf("\nConnection closed by server.\n");
+                    running = FALSE;
+                } else if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                    printf("Recv failed: %d\n", WSAGetLastError());
+                    running = FALSE;
+                }
+                break;
+            }
+        } else {
+            break;
+        }
+    }
+
+    WSAEventSelect(connectSocket, NULL, 0);
+    WSACloseEvent(sockEvent);
+    printf("\nPredictive echo: %lu bytes confirmed, %lu bytes rolled back\n",
+           predictor.confirmed, predictor.rolledBack);
+}
+
+// Connect to "host", "host:port" or "[v6]:port", trying every address
+// the name resolves to
+static SOCKET ConnectToServer(const char* server) {
+    SOCKET sock = INVALID_SOCKET;
+    struct addrinfo hints;
+    struct addrinfo* result;
+    struct addrinfo* address;
+    char host[256];
+    char port[16];
+
+    ParseEndpoint(server, host, sizeof(host), port, DEFAULT_PORT);
+    ZeroMemory(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    if (getaddrinfo(host, port, &hints, &result) != 0)
+        return INVALID_SOCKET;
+
+    for (address = result; address != NULL; address = address->ai_next) {
+        sock = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (sock == INVALID_SOCKET)
+            continue;
+        if (connect(sock, address->ai_addr, (int)address->ai_addrlen) != SOCKET_ERROR)
+            break;
+        closesocket(sock);
+        sock = INVALID_SOCKET;
+    }
+    freeaddrinfo(result);
+    return sock;
+}
+
+// Client end of a connection: the socket, or the local transport's rings
+// when the server is on this host and agreed to them (see "Local
+// transport"). LinkRecv() hands out what arrived over TCP before the switch
+// first.
+typedef struct {
+    SOCKET sock;
+    LocalShared* shared;            // NULL: everything goes over sock
+    char* toServer;
+    char* toClient;
+    DWORD size;
+    HANDLE hSection;
+    HANDLE events[LOCAL_EVENTS];
+    WSAEVENT sockEvent;             // the server process went away
+    DWORD timeout;                  // receive timeout in ms, 0 for none
+    char early[LOCAL_EARLY_SIZE];
+    int earlyLen;
+    int earlyUsed;
+} ClientLink;
+
+static BOOL IsLoopbackPeer(SOCKET sock) {
+    static const unsigned char mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+    SOCKADDR_STORAGE peer;
+    int length = sizeof(peer);
+    const unsigned char* address;
+
+    if (getpeername(sock, (struct sockaddr*)&peer, &length) != 0)
+        return FALSE;
+    if (peer.ss_family == AF_INET)
+        return ((const unsigned char*)&((struct sockaddr_in*)&peer)->sin_addr)[0] == 127;
+    address = (const unsigned char*)&((struct sockaddr_in6*)&peer)->sin6_addr;
+    return memcmp(address, &in6addr_loopback, 16) == 0 ||
+           (memcmp(address, mapped, sizeof(mapped)) == 0 && address[12] == 127);
+}
+
+static void LinkUnmap(ClientLink* link) {
+    int i;
+
+    if (link->shared != NULL)
+        UnmapViewOfFile(link->shared);
+    if (link->hSection != NULL)
+        CloseHandle(link->hSection);
+    for (i = 0; i < LOCAL_EVENTS; i++)
+        if (link->events[i] != NULL)
+            CloseHandle(link->events[i]);
+    if (link->sockEvent != NULL)
+        WSACloseEvent(link->sockEvent);
+    link->shared = NULL;
+    link->hSection = NULL;
+    ZeroMemory(link->events, sizeof(link->events));
+    link->sockEvent = NULL;
+}
+
+// Ask for the local transport. Whatever the shell printed before the reply
+// is kept for LinkRecv(), and so is what follows a refusal.
+static BOOL LinkNegotiate(ClientLink* link) {
+    const char* reply = NULL;
+    DWORD status;
+    int received, i;
+
+    if (!SendAll(link->sock, LOCAL_MAGIC, FRAME_MAGIC_SIZE))
+        return FALSE;
+    for (;;) {
+        // The marker starts with a NUL, so strstr() would not find it
+        for (i = 0; i + LOCAL_REPLY_SIZE <= link->earlyLen; i++) {
+            if (memcmp(link->early + i, LOCAL_MAGIC, FRAME_MAGIC_SIZE) == 0) {
+                reply = link->early + i;
+                break;
+            }
+        }
+        if (reply != NULL)
+            break;
+        if (link->earlyLen == LOCAL_EARLY_SIZE)
+            return FALSE;
+        received = recv(link->sock, link->early + link->earlyLen, LOCAL_EARLY_SIZE - link->earlyLen, 0);
+        if (received <= 0)
+            return FALSE;
+        link->earlyLen += received;
+    }
+
+    status = GetU32(reply + FRAME_MAGIC_SIZE);
+    if (status == NO_ERROR) {
+        link->hSection = (HANDLE)(ULONG_PTR)((ULONGLONG)GetU32(reply + FRAME_MAGIC_SIZE + 4) |
+                                             (ULONGLONG)GetU32(reply + FRAME_MAGIC_SIZE + 8) << 32);
+        for (i = 0; i < LOCAL_EVENTS; i++)
+            link->events[i] = (HANDLE)(ULONG_PTR)((ULONGLONG)GetU32(reply + FRAME_MAGIC_SIZE + 12 + 8 * i) |
+                                                  (ULONGLONG)GetU32(reply + FRAME_MAGIC_SIZE + 16 + 8 * i) << 32);
+    }
+    // Drop the reply itself
+    link->earlyLen -= (int)(reply - link->early) + LOCAL_REPLY_SIZE;
+    memmove((char*)reply, reply + LOCAL_REPLY_SIZE, link->earlyLen);
+    link->earlyLen += (int)(reply - link->early);
+    if (status != NO_ERROR)
+        return TRUE;
+
+    // The server writes to the rings from here on: there is no going back
+    link->shared = (LocalShared*)MapViewOfFile(link->hSection, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+    link->sockEvent = WSACreateEvent();
+    if (link->shared == NULL || link->sockEvent == WSA_INVALID_EVENT ||
+        WSAEventSelect(link->sock, link->sockEvent, FD_READ | FD_CLOSE) != 0)
+        return FALSE;
+    link->size = link->shared->ringSize;
+    if (link->size == 0 || (link->size & (link->size - 1)) != 0)
+        return FALSE;
+    link->toServer = (char*)(link->shared + 1);
+    link->toClient = link->toServer + link->size;
+    return TRUE;
+}
+
+// Connect, and move to the local transport if local is set and the server
+// runs on this host. timeout works like SO_RCVTIMEO on either transport.
+static BOOL LinkConnect(ClientLink* link, const char* server, BOOL local, DWORD timeout) {
+    ZeroMemory(link, sizeof(ClientLink));
+    link->timeout = timeout;
+    link->sock = ConnectToServer(server);
+    if (link->sock == INVALID_SOCKET)
+        return FALSE;
+    if (timeout != 0)
+        setsockopt(link->sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    if (local && IsLoopbackPeer(link->sock) && !LinkNegotiate(link)) {
+        LinkUnmap(link);
+        closesocket(link->sock);
+        link->sock = INVALID_SOCKET;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+// Wait for one of our events or the server's end of the socket; FALSE
+// after the link's timeout
+static BOOL LinkWait(ClientLink* link, HANDLE event) {
+    HANDLE handles[2];
+
+    handles[0] = event;
+    handles[1] = link->sockEvent;
+    switch (WaitForMultipleObjects(2, handles, FALSE, link->timeout != 0 ? link->timeout : INFINITE)) {
+        case WAIT_OBJECT_0:
+            return TRUE;
+        case WAIT_OBJECT_0 + 1:
+            // Nothing comes over TCP any more: the server is gone
+            InterlockedExchange(&link->shared->closed, 1);
+            return TRUE;
+        default:
+            return FALSE;
+    }
+}
+
+static BOOL LinkSend(ClientLink* link, const char* data, int length) {
+    LocalRing* ring;
+    DWORD put;
+
+    if (link->shared == NULL)
+        return SendAll(link->sock, data, length);
+    ring = &link->shared->toServer;
+    while (length > 0) {
+        if (link->shared->closed) {
+            WSASetLastError(WSAECONNRESET);
+            return FALSE;
+        }
+        put = RingWrite(ring, link->toServer, link->size, data, (DWORD)length);
+        if (put == RING_BROKEN) {
+            WSASetLastError(WSAECONNABORTED);
+            return FALSE;
+        }
+        if (put > 0) {
+            RingWake(&ring->readerWaiting, link->events[LOCAL_SERVER_DATA]);
+            data += put;
+            length -= (int)put;
+            continue;
+        }
+        // Full: sleep until the server has read some
+        InterlockedExchange(&ring->writerWaiting, 1);
+        if (RingUsed(ring, link->size) == link->size && !link->shared->closed &&
+            !LinkWait(link, link->events[LOCAL_CLIENT_SPACE])) {
+            WSASetLastError(WSAETIMEDOUT);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// LinkRecv() without waiting on the local transport: SOCKET_ERROR with
+// WSAEWOULDBLOCK when the ring is empty, and the server sets
+// events[LOCAL_CLIENT_DATA] once it is not. Over TCP it is recv(), which
+// blocks unless the socket does not.
+static int LinkRecvNow(ClientLink* link, char* buffer, int size) {
+    LocalRing* ring;
+    DWORD got;
+    int early = link->earlyLen - link->earlyUsed;
+
+    if (early > 0) {
+        if (early > size)
+            early = size;
+        memcpy(buffer, link->early + link->earlyUsed, early);
+        link->earlyUsed += early;
+        return early;
+    }
+    if (link->shared == NULL)
+        return recv(link->sock, buffer, size, 0);
+    ring = &link->shared->toClient;
+    for (;;) {
+        ring->readerWaiting = 0;
+        got = RingRead(ring, link->toClient, link->size, buffer, (DWORD)size);
+        if (got == RING_BROKEN) {
+            WSASetLastError(WSAECONNABORTED);
+            return SOCKET_ERROR;
+        }
+        if (got > 0) {
+            RingWake(&ring->writerWaiting, link->events[LOCAL_SERVER_SPACE]);
+            return (int)got;
+        }
+        if (link->shared->closed)
+            return 0;
+        InterlockedExchange(&ring->readerWaiting, 1);
+        if (RingUsed(ring, link->size) == 0 && !link->shared->closed) {
+            WSASetLastError(WSAEWOULDBLOCK);
+            return SOCKET_ERROR;
+        }
+    }
+}
+
+// recv() on the link: 0 once the server has hung up and everything it sent
+// has been read, SOCKET_ERROR with WSAETIMEDOUT after link->timeout
+static int LinkRecv(ClientLink* link, char* buffer, int size) {
+    int result;
+
+    while ((result = LinkRecvNow(link, buffer, size)) == SOCKET_ERROR && link->shared != NULL &&
+           WSAGetLastError() == WSAEWOULDBLOCK) {
+        if (!LinkWait(link, link->events[LOCAL_CLIENT_DATA])) {
+            WSASetLastError(WSAETIMEDOUT);
+            return SOCKET_ERROR;
+        }
+    }
+    return result;
+}
+
+static void LinkClose(ClientLink* link) {
+    if (link->shared != NULL) {
+        // The server reads what is left in its ring, then ends the session
+        InterlockedExchange(&link->shared->closed, 1);
+        SetEvent(link->events[LOCAL_SERVER_DATA]);
+        SetEvent(link->events[LOCAL_SERVER_SPACE]);
+    }
+    if (link->sock != INVALID_SOCKET)
+        closesocket(link->sock);
+    link->sock = INVALID_SOCKET;
+    LinkUnmap(link);
+}
+
+// Read shell output until marker shows up; counts the bytes received.
+// Relies on the link's timeout so a dead server cannot hang the caller.
+static BOOL WaitForMarker(ClientLink* link, const char* marker, LONGLONG* bytesReceived) {
+    char window[BUFSIZE * 2 + 1];
+    int windowLen = 0;
+    int markerLen = (int)strlen(marker);
+
+    for (;;) {
+        int result = LinkRecv(link, window + windowLen, BUFSIZE);
+        if (result <= 0)
+            return FALSE;
+        if (bytesReceived != NULL)
+            *bytesReceived += result;
+        windowLen += result;
+        window[windowLen] = '\0';
+        if (strstr(window, marker) != NULL)
+            return TRUE;
+        if (windowLen > BUFSIZE) {
+            // Keep just enough of the tail for a marker split across reads
+            memmove(window, window + windowLen - markerLen, markerLen);
+            windowLen = markerLen;
+        }
+    }
+}
+
+static int CompareDouble(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Latency probe (-latency N): runs N trivial commands one after another and
+// measures from send until the command's output arrives. "echo RC^PROBE<n>"
+// prints RCPROBE<n>, while the shell's echo of the command line still shows
+// the caret, so the marker only matches real output. Run it next to a
+// session that keeps the CPU busy to see how well sessions are isolated.
+static void RunLatencyProbe(ClientLink* link, int samples) {
+    char command[64];
+    char marker[32];
+    int count = 0, i;
+    double* rtt;
+    LARGE_INTEGER start, end, frequency;
+
+    rtt = (double*)HeapAlloc(GetProcessHeap(), 0, samples * sizeof(double));
+    if (rtt == NULL)
+        return;
+    QueryPerformanceFrequency(&frequency);
+
+    // Sample -1 is a warm-up that also swallows the banner and first prompt
+    for (i = -1; i < samples; i++) {
+        sprintf(command, "echo RC^PROBE%d\r\n", i + 1);
+        sprintf(marker, "RCPROBE%d\r\n", i + 1);
+
+        QueryPerformanceCounter(&start);
+        if (!LinkSend(link, command, (int)strlen(command)))
+            break;
+        if (!WaitForMarker(link, marker, NULL)) {
+            printf("Probe %d: no response (%d)\n", i + 1, WSAGetLastError());
+            break;
+        }
+        QueryPerformanceCounter(&end);
+        if (i >= 0)
+            rtt[count++] = (double)(end.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+        Sleep(PROBE_INTERVAL_MS);
+    }
+
+    if (count > 0) {
+        qsort(rtt, count, sizeof(double), CompareDouble);
+        printf("Latency over %d commands (%s): p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+               count, link->shared != NULL ? "local transport" : "TCP",
+               rtt[(count - 1) / 2], rtt[(count - 1) * 99 / 100], rtt[count - 1]);
+    }
+    LinkSend(link, "exit\r\n", 6);
+    HeapFree(GetProcessHeap(), 0, rtt);
+}
+
+void RunClient(const char* serverIP, BOOL predictEcho, int latencySamples, BOOL local) {
+    WSADATA wsaData;
+    SOCKET connectSocket = INVALID_SOCKET;
+    int result;
+    char sendBuffer[UTF8_OUT_SIZE(BUFSIZE)];
+    char recvBuffer[BUFSIZE];
+    char utf8[UTF8_OUT_SIZE(BUFSIZE)];
+    WCHAR wideInput[BUFSIZE];
+    Utf8Stream utf8Stream;
+    UINT oldOutputCP;
+    
+    printf("Connecting to server %s...\n", serverIP);
+
+    // Initialize Winsock
+    result = WSAStartup(MAKEWORD(2, 2), &wsaData);
+    if (result != 0) {
+        printf("WSAStartup failed: %d\n", result);
+        return;
+    }
+
+    // The probe may use the local transport; the interactive loops below
+    // poll the console and stay on the socket
+    if (latencySamples > 0) {
+        ClientLink link;
+        if (!LinkConnect(&link, serverIP, local, PROBE_TIMEOUT_MS)) {
+            printf("Connection failed: %d\n", WSAGetLastError());
+        } else {
+            printf("Connected to server!\n");
+            RunLatencyProbe(&link, latencySamples);
+            LinkClose(&link);
+        }
+        WSACleanup();
+        return;
+    }
+
+    // Connect to server (IPv4 or IPv6)
+    connectSocket = ConnectToServer(serverIP);
+    if (connectSocket == INVALID_SOCKET) {
+        printf("Connection failed: %d\n", WSAGetLastError());
+        WSACleanup();
+        return;
+    }
+
+    printf("Connected to server!\n");
+
+    printf("Enter commands (type 'exit' to quit):\n\n");
+
+    // The server sends UTF-8 regardless of its code page
+    oldOutputCP = GetConsoleOutputCP();
+    SetConsoleOutputCP(CP_UTF8);
+    ZeroMemory(&utf8Stream, sizeof(utf8Stream));
+
+    if (predictEcho) {
+        RunPredictiveClientLoop(connectSocket);
+        SetConsoleOutputCP(oldOutputCP);
+        closesocket(connectSocket);
+        WSACleanup();
+        printf("Client disconnected.\n");
+        return;
+    }
+
+    // Set socket to non-blocking
+    u_long mode = 1;
+    ioctlsocket(connectSocket, FIONBIO, &mode);
+
+    HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
+    HANDLE hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD fdwMode = ENABLE_LINE_INPUT | ENABLE_ECHO_INPUT | ENABLE_PROCESSED_INPUT;
+    SetConsoleMode(hStdin, fdwMode);
+
+    BOOL running = TRUE;
+    while (running) {
+        // Check for keyboard input
         DWORD eventsAvailable = 0;
         if (GetNumberOfConsoleInputEvents(hStdin, &eventsAvailable) && eventsAvailable > 1) {
-            DWORD bytesRead;
-            if (ReadConsole(hStdin, sendBuffer, BUFSIZE - 1, &bytesRead, NULL) && bytesRead > 0) {
+            DWORD charsRead;
+            int bytesRead;
+            if (ReadConsoleW(hStdin, wideInput, BUFSIZE, &charsRead, NULL) && charsRead > 0) {
+                bytesRead = WideCharToMultiByte(CP_UTF8, 0, wideInput, charsRead,
+                                                sendBuffer, sizeof(sendBuffer) - 1, NULL, NULL);
+                if (bytesRead <= 0)
+                    continue;
                 sendBuffer[bytesRead] = '\0';
                 
                 // Check for exit command
@@ -401,33 +5630,1790 @@ void RunClient(const char* serverIP) {
             }
         }
 
-        // Check for server response
-        result = recv(connectSocket, recvBuffer, BUFSIZE - 1, 0);
-        if (result > 0) {
-            recvBuffer[result] = '\0';
-            printf("%s", recvBuffer);
-        } else if (result == 0) {
-            printf("\nConnection closed by server.\n");
+        // Check for server response
+        result = recv(connectSocket, recvBuffer, BUFSIZE, 0);
+        if (result > 0) {
+            // Written by length: NUL bytes in the output no longer cut it short
+            ConsoleWrite(hStdout, utf8, Utf8Sanitize(&utf8Stream, recvBuffer, result, utf8));
+        } else if (result == 0) {
+            printf("\nConnection closed by server.\n");
+            break;
+        } else {
+            int error = WSAGetLastError();
+            if (error != WSAEWOULDBLOCK) {
+                printf("Recv failed: %d\n", error);
+                break;
+            }
+        }
+
+        Sleep(10); // Small delay
+    }
+
+    // Cleanup
+    SetConsoleOutputCP(oldOutputCP);
+    closesocket(connectSocket);
+    WSACleanup();
+    printf("Client disconnected.\n");
+}
+
+// ---------------------------------------------------------------------------
+// Watch client (-watch)
+//
+// Keeps the view the server last described and applies each update's edit
+// script to it. Only console rows whose text changed are rewritten, in
+// place and without scrolling, so a quiet command costs neither bandwidth
+// nor redraws. Esc or q ends the watch.
+// ---------------------------------------------------------------------------
+
+#define WATCH_ROW_MAX 1024
+
+// Apply a FRAME_WATCH_DIFF to the view; the result replaces *text. FALSE
+// for a script that does not fit the view (nothing is changed then).
+static BOOL WatchApply(char** text, DWORD* textLen, const TextLine* lines, int lineCount,
+                       const char* diff, DWORD length) {
+    DWORD newCount, newLen, pos = 8, out = 0, n, k;
+    int produced = 0, line = 0;
+    char* result;
+
+    if (length < 8)
+        return FALSE;
+    newCount = GetU32(diff);
+    newLen = GetU32(diff + 4);
+    result = (char*)HeapAlloc(GetProcessHeap(), 0, newLen + 1);
+    if (result == NULL)
+        return FALSE;
+    while (pos + 5 <= length) {
+        char op = diff[pos];
+        n = GetU32(diff + pos + 1);
+        pos += 5;
+        if (op == 'I') {
+            if (n > length - pos || n > newLen - out)
+                goto bad;
+            memcpy(result + out, diff + pos, n);
+            out += n;
+            pos += n;
+            produced++;
+        } else if (op == 'C' || op == 'S') {
+            if (n > (DWORD)(lineCount - line))
+                goto bad;
+            for (k = 0; op == 'C' && k < n; k++) {
+                const TextLine* l = &lines[line + k];
+                if (l->length > newLen - out)
+                    goto bad;
+                memcpy(result + out, l->text, l->length);
+                out += l->length;
+                produced++;
+            }
+            line += n;
+        } else {
+            goto bad;
+        }
+    }
+    if (pos != length || out != newLen || (DWORD)produced != newCount)
+        goto bad;
+    if (*text)
+        HeapFree(GetProcessHeap(), 0, *text);
+    *text = result;
+    *textLen = newLen;
+    return TRUE;
+
+bad:
+    HeapFree(GetProcessHeap(), 0, result);
+    return FALSE;
+}
+
+// Rewrite the rows below the header whose line is not what they show
+static void WatchDraw(HANDLE hConsole, SHORT top, SHORT rows, SHORT width,
+                      const TextLine* cur, int curCount, const TextLine* old, int oldCount, BOOL all) {
+    WCHAR row[WATCH_ROW_MAX];
+    COORD pos;
+    DWORD written;
+    SHORT r;
+    int n, i;
+
+    if (width > WATCH_ROW_MAX)
+        width = WATCH_ROW_MAX;
+    for (r = 0; r < rows; r++) {
+        const TextLine* a = r < curCount ? &cur[r] : NULL;
+        const TextLine* b = r < oldCount ? &old[r] : NULL;
+        if (!all && (a == NULL ? b == NULL : b != NULL && LinesEqual(a, b)))
+            continue;
+        n = 0;
+        if (a != NULL)
+            n = MultiByteToWideChar(CP_UTF8, 0, a->text,
+                                    a->length < WATCH_ROW_MAX ? (int)a->length : WATCH_ROW_MAX, row, WATCH_ROW_MAX);
+        if (n > width)
+            n = width;
+        for (i = 0; i < n; i++)
+            if (row[i] < L' ')
+                row[i] = L' ';      // tabs and the line end
+        for (; i < width; i++)
+            row[i] = L' ';
+        pos.X = 0;
+        pos.Y = top + 1 + r;
+        WriteConsoleOutputCharacterW(hConsole, row, width, pos, &written);
+    }
+}
+
+static void WatchDrawHeader(HANDLE hConsole, SHORT top, SHORT width, const char* command, double seconds,
+                            int updates, LONGLONG received, LONGLONG full) {
+    char header[WATCH_ROW_MAX + 1];
+    COORD pos;
+    DWORD written;
+    int n;
+
+    if (width > WATCH_ROW_MAX)
+        width = WATCH_ROW_MAX;
+    n = _snprintf(header, sizeof(header), "Every %.1fs: %s    [%d updates, %lld of %lld bytes]",
+                  seconds, command, updates, received, full);
+    if (n < 0 || n > width)
+        n = width;
+    memset(header + n, ' ', width - n);
+    pos.X = 0;
+    pos.Y = top;
+    WriteConsoleOutputCharacterA(hConsole, header, width, pos, &written);
+}
+
+// Hello and FRAME_WATCH in one send; the command goes as UTF-8
+static BOOL WatchSendRequest(SOCKET sock, const char* command, DWORD interval) {
+    WCHAR wide[BUFSIZE];
+    char request[FRAME_MAGIC_SIZE + FRAME_HEADER_SIZE + 4 + UTF8_OUT_SIZE(BUFSIZE)];
+    int n;
+
+    n = MultiByteToWideChar(CP_ACP, 0, command, -1, wide, BUFSIZE);
+    n = n > 1 ? WideCharToMultiByte(CP_UTF8, 0, wide, n - 1, request + FRAME_MAGIC_SIZE + FRAME_HEADER_SIZE + 4,
+                                    UTF8_OUT_SIZE(BUFSIZE), NULL, NULL) : 0;
+    memcpy(request, FRAME_MAGIC, FRAME_MAGIC_SIZE);
+    FrameHeader(request + FRAME_MAGIC_SIZE, FRAME_WATCH, 4 + n);
+    PutU32(request + FRAME_MAGIC_SIZE + FRAME_HEADER_SIZE, interval);
+    return n > 0 && SendAll(sock, request, FRAME_MAGIC_SIZE + FRAME_HEADER_SIZE + 4 + n);
+}
+
+// Before the server's hello comes plain shell output (the banner); the
+// watch has no use for it. Returns the bytes to skip, *magic keeps the
+// progress across receives.
+static int WatchSkipBanner(const char* data, int length, int* magic) {
+    int used = 0;
+
+    while (*magic < FRAME_MAGIC_SIZE && used < length) {
+        if (data[used] == FRAME_MAGIC[*magic])
+            (*magic)++;
+        else
+            *magic = data[used] == FRAME_MAGIC[0] ? 1 : 0;
+        used++;
+    }
+    return used;
+}
+
+void RunWatchClient(const char* serverIP, const char* command, double seconds) {
+    WSADATA wsaData;
+    SOCKET sock;
+    HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
+    HANDLE hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
+    CONSOLE_SCREEN_BUFFER_INFO info;
+    FrameReader reader;
+    WSAPOLLFD poll;
+    INPUT_RECORD keys[16];
+    char buffer[BUFSIZE * 4];
+    char stop[FRAME_HEADER_SIZE];       // FRAME_WATCH_STOP or FRAME_PONG
+    char* text = NULL;
+    DWORD textLen = 0, interval = (DWORD)(seconds * 1000);
+    TextLine* lines = NULL;
+    int lineCount = 0, magic = 0, updates = 0, received, used, type, n;
+    const char* payload;
+    const char* error = NULL;
+    DWORD payloadLength, keyCount, i;
+    LONGLONG bytesReceived = 0, bytesFull = 0;
+    SHORT top, rows, width;
+    BOOL running = TRUE;
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        printf("WSAStartup failed\n");
+        return;
+    }
+    sock = ConnectToServer(serverIP);
+    if (sock == INVALID_SOCKET) {
+        printf("Connection failed: %d\n", WSAGetLastError());
+        WSACleanup();
+        return;
+    }
+
+    if (!WatchSendRequest(sock, command, interval)) {
+        printf("Cannot send the watch request\n");
+        closesocket(sock);
+        WSACleanup();
+        return;
+    }
+
+    // The view takes the visible window: a header row, then the output
+    if (!GetConsoleScreenBufferInfo(hStdout, &info)) {
+        info.srWindow.Left = info.srWindow.Top = 0;
+        info.srWindow.Right = 79;
+        info.srWindow.Bottom = 24;
+    }
+    top = info.srWindow.Top;
+    width = info.srWindow.Right - info.srWindow.Left + 1;
+    rows = info.srWindow.Bottom - info.srWindow.Top;
+    for (n = 0; n <= rows; n++) {
+        COORD pos;
+        DWORD written;
+        pos.X = 0;
+        pos.Y = top + n;
+        FillConsoleOutputCharacterA(hStdout, ' ', width, pos, &written);
+    }
+    WatchDrawHeader(hStdout, top, width, command, seconds, 0, 0, 0);
+    SetConsoleMode(hStdin, ENABLE_PROCESSED_INPUT);
+    ZeroMemory(&reader, sizeof(reader));
+    reader.watchClient = TRUE;
+
+    while (running) {
+        if (GetNumberOfConsoleInputEvents(hStdin, &keyCount) && keyCount > 0 &&
+            ReadConsoleInputW(hStdin, keys, 16, &keyCount)) {
+            for (i = 0; i < keyCount; i++) {
+                KEY_EVENT_RECORD* key = &keys[i].Event.KeyEvent;
+                if (keys[i].EventType == KEY_EVENT && key->bKeyDown &&
+                    (key->wVirtualKeyCode == VK_ESCAPE || key->uChar.UnicodeChar == L'q')) {
+                    FrameHeader(stop, FRAME_WATCH_STOP, 0);
+                    SendAll(sock, stop, FRAME_HEADER_SIZE);
+                    running = FALSE;
+                }
+            }
+            if (!running)
+                break;
+        }
+
+        poll.fd = sock;
+        poll.events = POLLRDNORM;
+        poll.revents = 0;
+        if (WSAPoll(&poll, 1, 100) <= 0)
+            continue;
+        received = recv(sock, buffer, sizeof(buffer), 0);
+        if (received <= 0)
+            break;
+        bytesReceived += received;
+
+        used = WatchSkipBanner(buffer, received, &magic);
+        while (used < received && running) {
+            used += FrameRead(&reader, buffer + used, received - used, &type, &payload, &payloadLength);
+            if (type < 0) {
+                error = "malformed frame from the server";
+                running = FALSE;
+            } else if (type == FRAME_WATCH_DIFF) {
+                TextLine* shown = lines;
+                int shownCount = lineCount;
+                char* shownText = text;
+
+                text = NULL;    // the old text stays alive until it is redrawn over
+                if (!WatchApply(&text, &textLen, shown, shownCount, payload, payloadLength)) {
+                    text = shownText;
+                    error = "update does not fit the view";
+                    running = FALSE;
+                    break;
+                }
+                lineCount = SplitLines(text, textLen, &lines);
+                if (lineCount < 0) {
+                    lines = NULL;
+                    lineCount = 0;
+                }
+                updates++;
+                bytesFull += textLen;
+                WatchDraw(hStdout, top, rows, width, lines, lineCount, shown, shownCount, updates == 1);
+                WatchDrawHeader(hStdout, top, width, command, seconds, updates, bytesReceived, bytesFull);
+                if (shown) HeapFree(GetProcessHeap(), 0, shown);
+                if (shownText) HeapFree(GetProcessHeap(), 0, shownText);
+            } else if (type == FRAME_PING) {
+                FrameHeader(stop, FRAME_PONG, 0);
+                SendAll(sock, stop, FRAME_HEADER_SIZE);
+            } else if (type == FRAME_WATCH_END) {
+                COORD pos;
+                pos.X = 0;
+                pos.Y = top + rows;
+                SetConsoleCursorPosition(hStdout, pos);
+                printf("\nWatch ended: %.*s\n", (int)payloadLength, payload);
+                running = FALSE;
+            }
+        }
+    }
+
+    {
+        COORD pos;
+        pos.X = 0;
+        pos.Y = top + rows;
+        SetConsoleCursorPosition(hStdout, pos);
+    }
+    if (error != NULL)
+        printf("\nWatch failed: %s\n", error);
+    printf("\n%d updates: %lld bytes received for %lld bytes of output (%.1f%%)\n",
+           updates, bytesReceived, bytesFull, bytesFull > 0 ? 100.0 * bytesReceived / bytesFull : 0.0);
+    FrameReaderFree(&reader);
+    if (lines) HeapFree(GetProcessHeap(), 0, lines);
+    if (text) HeapFree(GetProcessHeap(), 0, text);
+    closesocket(sock);
+    WSACleanup();
+}
+
+// ---------------------------------------------------------------------------
+// Pipe client (-pipe)
+//
+// Runs one command on the server with our stdin as its input and its
+// output on our stdout, byte for byte: my.exe -c host -pipe "sort" < in > out.
+// The main thread uploads in PIPE_CLIENT_BLOCK reads, never past the credit
+// the server has granted; a second thread takes the output and the credit.
+// Ctrl+C kills the remote command. Throughput goes to stderr at the end.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    ClientLink link;                // the rings when the server is on this host
+    CRITICAL_SECTION sendLock;      // whole frames from the uploader and Ctrl+C
+    HANDLE hCredit;                 // auto-reset: credit arrived or the command ended
+    volatile LONG credit;
+    volatile LONG done;
+    DWORD exitCode;
+    LONGLONG bytesOut;
+} PipeClient;
+
+static PipeClient* g_PipeClient = NULL;
+
+static BOOL PipeSendFrame(PipeClient* pc, int type, const char* payload, DWORD length) {
+    char header[FRAME_HEADER_SIZE];
+    BOOL ok;
+
+    FrameHeader(header, type, length);
+    EnterCriticalSection(&pc->sendLock);
+    ok = LinkSend(&pc->link, header, FRAME_HEADER_SIZE) && (length == 0 || LinkSend(&pc->link, payload, length));
+    LeaveCriticalSection(&pc->sendLock);
+    return ok;
+}
+
+static BOOL WINAPI PipeCtrlHandler(DWORD ctrlType) {
+    if (g_PipeClient == NULL || (ctrlType != CTRL_C_EVENT && ctrlType != CTRL_BREAK_EVENT))
+        return FALSE;
+    PipeSendFrame(g_PipeClient, FRAME_EXEC_KILL, NULL, 0);
+    return TRUE;    // the exit code comes back from the server
+}
+
+static DWORD WINAPI PipeReceiveThread(LPVOID lpParam) {
+    PipeClient* pc = (PipeClient*)lpParam;
+    HANDLE hStdout = GetStdHandle(STD_OUTPUT_HANDLE);
+    FrameReader reader;
+    char* buffer = (char*)HeapAlloc(GetProcessHeap(), 0, PIPE_CLIENT_BLOCK);
+    const char* payload;
+    DWORD payloadLength, written;
+    int received, used, type, magic = 0;
+
+    ZeroMemory(&reader, sizeof(reader));
+    pc->exitCode = (DWORD)-1;
+    while (buffer != NULL && !pc->done) {
+        received = LinkRecv(&pc->link, buffer, PIPE_CLIENT_BLOCK);
+        if (received <= 0) {
+            fprintf(stderr, "Connection lost\n");
+            break;
+        }
+        // The shell's banner comes before the server's hello; not ours
+        used = 0;
+        while (magic < FRAME_MAGIC_SIZE && used < received) {
+            if (buffer[used] == FRAME_MAGIC[magic])
+                magic++;
+            else
+                magic = buffer[used] == FRAME_MAGIC[0] ? 1 : 0;
+            used++;
+        }
+        while (used < received && !pc->done) {
+            used += FrameRead(&reader, buffer + used, received - used, &type, &payload, &payloadLength);
+            if (type < 0) {
+                fprintf(stderr, "Malformed frame from server\n");
+                pc->done = TRUE;
+            } else if (type == FRAME_EXEC_OUTPUT) {
+                WriteFile(hStdout, payload, payloadLength, &written, NULL);
+                pc->bytesOut += payloadLength;
+            } else if (type == FRAME_PING) {
+                PipeSendFrame(pc, FRAME_PONG, NULL, 0);
+            } else if (type == FRAME_CREDIT && payloadLength >= 4) {
+                InterlockedExchangeAdd(&pc->credit, (LONG)GetU32(payload));
+                SetEvent(pc->hCredit);
+            } else if (type == FRAME_EXEC_EXIT && payloadLength >= 4) {
+                pc->exitCode = GetU32(payload);
+                if (payloadLength > 4)
+                    fprintf(stderr, "%.*s\n", (int)payloadLength - 4, payload + 4);
+                pc->done = TRUE;
+            }
+        }
+    }
+    pc->done = TRUE;
+    SetEvent(pc->hCredit);
+    FrameReaderFree(&reader);
+    if (buffer != NULL)
+        HeapFree(GetProcessHeap(), 0, buffer);
+    return 0;
+}
+
+int RunPipeClient(const char* serverIP, const char* command, BOOL local) {
+    WSADATA wsaData;
+    PipeClient pc;
+    HANDLE hStdin = GetStdHandle(STD_INPUT_HANDLE);
+    HANDLE hReceiver;
+    WCHAR wide[BUFSIZE];
+    char request[FRAME_MAGIC_SIZE + FRAME_HEADER_SIZE + UTF8_OUT_SIZE(BUFSIZE)];
+    char* block;
+    LARGE_INTEGER start, end, freq;
+    LONGLONG bytesIn = 0;
+    DWORD got, offset;
+    double seconds;
+    int n;
+
+    ZeroMemory(&pc, sizeof(pc));
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        fprintf(stderr, "WSAStartup failed\n");
+        return 1;
+    }
+    if (!LinkConnect(&pc.link, serverIP, local, 0)) {
+        fprintf(stderr, "Connection failed: %d\n", WSAGetLastError());
+        WSACleanup();
+        return 1;
+    }
+
+    // Hello and the command in one send; the command goes as UTF-8
+    n = MultiByteToWideChar(CP_ACP, 0, command, -1, wide, BUFSIZE);
+    n = n > 1 ? WideCharToMultiByte(CP_UTF8, 0, wide, n - 1, request + FRAME_MAGIC_SIZE + FRAME_HEADER_SIZE,
+                                    UTF8_OUT_SIZE(BUFSIZE), NULL, NULL) : 0;
+    memcpy(request, FRAME_MAGIC, FRAME_MAGIC_SIZE);
+    FrameHeader(request + FRAME_MAGIC_SIZE, FRAME_EXEC, n);
+    block = (char*)HeapAlloc(GetProcessHeap(), 0, PIPE_CLIENT_BLOCK);
+    if (n <= 0 || block == NULL || !LinkSend(&pc.link, request, FRAME_MAGIC_SIZE + FRAME_HEADER_SIZE + n)) {
+        fprintf(stderr, "Cannot send the command\n");
+        if (block != NULL)
+            HeapFree(GetProcessHeap(), 0, block);
+        LinkClose(&pc.link);
+        WSACleanup();
+        return 1;
+    }
+
+    InitializeCriticalSection(&pc.sendLock);
+    pc.hCredit = CreateEvent(NULL, FALSE, FALSE, NULL);
+    hReceiver = CreateThread(NULL, 0, PipeReceiveThread, &pc, 0, NULL);
+    g_PipeClient = &pc;
+    SetConsoleCtrlHandler(PipeCtrlHandler, TRUE);
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&start);
+
+    // Upload until stdin ends, within the granted window
+    while (!pc.done && ReadFile(hStdin, block, PIPE_CLIENT_BLOCK, &got, NULL) && got > 0) {
+        for (offset = 0; offset < got && !pc.done; ) {
+            DWORD chunk = got - offset;
+            if (pc.credit <= 0) {
+                WaitForSingleObject(pc.hCredit, 100);
+                continue;
+            }
+            if (chunk > (DWORD)pc.credit)
+                chunk = (DWORD)pc.credit;
+            InterlockedExchangeAdd(&pc.credit, -(LONG)chunk);
+            if (!PipeSendFrame(&pc, FRAME_EXEC_INPUT, block + offset, chunk)) {
+                pc.done = TRUE;
+                break;
+            }
+            offset += chunk;
+            bytesIn += chunk;
+        }
+    }
+    if (!pc.done)
+        PipeSendFrame(&pc, FRAME_EXEC_EOF, NULL, 0);
+    QueryPerformanceCounter(&end);
+    seconds = (double)(end.QuadPart - start.QuadPart) / freq.QuadPart;
+
+    WaitForSingleObject(hReceiver, INFINITE);
+    SetConsoleCtrlHandler(PipeCtrlHandler, FALSE);
+    g_PipeClient = NULL;
+    fprintf(stderr, "Sent %.1f MB in %.2f s (%.1f MB/s over %s), received %.1f MB, exit code %ld\n",
+            bytesIn / 1048576.0, seconds, seconds > 0 ? bytesIn / 1048576.0 / seconds : 0.0,
+            pc.link.shared != NULL ? "shared memory" : "TCP", pc.bytesOut / 1048576.0, (long)pc.exitCode);
+
+    CloseHandle(hReceiver);
+    CloseHandle(pc.hCredit);
+    DeleteCriticalSection(&pc.sendLock);
+    HeapFree(GetProcessHeap(), 0, block);
+    LinkClose(&pc.link);
+    WSACleanup();
+    return (int)pc.exitCode;
+}
+
+// ---------------------------------------------------------------------------
+// Load generator (-load)
+//
+// Simulates many clients against one server. Each client types commands
+// from a weighted mix at a fixed key rate, presses Enter and times how long
+// the shell takes to answer, detected with the same caret marker as the
+// latency probe. Clients are state machines on non-blocking sockets (or
+// local transport rings); a small pool of threads drives them, each
+// sleeping until one of its clients has data or a timer is due. Latencies
+// go into per-thread log-linear histograms (HDR style: 32 sub-buckets per
+// power of two, ~3% precision, microsecond units) that are merged for the
+// report. On loopback the listening process is found by port so its CPU
+// and memory can be reported alongside.
+// ---------------------------------------------------------------------------
+
+#define HIST_SUB_BUCKETS 32
+#define HIST_BUCKETS (HIST_SUB_BUCKETS * 40)
+#define LOAD_OPS 4              // connect + the three commands of the mix
+#define LOAD_LINE_WIDTH 78      // characters per line of a bulk burst
+#define LOAD_THREAD_SOCKETS 256 // TCP-only clients per pool thread: their sockets share one event
+#define LOAD_IDLE_OPENING 16    // -idle: sessions per pool thread waiting for their banner at once
+
+enum { OP_CONNECT, OP_ECHO, OP_DIR, OP_BURST };
+static const char* const g_LoadOpNames[LOAD_OPS] = { "connect", "echo", "dir", "burst" };
+
+typedef struct {
+    LONGLONG counts[HIST_BUCKETS];
+    LONGLONG total;
+    LONGLONG max;
+} Histogram;
+
+enum { LOAD_START, LOAD_WAIT, LOAD_THINK, LOAD_TYPE, LOAD_IDLE, LOAD_CLOSED };
+
+typedef struct {
+    int state;                      // LOAD_*
+    ClientLink* link;               // mix clients, while connected
+    SOCKET sock;                    // -storm and -idle
+    BOOL counted;                   // included in g_LoadConnected
+    int op;                         // what LOAD_WAIT waits for
+    int sequence;
+    ULONG random;
+    ULONGLONG due;                  // GetTickCount64(): (re)connect, next key, end of the pause or timeout
+    LARGE_INTEGER start;
+    char command[256];
+    int typed;
+    char marker[32];
+    int matched;                    // marker characters received so far
+} LoadClient;
+
+// A pool thread and the clients it drives
+typedef struct {
+    const LoadConfig* config;
+    HANDLE hThread;
+    LoadClient* clients;
+    int count;
+    int nextOpen;                   // -idle: next client allowed to connect
+    WSAEVENT sockEvent;             // shared by the TCP sockets of all its clients
+    Histogram hist[LOAD_OPS];
+    LONGLONG errors;
+    LONGLONG bytesReceived;
+    int local;                      // clients that talked over the local transport
+} LoadThread;
+
+static volatile LONG g_LoadStop = 0;
+static volatile LONG g_LoadConnected = 0;  // clients with their session up right now
+static volatile LONG g_LoadSettled = 0;    // -idle: sessions opened or given up
+
+static int HistogramIndex(LONGLONG value) {
+    int shift = 0;
+    if (value < 0)
+        value = 0;
+    while ((value >> shift) >= 2 * HIST_SUB_BUCKETS && shift < 38)
+        shift++;
+    if ((value >> shift) >= 2 * HIST_SUB_BUCKETS)
+        return HIST_BUCKETS - 1;
+    return shift * HIST_SUB_BUCKETS + (int)(value >> shift);
+}
+
+// Highest value that falls into the bucket
+static LONGLONG HistogramValue(int index) {
+    int shift;
+    if (index < 2 * HIST_SUB_BUCKETS)
+        return index;
+    shift = index / HIST_SUB_BUCKETS - 1;
+    return (((LONGLONG)(index - shift * HIST_SUB_BUCKETS) + 1) << shift) - 1;
+}
+
+static void HistogramRecord(Histogram* h, LONGLONG value) {
+    h->counts[HistogramIndex(value)]++;
+    h->total++;
+    if (value > h->max)
+        h->max = value;
+}
+
+static void HistogramMerge(Histogram* into, const Histogram* from) {
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++)
+        into->counts[i] += from->counts[i];
+    into->total += from->total;
+    if (from->max > into->max)
+        into->max = from->max;
+}
+
+static LONGLONG HistogramPercentile(const Histogram* h, double percentile) {
+    LONGLONG rank = (LONGLONG)(h->total * percentile / 100.0 + 0.5);
+    LONGLONG seen = 0;
+    int i;
+    if (rank < 1)
+        rank = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank)
+            return HistogramValue(i) < h->max ? HistogramValue(i) : h->max;
+    }
+    return h->max;
+}
+
+static LONGLONG ElapsedMicroseconds(const LARGE_INTEGER* start) {
+    LARGE_INTEGER now, frequency;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+    return (now.QuadPart - start->QuadPart) * 1000000 / frequency.QuadPart;
+}
+
+// Feed received bytes to the marker search; TRUE once all of it arrived.
+// Restarting at the first character is enough: it occurs only once in the
+// "RCLOAD<n>\r\n" markers.
+static BOOL MarkerScan(const char* marker, int* matched, const char* data, int length) {
+    int i;
+
+    for (i = 0; i < length; i++) {
+        if (data[i] == marker[*matched])
+            (*matched)++;
+        else
+            *matched = data[i] == marker[0];
+        if (marker[*matched] == '\0')
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static void LoadClientClose(LoadClient* client) {
+    if (client->counted) {
+        InterlockedDecrement(&g_LoadConnected);
+        client->counted = FALSE;
+    }
+    if (client->link != NULL) {
+        LinkSend(client->link, "exit\r\n", 6);
+        LinkClose(client->link);
+        HeapFree(GetProcessHeap(), 0, client->link);
+        client->link = NULL;
+    }
+    if (client->sock != INVALID_SOCKET) {
+        closesocket(client->sock);
+        client->sock = INVALID_SOCKET;
+    }
+    client->state = LOAD_CLOSED;
+}
+
+// -idle: one more session may start connecting
+static void LoadIdleOpenNext(LoadThread* thread, ULONGLONG now) {
+    if (thread->nextOpen < thread->count)
+        thread->clients[thread->nextOpen++].due = now;
+}
+
+// No answer or a broken connection: -storm tries again shortly, everyone
+// else gives up
+static void LoadClientFailed(LoadThread* thread, LoadClient* client, ULONGLONG now) {
+    BOOL opening = client->state == LOAD_START || client->state == LOAD_WAIT;
+
+    thread->errors++;
+    LoadClientClose(client);
+    if (thread->config->storm) {
+        client->state = LOAD_START;
+        client->due = now + 10;
+    } else if (thread->config->idle && opening) {
+        InterlockedIncrement(&g_LoadSettled);
+        LoadIdleOpenNext(thread, now);
+    }
+}
+
+// connect() itself blocks, as does asking for the local transport; waiting
+// for the shell is left to the pool loop
+static void LoadClientConnect(LoadThread* thread, LoadClient* client, ULONGLONG now) {
+    const LoadConfig* config = thread->config;
+
+    QueryPerformanceCounter(&client->start);
+    client->due = now + PROBE_TIMEOUT_MS;
+    client->matched = 0;
+    client->op = OP_CONNECT;
+
+    // Connection storm and idle sessions: wait for the shell's banner
+    if (config->storm || config->idle) {
+        client->sock = ConnectToServer(config->serverIP);
+        if (client->sock != INVALID_SOCKET &&
+            WSAEventSelect(client->sock, thread->sockEvent, FD_READ | FD_CLOSE) == 0) {
+            client->state = LOAD_WAIT;
+            return;
+        }
+        LoadClientFailed(thread, client, now);
+        return;
+    }
+
+    // Connected once the first command has been answered: includes
+    // spawning the session's shell
+    client->link = (ClientLink*)HeapAlloc(GetProcessHeap(), 0, sizeof(ClientLink));
+    if (client->link != NULL && LinkConnect(client->link, config->serverIP, !config->tcp, PROBE_TIMEOUT_MS) &&
+        (client->link->shared != NULL ||
+         WSAEventSelect(client->link->sock, thread->sockEvent, FD_READ | FD_CLOSE) == 0) &&
+        LinkSend(client->link, "echo RC^LOAD0\r\n", 15)) {
+        thread->local += client->link->shared != NULL;
+        strcpy(client->marker, "RCLOAD0\r\n");
+        client->state = LOAD_WAIT;
+        return;
+    }
+    LoadClientFailed(thread, client, now);
+}
+
+// The marker, or for -storm and -idle the banner, has arrived
+static void LoadClientAnswered(LoadThread* thread, LoadClient* client, ULONGLONG now) {
+    const LoadConfig* config = thread->config;
+
+    if (config->idle) {
+        InterlockedIncrement(&g_LoadConnected);
+        client->counted = TRUE;
+        client->state = LOAD_IDLE;
+        InterlockedIncrement(&g_LoadSettled);
+        LoadIdleOpenNext(thread, now);
+        return;
+    }
+    HistogramRecord(&thread->hist[client->op], ElapsedMicroseconds(&client->start));
+    if (config->storm) {
+        // Hang up and connect again right away
+        LoadClientClose(client);
+        client->state = LOAD_START;
+        client->due = now;
+        return;
+    }
+    if (client->op == OP_CONNECT) {
+        InterlockedIncrement(&g_LoadConnected);
+        client->counted = TRUE;
+        client->due = now;
+    } else {
+        client->due = now + config->thinkMs;
+    }
+    client->state = LOAD_THINK;
+}
+
+// Pick the next command from the mix
+static void LoadClientNextCommand(LoadThread* thread, LoadClient* client, ULONGLONG now) {
+    const LoadConfig* config = thread->config;
+    int weightSum = config->mix[0] + config->mix[1] + config->mix[2];
+    char line[LOAD_LINE_WIDTH + 1];
+    int pick;
+
+    if (weightSum <= 0) {
+        LoadClientClose(client);
+        return;
+    }
+    client->random = client->random * 1103515245 + 12345;
+    pick = (int)((client->random >> 8) % (ULONG)weightSum);
+    client->op = pick < config->mix[0] ? OP_ECHO :
+                 pick < config->mix[0] + config->mix[1] ? OP_DIR : OP_BURST;
+    client->sequence++;
+    sprintf(client->marker, "RCLOAD%d\r\n", client->sequence);
+
+    if (client->op == OP_ECHO) {
+        sprintf(client->command, "echo RC^LOAD%d", client->sequence);
+    } else if (client->op == OP_DIR) {
+        sprintf(client->command, "dir %%SystemRoot%% & echo RC^LOAD%d", client->sequence);
+    } else {
+        memset(line, 'x', LOAD_LINE_WIDTH);
+        line[LOAD_LINE_WIDTH] = '\0';
+        sprintf(client->command, "for /l %%i in (1,1,%d) do @echo %s",
+                config->burstKB * 1024 / (LOAD_LINE_WIDTH + 2), line);
+    }
+    client->typed = 0;
+    client->state = LOAD_TYPE;
+    client->due = now;
+}
+
+// Type the command the way a person does, one key per due time at -rate,
+// then press Enter. Bursts and -rate 0 go in one piece.
+static void LoadClientType(LoadThread* thread, LoadClient* client, ULONGLONG now) {
+    int keysPerSecond = thread->config->keysPerSecond;
+    int length = (int)strlen(client->command);
+    char enter[32];
+
+    if (keysPerSecond > 0 && client->op != OP_BURST && client->typed < length) {
+        if (!LinkSend(client->link, client->command + client->typed, 1)) {
+            LoadClientClose(client);
+            return;
+        }
+        client->typed++;
+        client->due = now + 1000 / keysPerSecond;
+        return;
+    }
+    if (client->typed < length &&
+        !LinkSend(client->link, client->command + client->typed, length - client->typed)) {
+        LoadClientClose(client);
+        return;
+    }
+
+    // The clock starts at Enter: typing time is the user's, not the server's
+    QueryPerformanceCounter(&client->start);
+    if (client->op == OP_BURST)
+        sprintf(enter, "\r\necho RC^LOAD%d\r\n", client->sequence);
+    else
+        strcpy(enter, "\r\n");
+    if (!LinkSend(client->link, enter, (int)strlen(enter))) {
+        LoadClientClose(client);
+        return;
+    }
+    client->matched = 0;
+    client->state = LOAD_WAIT;
+    client->due = now + PROBE_TIMEOUT_MS;
+}
+
+// Read whatever has arrived, without waiting
+static void LoadClientRead(LoadThread* thread, LoadClient* client, char* buffer, ULONGLONG now) {
+    const LoadConfig* config = thread->config;
+
+    while (client->link != NULL || client->sock != INVALID_SOCKET) {
+        int received = client->link != NULL ? LinkRecvNow(client->link, buffer, BUFSIZE)
+                                            : recv(client->sock, buffer, BUFSIZE, 0);
+        if (received == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK)
+            return;
+        if (received <= 0) {
+            if (client->state == LOAD_WAIT)
+                LoadClientFailed(thread, client, now);
+            else
+                LoadClientClose(client);
+            return;
+        }
+        thread->bytesReceived += received;
+        if (client->state != LOAD_WAIT)
+            continue;
+        // Like SO_RCVTIMEO: the timeout runs from the last data received
+        client->due = now + PROBE_TIMEOUT_MS;
+        if (config->storm || config->idle || MarkerScan(client->marker, &client->matched, buffer, received))
+            LoadClientAnswered(thread, client, now);
+    }
+}
+
+static void LoadClientTimer(LoadThread* thread, LoadClient* client, ULONGLONG now) {
+    switch (client->state) {
+        case LOAD_START: LoadClientConnect(thread, client, now); break;
+        case LOAD_WAIT:  LoadClientFailed(thread, client, now); break;     // timed out
+        case LOAD_THINK: LoadClientNextCommand(thread, client, now); break;
+        case LOAD_TYPE:  LoadClientType(thread, client, now); break;
+    }
+}
+
+// Pool thread: run the due timers, let every client read what it can,
+// then sleep until a socket or ring of one of its clients has data or the
+// next timer is due. TCP sockets share sockEvent; each local transport
+// client brings its ring's data event, which the read pass arms.
+static DWORD WINAPI LoadPoolThread(LPVOID lpParam) {
+    LoadThread* thread = (LoadThread*)lpParam;
+    HANDLE handles[MAXIMUM_WAIT_OBJECTS];
+    char buffer[BUFSIZE];
+    ULONGLONG now, next;
+    int count, i;
+
+    while (!g_LoadStop) {
+        now = GetTickCount64();
+        for (i = 0; i < thread->count && !g_LoadStop; i++) {
+            LoadClient* client = &thread->clients[i];
+            if (client->state != LOAD_CLOSED && client->state != LOAD_IDLE && client->due <= now)
+                LoadClientTimer(thread, client, now);
+        }
+
+        // Reset first: data arriving during the pass signals it again
+        WSAResetEvent(thread->sockEvent);
+        now = GetTickCount64();
+        for (i = 0; i < thread->count; i++)
+            LoadClientRead(thread, &thread->clients[i], buffer, now);
+
+        handles[0] = thread->sockEvent;
+        count = 1;
+        next = now + PROBE_TIMEOUT_MS;
+        for (i = 0; i < thread->count; i++) {
+            LoadClient* client = &thread->clients[i];
+            if (client->state == LOAD_CLOSED)
+                continue;
+            if (client->state != LOAD_IDLE && client->due < next)
+                next = client->due;
+            if (client->link != NULL && client->link->shared != NULL && count < MAXIMUM_WAIT_OBJECTS)
+                handles[count++] = client->link->events[LOCAL_CLIENT_DATA];
+        }
+        if (!g_LoadStop)
+            WaitForMultipleObjects(count, handles, FALSE, next > now ? (DWORD)(next - now) : 0);
+    }
+
+    for (i = 0; i < thread->count; i++)
+        LoadClientClose(&thread->clients[i]);
+    return 0;
+}
+
+// Spread the clients over as few pool threads as the wait limit allows:
+// on the local transport every client brings an event of its own
+static LoadThread* LoadPoolStart(const LoadConfig* config, int* threadCount) {
+    BOOL tcpOnly = config->tcp || config->storm || config->idle;
+    int perThread = tcpOnly ? LOAD_THREAD_SOCKETS : MAXIMUM_WAIT_OBJECTS - 1;
+    int count = (config->clients + perThread - 1) / perThread;
+    int share = (config->clients + count - 1) / count;
+    ULONGLONG now = GetTickCount64();
+    LoadThread* threads;
+    LoadClient* clients;
+    int i, t;
+
+    threads = (LoadThread*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, count * sizeof(LoadThread));
+    clients = (LoadClient*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, config->clients * sizeof(LoadClient));
+    if (threads == NULL || clients == NULL) {
+        if (threads) HeapFree(GetProcessHeap(), 0, threads);
+        if (clients) HeapFree(GetProcessHeap(), 0, clients);
+        return NULL;
+    }
+
+    for (i = 0; i < config->clients; i++) {
+        clients[i].state = LOAD_START;
+        clients[i].sock = INVALID_SOCKET;
+        clients[i].random = 2166136261u ^ (ULONG)i;
+        // -idle opens a few sessions at a time per thread
+        clients[i].due = config->idle && i % share >= LOAD_IDLE_OPENING ? MAXULONGLONG : now;
+    }
+    for (t = 0; t < count; t++) {
+        LoadThread* thread = &threads[t];
+        thread->config = config;
+        thread->clients = clients + t * share;
+        thread->count = config->clients - t * share < share ? config->clients - t * share : share;
+        if (thread->count < 0)
+            thread->count = 0;
+        thread->nextOpen = config->idle && thread->count > LOAD_IDLE_OPENING ? LOAD_IDLE_OPENING : thread->count;
+        thread->sockEvent = WSACreateEvent();
+        if (thread->sockEvent != WSA_INVALID_EVENT)
+            thread->hThread = CreateThread(NULL, 0, LoadPoolThread, thread, 0, NULL);
+        if (thread->hThread == NULL) {
+            // Its clients never start: count them as given up
+            thread->errors += thread->count;
+            InterlockedExchangeAdd(&g_LoadSettled, thread->count);
+        }
+    }
+    *threadCount = count;
+    return threads;
+}
+
+// Stop the pool and wait for its threads; their clients hang up
+static void LoadPoolStop(LoadThread* threads, int count) {
+    int t;
+
+    InterlockedExchange(&g_LoadStop, 1);
+    for (t = 0; t < count; t++) {
+        if (threads[t].sockEvent != WSA_INVALID_EVENT)
+            WSASetEvent(threads[t].sockEvent);
+    }
+    for (t = 0; t < count; t++) {
+        if (threads[t].hThread != NULL) {
+            WaitForSingleObject(threads[t].hThread, INFINITE);
+            CloseHandle(threads[t].hThread);
+        }
+        if (threads[t].sockEvent != WSA_INVALID_EVENT)
+            WSACloseEvent(threads[t].sockEvent);
+    }
+}
+
+static void LoadPoolFree(LoadThread* threads) {
+    HeapFree(GetProcessHeap(), 0, threads[0].clients);
+    HeapFree(GetProcessHeap(), 0, threads);
+}
+
+// Owner of a listening socket on port, 0 if not found. A dual-stack
+// server only shows up in the IPv6 table.
+static DWORD FindServerProcessId(int port) {
+    ULONG families[2] = { AF_INET, AF_INET6 };
+    void* table;
+    DWORD size, pid = 0, i;
+    int f;
+
+    for (f = 0; f < 2 && pid == 0; f++) {
+        size = 0;
+        if (GetExtendedTcpTable(NULL, &size, FALSE, families[f], TCP_TABLE_OWNER_PID_LISTENER, 0) != ERROR_INSUFFICIENT_BUFFER)
+            continue;
+        table = HeapAlloc(GetProcessHeap(), 0, size);
+        if (table == NULL)
+            return 0;
+        if (GetExtendedTcpTable(table, &size, FALSE, families[f], TCP_TABLE_OWNER_PID_LISTENER, 0) == NO_ERROR) {
+            if (families[f] == AF_INET) {
+                MIB_TCPTABLE_OWNER_PID* v4 = (MIB_TCPTABLE_OWNER_PID*)table;
+                for (i = 0; i < v4->dwNumEntries && pid == 0; i++)
+                    if (ntohs((u_short)v4->table[i].dwLocalPort) == port)
+                        pid = v4->table[i].dwOwningPid;
+            } else {
+                MIB_TCP6TABLE_OWNER_PID* v6 = (MIB_TCP6TABLE_OWNER_PID*)table;
+                for (i = 0; i < v6->dwNumEntries && pid == 0; i++)
+                    if (ntohs((u_short)v6->table[i].dwLocalPort) == port)
+                        pid = v6->table[i].dwOwningPid;
+            }
+        }
+        HeapFree(GetProcessHeap(), 0, table);
+    }
+    return pid;
+}
+
+static ULONGLONG ProcessCpuTime(HANDLE hProcess) {
+    FILETIME created, exited, kernel, user;
+    ULARGE_INTEGER k, u;
+    if (!GetProcessTimes(hProcess, &created, &exited, &kernel, &user))
+        return 0;
+    k.LowPart = kernel.dwLowDateTime; k.HighPart = kernel.dwHighDateTime;
+    u.LowPart = user.dwLowDateTime; u.HighPart = user.dwHighDateTime;
+    return k.QuadPart + u.QuadPart;     // 100 ns units
+}
+
+// -idle: hold config->clients sessions open without sending anything and
+// report what an idle session costs the server process. The shells are
+// separate processes and not part of the figure.
+static int RunIdleTest(const LoadConfig* config) {
+    PROCESS_MEMORY_COUNTERS_EX before, after;
+    HANDLE hServer = NULL;
+    LoadThread* threads;
+    DWORD serverPid;
+    char host[256];
+    char port[16];
+    int threadCount, opened, reported = 0;
+
+    ParseEndpoint(config->serverIP, host, sizeof(host), port, DEFAULT_PORT);
+    serverPid = FindServerProcessId(atoi(port));
+    if (serverPid != 0)
+        hServer = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, serverPid);
+    if (hServer == NULL) {
+        printf("Server process not found on this host: idle memory cannot be measured\n");
+        return 1;
+    }
+
+    printf("Idle: opening %d sessions on %s\n", config->clients, config->serverIP);
+    ZeroMemory(&before, sizeof(before));
+    GetProcessMemoryInfo(hServer, (PROCESS_MEMORY_COUNTERS*)&before, sizeof(before));
+    threads = LoadPoolStart(config, &threadCount);
+    if (threads == NULL) {
+        printf("Out of memory\n");
+        CloseHandle(hServer);
+        return 1;
+    }
+
+    // The shell's banner means a session is fully set up
+    while (g_LoadSettled < config->clients) {
+        Sleep(100);
+        if (g_LoadConnected / 1000 > reported) {
+            reported = g_LoadConnected / 1000;
+            printf("%d sessions open\n", reported * 1000);
+        }
+    }
+
+    // Let the server settle before sampling
+    Sleep((DWORD)config->seconds * 1000);
+    ZeroMemory(&after, sizeof(after));
+    opened = g_LoadConnected;
+    GetProcessMemoryInfo(hServer, (PROCESS_MEMORY_COUNTERS*)&after, sizeof(after));
+
+    printf("\nOpen sessions: %d of %d (%d client threads)\n", opened, config->clients, threadCount);
+    printf("Server pid %lu: private %.1f MB -> %.1f MB, working set %.1f MB -> %.1f MB\n", serverPid,
+           before.PrivateUsage / 1048576.0, after.PrivateUsage / 1048576.0,
+           before.WorkingSetSize / 1048576.0, after.WorkingSetSize / 1048576.0);
+    if (opened > 0)
+        printf("Per idle session: private %.2f KB, working set %.2f KB\n",
+               ((double)after.PrivateUsage - (double)before.PrivateUsage) / 1024.0 / opened,
+               ((double)after.WorkingSetSize - (double)before.WorkingSetSize) / 1024.0 / opened);
+
+    LoadPoolStop(threads, threadCount);
+    LoadPoolFree(threads);
+    CloseHandle(hServer);
+    return opened < config->clients ? 1 : 0;
+}
+
+// -coldstart: against a -ondemand server with no activated server running,
+// time the first connection up to the shell's first prompt, then do the
+// same again while the server is still up. The difference is what
+// activation costs the first user. Exit code 2 when the cold start is over
+// budgetMs.
+static int RunColdStartTest(const LoadConfig* config) {
+    static const char* names[2] = { "Cold", "Warm" };
+    double connectMs[2], promptMs[2];
+    LARGE_INTEGER start, connected, prompt, frequency;
+    ClientLink link;
+    int i;
+
+    QueryPerformanceFrequency(&frequency);
+    for (i = 0; i < 2; i++) {
+        // Plain TCP: the time to the prompt is what a user sees
+        QueryPerformanceCounter(&start);
+        if (!LinkConnect(&link, config->serverIP, FALSE, PROBE_TIMEOUT_MS)) {
+            printf("%s start: cannot connect to %s\n", names[i], config->serverIP);
+            return 1;
+        }
+        QueryPerformanceCounter(&connected);
+        if (!WaitForMarker(&link, ">", NULL)) {
+            printf("%s start: no prompt (%d)\n", names[i], WSAGetLastError());
+            LinkClose(&link);
+            return 1;
+        }
+        QueryPerformanceCounter(&prompt);
+        LinkSend(&link, "exit\r\n", 6);
+        LinkClose(&link);
+
+        connectMs[i] = (double)(connected.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+        promptMs[i] = (double)(prompt.QuadPart - start.QuadPart) * 1000.0 / frequency.QuadPart;
+        printf("%s start: connect %.2f ms, first prompt %.2f ms\n", names[i], connectMs[i], promptMs[i]);
+    }
+
+    printf("Activation overhead: %.2f ms (budget %.0f ms)\n", promptMs[0] - promptMs[1], config->budgetMs);
+    if (promptMs[0] > config->budgetMs) {
+        printf("Cold start over budget\n");
+        return 2;
+    }
+    return 0;
+}
+
+// -watchtest: watch a command that prints WATCH_TEST_LINES numbered lines,
+// more than FRAME_MAX_CONTROL in all, and check that the first update
+// arrives whole and reproduces every line
+static int RunWatchTest(const LoadConfig* config) {
+    char command[160];
+    char buffer[BUFSIZE * 4];
+    char expect[32];
+    char stop[FRAME_HEADER_SIZE];
+    FrameReader reader;
+    TextLine* lines = NULL;
+    char* text = NULL;
+    const char* payload = NULL;
+    DWORD textLen = 0, payloadLength = 0, timeout = PROBE_TIMEOUT_MS;
+    LARGE_INTEGER start;
+    SOCKET sock;
+    int magic = 0, received, used, type = 0, lineCount, i, result = 1;
+
+    sock = ConnectToServer(config->serverIP);
+    if (sock == INVALID_SOCKET) {
+        printf("Watch test: cannot connect to %s\n", config->serverIP);
+        return 1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    ZeroMemory(&reader, sizeof(reader));
+    reader.watchClient = TRUE;
+
+    _snprintf(command, sizeof(command), "for /l %%i in (1,1,%d) do @echo watch test line %%i %s",
+              WATCH_TEST_LINES, "--------------------------------------------");
+    QueryPerformanceCounter(&start);
+    if (!WatchSendRequest(sock, command, 60000)) {
+        printf("Watch test: cannot send the request\n");
+        goto done;
+    }
+    while (type != FRAME_WATCH_DIFF) {
+        received = recv(sock, buffer, sizeof(buffer), 0);
+        if (received <= 0) {
+            printf("Watch test: no update (%d)\n", WSAGetLastError());
+            goto done;
+        }
+        used = WatchSkipBanner(buffer, received, &magic);
+        while (used < received) {
+            used += FrameRead(&reader, buffer + used, received - used, &type, &payload, &payloadLength);
+            if (type < 0) {
+                printf("Watch test: malformed frame\n");
+                goto done;
+            }
+            if (type == FRAME_WATCH_END) {
+                printf("Watch test: watch ended: %.*s\n", (int)payloadLength, payload);
+                goto done;
+            }
+            if (type == FRAME_WATCH_DIFF)
+                break;
+        }
+    }
+
+    if (!WatchApply(&text, &textLen, NULL, 0, payload, payloadLength)) {
+        printf("Watch test: the first update does not apply to an empty view\n");
+        goto done;
+    }
+    lineCount = SplitLines(text, textLen, &lines);
+    printf("Watch test: first update %lu bytes after %.2f ms, %lu bytes of text in %d lines\n",
+           payloadLength, ElapsedMicroseconds(&start) / 1000.0, textLen, lineCount);
+    for (i = 0; i < lineCount; i++) {
+        int n = _snprintf(expect, sizeof(expect), "watch test line %d ", i + 1);
+        if (lines[i].length < (DWORD)n || memcmp(lines[i].text, expect, n) != 0)
             break;
-        } else {
-            int error = WSAGetLastError();
-            if (error != WSAEWOULDBLOCK) {
-                printf("Recv failed: %d\n", error);
+    }
+    if (lineCount != WATCH_TEST_LINES || i != lineCount) {
+        printf("Watch test failed: expected %d lines, line %d differs\n", WATCH_TEST_LINES, i + 1);
+    } else if (textLen <= FRAME_MAX_CONTROL) {
+        printf("Watch test failed: the output is too short to test anything\n");
+    } else {
+        printf("Watch test passed\n");
+        result = 0;
+    }
+    FrameHeader(stop, FRAME_WATCH_STOP, 0);
+    SendAll(sock, stop, FRAME_HEADER_SIZE);
+
+done:
+    FrameReaderFree(&reader);
+    if (lines) HeapFree(GetProcessHeap(), 0, lines);
+    if (text) HeapFree(GetProcessHeap(), 0, text);
+    closesocket(sock);
+    return result;
+}
+
+// One scripted exchange for -predicttest: type a line, press Enter, type
+// the rest of the next line, then the "server" answers with reply. The
+// rows are what the screen shows from the typed line down afterwards.
+typedef struct {
+    const char* name;
+    const char* typed;
+    const char* pending;
+    const char* reply;
+    DWORD confirmed;
+    DWORD rolledBack;
+    const char* rows[3];        // NULL: not checked
+} PredictCase;
+
+static const PredictCase g_PredictCases[] = {
+    { "confirmed echo",   "echo abc", "",   "echo abc\r\n",             10, 0, { "echo abc", NULL, NULL } },
+    { "partial echo",     "echo abc", "",   "echo a",                    6, 0, { "echo abc", NULL, NULL } },
+    { "echo while typing", "dir",     "ab", "dir\r\n",                   5, 0, { "dir", "ab", NULL } },
+    { "misprediction",    "echo abc", "",   "echo abd\r\n",              7, 3, { "echo abd", NULL, NULL } },
+    { "unrelated output", "ver",      "xy", "\r\nMicrosoft Windows\r\n", 0, 5, { "   ", "Microsoft Windows", "xy" } },
+};
+
+// Type text into the predictor one key at a time, as the client loop does
+static void PredictTestType(EchoPredictor* p, const char* text) {
+    while (*text != '\0')
+        PredictorTypeChar(p, text++, 1);
+}
+
+static BOOL PredictTestShows(const EchoPredictor* p, COORD at, const char* text) {
+    char cells[BUFSIZE];
+    DWORD length = (DWORD)strlen(text), read = 0;
+
+    return ReadConsoleOutputCharacterA(p->hConsole, cells, length, at, &read) &&
+           read == length && memcmp(cells, text, length) == 0;
+}
+
+static BOOL RunPredictCase(EchoPredictor* p, const PredictCase* c, SHORT row) {
+    HANDLE hConsole = p->hConsole;
+    char out[BUFSIZE];
+    COORD at;
+    int i;
+
+    ZeroMemory(p, sizeof(EchoPredictor));
+    p->hConsole = hConsole;
+    at.X = 0;
+    at.Y = row;
+    SetConsoleCursorPosition(p->hConsole, at);
+
+    PredictTestType(p, c->typed);
+    PredictorCommitLine(p, out);
+    PredictTestType(p, c->pending);
+    if (!PredictTestShows(p, at, c->typed)) {
+        printf("Predict test, %s: the typed line is not on screen before the echo\n", c->name);
+        return FALSE;
+    }
+
+    PredictorOnServerData(p, c->reply, (int)strlen(c->reply));
+    if (p->confirmed != c->confirmed || p->rolledBack != c->rolledBack) {
+        printf("Predict test, %s: %lu bytes confirmed, %lu rolled back, expected %lu and %lu\n",
+               c->name, p->confirmed, p->rolledBack, c->confirmed, c->rolledBack);
+        return FALSE;
+    }
+    for (i = 0; i < 3; i++) {
+        at.Y = (SHORT)(row + i);
+        if (c->rows[i] != NULL && !PredictTestShows(p, at, c->rows[i])) {
+            printf("Predict test, %s: row %d does not show \"%s\"\n", c->name, i + 1, c->rows[i]);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// -predicttest: check the -predict echo predictor on a hidden screen
+// buffer. Scripted replies cover a confirmed echo, a partial one, an echo
+// arriving while the next line is typed, a misprediction and unrelated
+// output; each must confirm or roll back exactly the expected bytes and
+// leave the server's text on screen. Then PREDICT_TEST_LINES commands go
+// to the server through the predictor: every byte must be confirmed by
+// cmd.exe's echo, and the report compares when the typed line was shown
+// with when the echo and the output arrived.
+static int RunPredictTest(const LoadConfig* config) {
+    static const COORD size = { 120, 1000 };
+    HANDLE hConsole;
+    EchoPredictor predictor;
+    ClientLink link;
+    Utf8Stream utf8Stream;
+    char command[64];
+    char marker[32];
+    char out[BUFSIZE];
+    char buffer[BUFSIZE];
+    char utf8[UTF8_OUT_SIZE(BUFSIZE)];
+    char window[UTF8_OUT_SIZE(BUFSIZE) + 64];
+    double shownUs[PREDICT_TEST_LINES], echoMs[PREDICT_TEST_LINES], outputMs[PREDICT_TEST_LINES];
+    DWORD expected = 0;
+    LARGE_INTEGER typed, sent;
+    COORD at;
+    int count = sizeof(g_PredictCases) / sizeof(g_PredictCases[0]);
+    int windowLen, length, i, k, result = 1;
+
+    // Off screen, so the test neither shows nor scrolls what it types
+    hConsole = CreateConsoleScreenBuffer(GENERIC_READ | GENERIC_WRITE, 0, NULL, CONSOLE_TEXTMODE_BUFFER, NULL);
+    if (hConsole == INVALID_HANDLE_VALUE) {
+        printf("Predict test: needs a console (%lu)\n", GetLastError());
+        return 1;
+    }
+    SetConsoleScreenBufferSize(hConsole, size);
+    predictor.hConsole = hConsole;
+
+    for (i = 0; i < count; i++) {
+        if (!RunPredictCase(&predictor, &g_PredictCases[i], (SHORT)(i * 3)))
+            goto done;
+    }
+    printf("Predict test: %d scripted cases passed\n", count);
+
+    if (!LinkConnect(&link, config->serverIP, FALSE, PROBE_TIMEOUT_MS)) {
+        printf("Predict test: cannot connect to %s\n", config->serverIP);
+        goto done;
+    }
+    if (!WaitForMarker(&link, ">", NULL)) {
+        printf("Predict test: no prompt (%d)\n", WSAGetLastError());
+        goto close;
+    }
+
+    ZeroMemory(&predictor, sizeof(predictor));
+    predictor.hConsole = hConsole;
+    ZeroMemory(&utf8Stream, sizeof(utf8Stream));
+    at.X = 0;
+    at.Y = (SHORT)(count * 3);
+    SetConsoleCursorPosition(hConsole, at);
+
+    for (k = 0; k < PREDICT_TEST_LINES; k++) {
+        // The caret keeps the marker out of cmd.exe's echo, as in the latency probe
+        sprintf(command, "echo RC^PREDICT%d", k + 1);
+        sprintf(marker, "RCPREDICT%d\r\n", k + 1);
+
+        QueryPerformanceCounter(&typed);
+        PredictTestType(&predictor, command);
+        shownUs[k] = (double)ElapsedMicroseconds(&typed);
+        at = predictor.anchor;
+        length = PredictorCommitLine(&predictor, out);
+        expected += length;
+        QueryPerformanceCounter(&sent);
+        if (!LinkSend(&link, out, length)) {
+            printf("Predict test: send failed (%d)\n", WSAGetLastError());
+            goto close;
+        }
+
+        // Everything the server sends goes through the predictor, up to the
+        // command's output and the prompt after it
+        echoMs[k] = outputMs[k] = -1;
+        windowLen = 0;
+        for (;;) {
+            char* found;
+            int received = LinkRecv(&link, buffer, BUFSIZE);
+            if (received <= 0) {
+                printf("Predict test: no response to command %d (%d)\n", k + 1, WSAGetLastError());
+                goto close;
+            }
+            length = Utf8Sanitize(&utf8Stream, buffer, received, utf8);
+            PredictorOnServerData(&predictor, utf8, length);
+            if (echoMs[k] < 0 && predictor.sentLen == 0)
+                echoMs[k] = ElapsedMicroseconds(&sent) / 1000.0;
+
+            // Keep just enough of the tail for a marker split across reads
+            if (windowLen > 32) {
+                memmove(window, window + windowLen - 32, 32);
+                windowLen = 32;
+            }
+            memcpy(window + windowLen, utf8, length);
+            windowLen += length;
+            window[windowLen] = '\0';
+            if (outputMs[k] < 0) {
+                found = strstr(window, marker);
+                if (found == NULL)
+                    continue;
+                outputMs[k] = ElapsedMicroseconds(&sent) / 1000.0;
+                found += strlen(marker);
+                windowLen -= (int)(found - window);
+                memmove(window, found, windowLen + 1);
+            }
+            if (memchr(window, '>', windowLen) != NULL)
                 break;
+        }
+        if (!PredictTestShows(&predictor, at, command)) {
+            printf("Predict test: command %d is not on screen after its echo\n", k + 1);
+            goto close;
+        }
+    }
+    LinkSend(&link, "exit\r\n", 6);
+
+    qsort(shownUs, PREDICT_TEST_LINES, sizeof(double), CompareDouble);
+    qsort(echoMs, PREDICT_TEST_LINES, sizeof(double), CompareDouble);
+    qsort(outputMs, PREDICT_TEST_LINES, sizeof(double), CompareDouble);
+    printf("Typed line on screen: p50 %.1f us, max %.1f us\n",
+           shownUs[(PREDICT_TEST_LINES - 1) / 2], shownUs[PREDICT_TEST_LINES - 1]);
+    printf("Server echo: p50 %.2f ms, p99 %.2f ms; output: p50 %.2f ms, p99 %.2f ms\n",
+           echoMs[(PREDICT_TEST_LINES - 1) / 2], echoMs[(PREDICT_TEST_LINES - 1) * 99 / 100],
+           outputMs[(PREDICT_TEST_LINES - 1) / 2], outputMs[(PREDICT_TEST_LINES - 1) * 99 / 100]);
+    printf("Predictive echo: %lu bytes confirmed, %lu bytes rolled back\n",
+           predictor.confirmed, predictor.rolledBack);
+    if (predictor.confirmed != expected || predictor.rolledBack != 0) {
+        printf("Predict test failed: expected all %lu typed bytes to be confirmed\n", expected);
+    } else {
+        printf("Predict test passed\n");
+        result = 0;
+    }
+
+close:
+    LinkClose(&link);
+done:
+    CloseHandle(hConsole);
+    return result;
+}
+
+// -transcodetest text in codePage: runs of ASCII with line breaks between
+// runs of the code page's other characters, mostly ASCII as in shell
+// output. utf8 gets the same text as UTF-8. Returns the length of oem.
+static int TranscodeTestText(UINT codePage, ULONG random, char* oem, int size, char* utf8, int* utf8Len) {
+    // Cyrillic, box drawing, kana, CJK: each code page has some of them
+    static const WCHAR bases[4] = { 0x0410, 0x2500, 0x3041, 0x4E00 };
+    static const int spans[4] = { 64, 128, 83, 4096 };
+    int length = 0, run = 0, n;
+    BOOL ascii = TRUE;
+
+    *utf8Len = 0;
+    while (length + 4 <= size) {
+        WCHAR wc;
+        char mb[4];
+        BOOL usedDefault = FALSE;
+
+        random = random * 1103515245 + 12345;
+        if (run == 0) {
+            ascii = !ascii;
+            run = 1 + (int)((random >> 8) % (ascii ? 48 : 6));
+            continue;
+        }
+        run--;
+        if (ascii && (random >> 20) % 40 == 0) {
+            memcpy(oem + length, "\r\n", 2);
+            memcpy(utf8 + *utf8Len, "\r\n", 2);
+            length += 2;
+            *utf8Len += 2;
+            continue;
+        }
+        if (ascii) {
+            wc = (WCHAR)(0x20 + (random >> 8) % 95);
+        } else {
+            n = (int)((random >> 8) % 4);
+            wc = (WCHAR)(bases[n] + (random >> 12) % spans[n]);
+        }
+        n = WideCharToMultiByte(codePage, WC_NO_BEST_FIT_CHARS, &wc, 1, mb, sizeof(mb), NULL, &usedDefault);
+        if (n <= 0 || usedDefault)
+            continue;
+        memcpy(oem + length, mb, n);
+        length += n;
+        *utf8Len += WideCharToMultiByte(CP_UTF8, 0, &wc, 1, utf8 + *utf8Len, 4, NULL, NULL);
+    }
+    return length;
+}
+
+// Transcode shell output (or client input) in chunks of 1..maxChunk
+// bytes, or of exactly maxChunk when random is NULL
+static int TranscodeTestRun(UINT codePage, BOOL input, const char* in, int length, char* out,
+                            int maxChunk, ULONG* random) {
+    OutputTranscoder output;
+    InputTranscoder inputTranscoder;
+    int i = 0, o = 0, chunk = maxChunk;
+
+    OutputTranscoderInit(&output, codePage);
+    ZeroMemory(&inputTranscoder, sizeof(inputTranscoder));
+    inputTranscoder.codePage = codePage;
+    while (i < length) {
+        if (random != NULL) {
+            *random = *random * 1103515245 + 12345;
+            chunk = 1 + (int)((*random >> 8) % (ULONG)maxChunk);
+        }
+        if (chunk > length - i)
+            chunk = length - i;
+        if (input)
+            o += TranscodeInput(&inputTranscoder, in + i, chunk, out + o);
+        else
+            o += TranscodeOutput(&output, in + i, chunk, out + o);
+        i += chunk;
+    }
+    return o;
+}
+
+static BOOL TranscodeTestSame(const char* what, const char* got, int gotLen, const char* expect, int expectLen) {
+    int i = 0;
+
+    while (i < gotLen && i < expectLen && got[i] == expect[i])
+        i++;
+    if (i == gotLen && i == expectLen)
+        return TRUE;
+    printf("Transcode test failed: %s differs at byte %d (%d bytes, expected %d)\n", what, i, gotLen, expectLen);
+    return FALSE;
+}
+
+// -transcodetest: for the OEM code page, 866 and 932 (where installed)
+// build mixed text and push it through both directions with the SSE2 and
+// the scalar ASCII scan. Small random chunks cut characters and leave DBCS
+// lead bytes at chunk ends; BUFSIZE chunks are what the relay uses. Every
+// result must equal the text converted character by character. Then each
+// scan is timed on BUFSIZE chunks.
+static int RunTranscodeTest(const LoadConfig* config) {
+    static const char* names[2] = { "SSE2", "scalar" };
+    static const int chunks[2] = { 17, BUFSIZE };
+    UINT codePages[3];
+    char* oem;
+    char* utf8;
+    char* out;
+    char what[96];
+    double mbPerSecond[2][2];
+    LARGE_INTEGER start;
+    ULONG random;
+    int oemLen, utf8Len, length, count = 0, c, scan, input, k, result = 1;
+
+    codePages[count++] = GetOEMCP();
+    if (codePages[0] != 866 && IsValidCodePage(866))
+        codePages[count++] = 866;
+    if (codePages[0] != 932 && IsValidCodePage(932))
+        codePages[count++] = 932;
+
+    oem = (char*)HeapAlloc(GetProcessHeap(), 0, TRANSCODE_TEST_SIZE);
+    utf8 = (char*)HeapAlloc(GetProcessHeap(), 0, UTF8_OUT_SIZE(TRANSCODE_TEST_SIZE));
+    out = (char*)HeapAlloc(GetProcessHeap(), 0, UTF8_OUT_SIZE(TRANSCODE_TEST_SIZE));
+    if (oem == NULL || utf8 == NULL || out == NULL) {
+        printf("Out of memory\n");
+        goto done;
+    }
+#ifndef HAVE_SSE2
+    printf("Built without SSE2: both runs use the scalar scan\n");
+#endif
+
+    for (c = 0; c < count; c++) {
+        oemLen = TranscodeTestText(codePages[c], 2166136261u ^ codePages[c], oem, TRANSCODE_TEST_SIZE, utf8, &utf8Len);
+        for (scan = 0; scan < 2; scan++) {
+            g_TranscodeScalar = scan == 1;
+            for (input = 0; input < 2; input++) {
+                for (k = 0; k < 2; k++) {
+                    random = (ULONG)k;
+                    length = TranscodeTestRun(codePages[c], input, input ? utf8 : oem, input ? utf8Len : oemLen,
+                                              out, chunks[k], &random);
+                    _snprintf(what, sizeof(what), "code page %u %s, %s scan, chunks up to %d",
+                              codePages[c], input ? "input" : "output", names[scan], chunks[k]);
+                    if (!TranscodeTestSame(what, out, length, input ? oem : utf8, input ? oemLen : utf8Len))
+                        goto done;
+                }
+
+                QueryPerformanceCounter(&start);
+                for (k = 0; k < TRANSCODE_TEST_ROUNDS; k++)
+                    TranscodeTestRun(codePages[c], input, input ? utf8 : oem, input ? utf8Len : oemLen,
+                                     out, BUFSIZE, NULL);
+                // Bytes per microsecond are MB/s
+                mbPerSecond[input][scan] = (double)(input ? utf8Len : oemLen) * TRANSCODE_TEST_ROUNDS /
+                                           (double)(ElapsedMicroseconds(&start) + 1);
             }
         }
+        printf("Code page %u: %d bytes, %d as UTF-8\n", codePages[c], oemLen, utf8Len);
+        printf("  output: SSE2 %.0f MB/s, scalar %.0f MB/s\n", mbPerSecond[0][0], mbPerSecond[0][1]);
+        printf("  input:  SSE2 %.0f MB/s, scalar %.0f MB/s\n", mbPerSecond[1][0], mbPerSecond[1][1]);
+    }
+    printf("Transcode test passed\n");
+    result = 0;
 
-        Sleep(10); // Small delay
+done:
+    g_TranscodeScalar = FALSE;
+    if (oem) HeapFree(GetProcessHeap(), 0, oem);
+    if (utf8) HeapFree(GetProcessHeap(), 0, utf8);
+    if (out) HeapFree(GetProcessHeap(), 0, out);
+    return result;
+}
+
+// -logtest: time LOG_VAL on this thread against LOG_BUDGET_NS. Events go
+// through the real log thread to NUL. Each burst fills half of the ring
+// and the test waits for the log thread to empty it before the next, so
+// every call is queued instead of being dropped. Exit code 2 when the
+// median burst is over budget per call.
+static int RunLogTest(const LoadConfig* config) {
+    double perCall[LOG_TEST_BURSTS];
+    LARGE_INTEGER start, end, frequency;
+    LogRing* ring;
+    LONG dropped;
+    int burst, i;
+
+    if (!LogInit("NUL")) {
+        printf("Log test: cannot start the logger (%lu)\n", GetLastError());
+        return 1;
+    }
+    QueryPerformanceFrequency(&frequency);
+    // The first event allocates this thread's ring: keep it out of the timing
+    LOG_VAL(LOG_INFO, "log test", "bursts", LOG_TEST_BURSTS);
+    ring = LogGetRing();
+    if (ring == NULL) {
+        printf("Log test: no log ring\n");
+        LogShutdown();
+        return 1;
     }
 
-    // Cleanup
-    closesocket(connectSocket);
+    for (burst = 0; burst < LOG_TEST_BURSTS; burst++) {
+        while (ring->tail != ring->head)
+            Sleep(1);
+        QueryPerformanceCounter(&start);
+        for (i = 0; i < LOG_RING_SIZE / 2; i++)
+            LOG_VAL(LOG_INFO, "log test event", "n", i);
+        QueryPerformanceCounter(&end);
+        perCall[burst] = (double)(end.QuadPart - start.QuadPart) * 1e9 / frequency.QuadPart / (LOG_RING_SIZE / 2);
+    }
+    dropped = ring->dropped;
+    LogShutdown();
+
+    qsort(perCall, LOG_TEST_BURSTS, sizeof(double), CompareDouble);
+    printf("LOG_VAL over %d events: p50 %.1f ns, p99 %.1f ns, max %.1f ns per call (budget %d ns)\n",
+           LOG_TEST_BURSTS * LOG_RING_SIZE / 2, perCall[(LOG_TEST_BURSTS - 1) / 2],
+           perCall[(LOG_TEST_BURSTS - 1) * 99 / 100], perCall[LOG_TEST_BURSTS - 1], LOG_BUDGET_NS);
+    if (dropped > 0) {
+        printf("Log test: %ld events dropped, the log thread fell behind\n", dropped);
+        return 1;
+    }
+    if (perCall[(LOG_TEST_BURSTS - 1) / 2] > LOG_BUDGET_NS) {
+        printf("Logging hot path over budget\n");
+        return 2;
+    }
+    return 0;
+}
+
+int RunLoadTest(const LoadConfig* config) {
+    WSADATA wsaData;
+    LoadThread* threads;
+    Histogram* total;
+    HANDLE hServer = NULL;
+    PROCESS_MEMORY_COUNTERS_EX baseline, memory;
+    DWORD serverPid;
+    ULONGLONG cpuStart = 0;
+    LARGE_INTEGER start;
+    LONGLONG elapsedUs, errors = 0, bytes = 0;
+    int localClients = 0, connected = 0;
+    double echoP99 = 0;
+    char host[256];
+    char port[16];
+    int threadCount, i, op;
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
+        printf("WSAStartup failed\n");
+        return 1;
+    }
+    if (config->idle) {
+        i = RunIdleTest(config);
+        WSACleanup();
+        return i;
+    }
+    if (config->coldStart) {
+        i = RunColdStartTest(config);
+        WSACleanup();
+        return i;
+    }
+    if (config->watchTest) {
+        i = RunWatchTest(config);
+        WSACleanup();
+        return i;
+    }
+    if (config->predictTest) {
+        i = RunPredictTest(config);
+        WSACleanup();
+        return i;
+    }
+    if (config->transcodeTest) {
+        i = RunTranscodeTest(config);
+        WSACleanup();
+        return i;
+    }
+    if (config->logTest) {
+        i = RunLogTest(config);
+        WSACleanup();
+        return i;
+    }
+
+    total = (Histogram*)HeapAlloc(GetProcessHeap(), HEAP_ZERO_MEMORY, LOAD_OPS * sizeof(Histogram));
+    if (total == NULL) {
+        printf("Out of memory\n");
+        WSACleanup();
+        return 1;
+    }
+
+    ParseEndpoint(config->serverIP, host, sizeof(host), port, DEFAULT_PORT);
+    serverPid = FindServerProcessId(atoi(port));
+    if (serverPid != 0)
+        hServer = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, serverPid);
+    // Baseline before any client connects, as in RunIdleTest()
+    ZeroMemory(&baseline, sizeof(baseline));
+    if (hServer != NULL) {
+        cpuStart = ProcessCpuTime(hServer);
+        GetProcessMemoryInfo(hServer, (PROCESS_MEMORY_COUNTERS*)&baseline, sizeof(baseline));
+    }
+
+    if (config->storm)
+        printf("Connection storm: %d clients on %s for %d s\n", config->clients, config->serverIP, config->seconds);
+    else
+        printf("Load: %d clients on %s for %d s, %d keys/s, mix echo %d / dir %d / burst %d (%d KB)\n",
+               config->clients, config->serverIP, config->seconds, config->keysPerSecond,
+               config->mix[0], config->mix[1], config->mix[2], config->burstKB);
+
+    QueryPerformanceCounter(&start);
+    threads = LoadPoolStart(config, &threadCount);
+    if (threads == NULL) {
+        printf("Out of memory\n");
+        HeapFree(GetProcessHeap(), 0, total);
+        WSACleanup();
+        return 1;
+    }
+
+    Sleep((DWORD)config->seconds * 1000);
+    // Memory is sampled while the clients are still connected
+    ZeroMemory(&memory, sizeof(memory));
+    connected = g_LoadConnected;
+    if (hServer != NULL)
+        GetProcessMemoryInfo(hServer, (PROCESS_MEMORY_COUNTERS*)&memory, sizeof(memory));
+    LoadPoolStop(threads, threadCount);
+    for (i = 0; i < threadCount; i++) {
+        for (op = 0; op < LOAD_OPS; op++)
+            HistogramMerge(&total[op], &threads[i].hist[op]);
+        errors += threads[i].errors;
+        bytes += threads[i].bytesReceived;
+        localClients += threads[i].local;
+    }
+    elapsedUs = ElapsedMicroseconds(&start);
+
+    printf("\n%-8s %9s %10s %10s %10s %10s\n", "op", "count", "p50 ms", "p99 ms", "p99.9 ms", "max ms");
+    for (op = 0; op < LOAD_OPS; op++) {
+        if (total[op].total == 0)
+            continue;
+        printf("%-8s %9lld %10.2f %10.2f %10.2f %10.2f\n", g_LoadOpNames[op], total[op].total,
+               HistogramPercentile(&total[op], 50.0) / 1000.0,
+               HistogramPercentile(&total[op], 99.0) / 1000.0,
+               HistogramPercentile(&total[op], 99.9) / 1000.0,
+               total[op].max / 1000.0);
+    }
+    printf("\nErrors: %lld, received %.1f MB (%.2f MB/s)\n", errors,
+           bytes / 1048576.0, bytes / 1048576.0 * 1000000.0 / elapsedUs);
+    if (!config->storm)
+        printf("Transport: %d of %d clients over shared memory, the rest over TCP\n", localClients, config->clients);
+    if (config->storm)
+        printf("Connections: %.1f per second\n", total[OP_CONNECT].total * 1000000.0 / elapsedUs);
+
+    if (hServer != NULL) {
+        double cpu = (double)(ProcessCpuTime(hServer) - cpuStart) / 10.0 / elapsedUs * 100.0;
+        printf("Server pid %lu: CPU %.1f%% of one core, working set %.1f MB (peak %.1f MB), private %.1f MB\n",
+               serverPid, cpu, memory.WorkingSetSize / 1048576.0,
+               memory.PeakWorkingSetSize / 1048576.0, memory.PrivateUsage / 1048576.0);
+        if (!config->storm && connected > 0)
+            printf("Server private memory per connected client: %.1f KB (%d connected)\n",
+                   ((double)memory.PrivateUsage - (double)baseline.PrivateUsage) / 1024.0 / connected, connected);
+        CloseHandle(hServer);
+    } else {
+        printf("Server process not found on this host: CPU and memory not reported\n");
+    }
+
+    if (total[OP_ECHO].total > 0)
+        echoP99 = HistogramPercentile(&total[OP_ECHO], 99.0) / 1000.0;
+
+    HeapFree(GetProcessHeap(), 0, total);
+    LoadPoolFree(threads);
     WSACleanup();
-    printf("Client disconnected.\n");
+
+    if (errors > 0)
+        return 1;
+    if (config->p99BudgetMs > 0 && echoP99 > config->p99BudgetMs) {
+        printf("echo p99 %.2f ms exceeds budget %.2f ms\n", echoP99, config->p99BudgetMs);
+        return 2;
+    }
+    return 0;
 }
 
 // Service Management Functions
-void InstallService(void) {
+void InstallService(BOOL onDemand) {
     SC_HANDLE schSCManager;
     SC_HANDLE schService;
     TCHAR szPath[MAX_PATH];
@@ -438,7 +7424,7 @@ void InstallService(void) {
     }
 
     // Append service argument
-    _tcscat_s(szPath, MAX_PATH, TEXT(" -s -service"));
+    _tcscat_s(szPath, MAX_PATH, onDemand ? TEXT(" -s -service -ondemand") : TEXT(" -s -service"));
 
     schSCManager = OpenSCManager(NULL, NULL, SC_MANAGER_ALL_ACCESS);
     if (NULL == schSCManager) {
@@ -568,7 +7554,10 @@ VOID WINAPI ServiceMain(DWORD argc, LPTSTR *argv) {
     // Start the service
     SetServiceStatus(SERVICE_RUNNING, NO_ERROR, 0);
     
-    RunServer(TRUE);
+    if (g_OnDemand)
+        RunOnDemand(TRUE);
+    else
+        RunServer(TRUE);
 
     SetServiceStatus(SERVICE_STOPPED, NO_ERROR, 0);
 }
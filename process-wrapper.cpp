@@ -31,7 +31,7 @@ void ProcessWrapper::CreatePipes() {
     saAttr.lpSecurityDescriptor = NULL;
 
     // Create pipe for child's STDOUT
-    if (!CreatePipe(&m_hChildStd_OUT_Rd, &m_hChildStd_OUT_Wr, &saAttr, 0)) {
+    if (!CreatePipe(&m_hChildStd_OUT_Rd, &m_hChildStd_OUT_Wr, &saAttr, kPipeBufferSize)) {
         throw std::runtime_error("Failed to create stdout pipe");
     }
     
@@ -163,21 +163,18 @@ std::string ProcessWrapper::ReadFromStdout(size_t maxBytes) {
         return "";
     }
 
-    // Limit read size
+    // Read what is there in one call instead of fixed small chunks
+    if (maxBytes == 0) {
+        maxBytes = kMaxReadSize;
+    }
     DWORD bytesToRead = (bytesAvailable < maxBytes) ? bytesAvailable : (DWORD)maxBytes;
     
-    char* buffer = new char[bytesToRead + 1];
+    std::string result(bytesToRead, '\0');
     DWORD bytesRead = 0;
     
-    BOOL bSuccess = ReadFile(m_hChildStd_OUT_Rd, buffer, bytesToRead, &bytesRead, NULL);
-    
-    std::string result;
-    if (bSuccess && bytesRead > 0) {
-        buffer[bytesRead] = '\0';
-        result = std::string(buffer, bytesRead);
-    }
+    BOOL bSuccess = ReadFile(m_hChildStd_OUT_Rd, &result[0], bytesToRead, &bytesRead, NULL);
     
-    delete[] buffer;
+    result.resize(bSuccess ? bytesRead : 0);
     return result;
 }
 
@@ -24,6 +24,9 @@ private:
     void ClosePipes();
 
 public:
+    static const DWORD kPipeBufferSize = 64 * 1024;     // stdout pipe capacity hint
+    static const size_t kMaxReadSize = 256 * 1024;      // ReadFromStdout() default cap
+
     ProcessWrapper();
     ~ProcessWrapper();
 
@@ -38,8 +41,9 @@ public:
     bool WriteToStdin(const std::string& data);
     bool WriteToStdin(const char* data, size_t length);
     
-    // Read data from child process stdout (non-blocking)
-    std::string ReadFromStdout(size_t maxBytes = 4096);
+    // Read data from child process stdout (non-blocking). By default
+    // returns everything already in the pipe, up to kMaxReadSize.
+    std::string ReadFromStdout(size_t maxBytes = 0);
     
     // Check if data is available to read
     bool IsDataAvailable(DWORD& bytesAvailable);